@@ -0,0 +1,382 @@
+#include "bloom.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// The first level is a quarter of the canvas size. The glow is soft
+// anyway, and the pyramid's memory traffic is then small next to that of
+// the canvas itself.
+static const int kFirstLevelShift = 2;
+static const int kBlockSize = 1 << kFirstLevelShift;
+// Canvas pixels per tile side. Level l tiles are
+// kTileSize >> (l + kFirstLevelShift) texels on a side, so a tile covers the
+// same canvas area on every level.
+static const int kTileSize = 64;
+static const int kBlurRadius = 2;
+// Two box passes reach 2*kBlurRadius texels, which on the coarsest level,
+// plus its down- and upsampling, is under 192 canvas pixels.
+static const int kReachTiles = 3;
+
+// One texel, four floats wide, with the arithmetic the passes need.
+#ifdef __SSE2__
+typedef __m128 Texel;
+
+static inline Texel texel_zero() { return _mm_setzero_ps(); }
+static inline Texel texel_load(const float* p) { return _mm_loadu_ps(p); }
+static inline void texel_store(float* p, Texel t) { _mm_storeu_ps(p, t); }
+static inline Texel texel_add(Texel a, Texel b) { return _mm_add_ps(a, b); }
+static inline Texel texel_sub(Texel a, Texel b) { return _mm_sub_ps(a, b); }
+static inline Texel texel_scale(Texel a, float s) { return _mm_mul_ps(a, _mm_set1_ps(s)); }
+
+// The average of how far each pixel in a block, kBlockSize from each of
+// |rows|, is above |threshold|, per channel from 0 to 1, with alpha
+// cleared. Thresholding before averaging lets a lone bright pixel glow;
+// the other way round, anything under half a block wide never would.
+static inline Texel texel_bright(const uint32_t* const* rows, float threshold) {
+  __m128i zero = _mm_setzero_si128();
+  Texel scale = _mm_set1_ps(1.0f / 255);
+  Texel bias = _mm_set1_ps(threshold);
+  Texel sum = _mm_setzero_ps();
+  for (int i = 0; i < kBlockSize; i++) {
+    __m128i pixels = _mm_loadu_si128((const __m128i*)rows[i]);
+    __m128i low = _mm_unpacklo_epi8(pixels, zero);
+    __m128i high = _mm_unpackhi_epi8(pixels, zero);
+    __m128i wide[kBlockSize] = {_mm_unpacklo_epi16(low, zero), _mm_unpackhi_epi16(low, zero),
+                                _mm_unpacklo_epi16(high, zero), _mm_unpackhi_epi16(high, zero)};
+    for (int j = 0; j < kBlockSize; j++) {
+      Texel t = _mm_sub_ps(_mm_mul_ps(_mm_cvtepi32_ps(wide[j]), scale), bias);
+      sum = _mm_add_ps(sum, _mm_max_ps(t, _mm_setzero_ps()));
+    }
+  }
+  sum = _mm_mul_ps(sum, _mm_set1_ps(1.0f / (kBlockSize*kBlockSize)));
+  return _mm_and_ps(sum, _mm_castsi128_ps(_mm_setr_epi32(-1, -1, -1, 0)));
+}
+
+// |pixel| plus |glow|, already in 0-255 units, saturated per channel.
+static inline uint32_t texel_add_to_pixel(uint32_t pixel, Texel glow) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i wide = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(pixel), zero), zero);
+  __m128i sum = _mm_cvtps_epi32(_mm_add_ps(_mm_cvtepi32_ps(wide), glow));
+  __m128i packed = _mm_packs_epi32(sum, zero);
+  return _mm_cvtsi128_si32(_mm_packus_epi16(packed, zero));
+}
+#else
+struct Texel {
+  float v[4];
+};
+
+static inline Texel texel_zero() { return {{0, 0, 0, 0}}; }
+static inline Texel texel_load(const float* p) { return {{p[0], p[1], p[2], p[3]}}; }
+static inline void texel_store(float* p, Texel t) { memcpy(p, t.v, sizeof(t.v)); }
+static inline Texel texel_add(Texel a, Texel b) {
+  return {{a.v[0] + b.v[0], a.v[1] + b.v[1], a.v[2] + b.v[2], a.v[3] + b.v[3]}};
+}
+static inline Texel texel_sub(Texel a, Texel b) {
+  return {{a.v[0] - b.v[0], a.v[1] - b.v[1], a.v[2] - b.v[2], a.v[3] - b.v[3]}};
+}
+static inline Texel texel_scale(Texel a, float s) { return {{a.v[0] * s, a.v[1] * s, a.v[2] * s, a.v[3] * s}}; }
+
+static inline Texel texel_bright(const uint32_t* const* rows, float threshold) {
+  Texel t;
+  for (int c = 0; c < 3; c++) {
+    float sum = 0;
+    for (int i = 0; i < kBlockSize; i++) {
+      for (int j = 0; j < kBlockSize; j++) {
+        float val = ((rows[i][j] >> (c*8)) & 0xFF) * (1.0f / 255) - threshold;
+        sum += val > 0 ? val : 0;
+      }
+    }
+    t.v[c] = sum * (1.0f / (kBlockSize*kBlockSize));
+  }
+  t.v[3] = 0;
+  return t;
+}
+
+static inline uint32_t texel_add_to_pixel(uint32_t pixel, Texel glow) {
+  uint32_t out = 0;
+  for (int c = 0; c < 4; c++) {
+    int val = (int)(((pixel >> (c*8)) & 0xFF) + glow.v[c] + 0.5f);
+    out |= (uint32_t)(val < 0 ? 0 : (val > 255 ? 255 : val)) << (c*8);
+  }
+  return out;
+}
+#endif
+
+static inline int clamp_index(int i, int size) {
+  return i < 0 ? 0 : (i >= size ? size - 1 : i);
+}
+
+// Bilinear taps for upsampling by 2^|shift|: texel |x| of the fine level
+// takes 1 - |far_weight| of coarse texel |near| and |far_weight| of |far|.
+static inline void upsample_taps(int x, int shift, int coarse_size, int& near, int& far, float& far_weight) {
+  int factor = 1 << shift;
+  int offset = 2*(x & (factor - 1)) + 1 - factor;
+  near = clamp_index(x >> shift, coarse_size);
+  far = clamp_index((x >> shift) + (offset > 0 ? 1 : -1), coarse_size);
+  far_weight = (float)abs(offset) / (2*factor);
+}
+
+Bloom::Bloom(int width, int height, float threshold, float intensity, ThreadPool* pool) {
+  this->width = width;
+  this->height = height;
+  this->threshold = threshold;
+  this->intensity = intensity;
+  this->pool = pool;
+
+  tiles_x = (width + kTileSize - 1) / kTileSize;
+  tiles_y = (height + kTileSize - 1) / kTileSize;
+  marked.assign(tiles_x*tiles_y, 0);
+  active.assign(tiles_x*tiles_y, 0);
+  was_active.assign(tiles_x*tiles_y, 0);
+
+  for (int l = 0; l < kBloomLevels; l++) {
+    int shift = l + kFirstLevelShift;
+    level_width[l] = (width + (1 << shift) - 1) >> shift;
+    level_height[l] = (height + (1 << shift) - 1) >> shift;
+    size_t size = (size_t)level_width[l]*level_height[l]*4*sizeof(float);
+    levels[l] = (float*)aligned_alloc(64, (size + 63) & ~(size_t)63);
+    scratch[l] = (float*)aligned_alloc(64, (size + 63) & ~(size_t)63);
+    memset(levels[l], 0, size);
+    memset(scratch[l], 0, size);
+  }
+}
+
+Bloom::~Bloom() {
+  for (int l = 0; l < kBloomLevels; l++) {
+    free(levels[l]);
+    free(scratch[l]);
+  }
+}
+
+void Bloom::mark(int x_begin, int y_begin, int x_end, int y_end) {
+  x_begin = clamp_index(x_begin, width);
+  y_begin = clamp_index(y_begin, height);
+  x_end = clamp_index(x_end - 1, width);
+  y_end = clamp_index(y_end - 1, height);
+  for (int ty = y_begin / kTileSize; ty <= y_end / kTileSize; ty++) {
+    for (int tx = x_begin / kTileSize; tx <= x_end / kTileSize; tx++)
+      marked[ty*tiles_x + tx] = 1;
+  }
+}
+
+// Activates the tiles within reach of a marked one. Tiles dropping out are
+// zeroed on every level, so inactive tiles always read as black when an
+// active neighbour's filter reaches into them.
+void Bloom::update_active_tiles() {
+  std::fill(active.begin(), active.end(), 0);
+  for (int ty = 0; ty < tiles_y; ty++) {
+    for (int tx = 0; tx < tiles_x; tx++) {
+      if (!marked[ty*tiles_x + tx])
+        continue;
+      for (int y = std::max(ty - kReachTiles, 0); y <= std::min(ty + kReachTiles, tiles_y - 1); y++) {
+        for (int x = std::max(tx - kReachTiles, 0); x <= std::min(tx + kReachTiles, tiles_x - 1); x++)
+          active[y*tiles_x + x] = 1;
+      }
+    }
+  }
+
+  active_tiles.clear();
+  for (int idx = 0; idx < tiles_x*tiles_y; idx++) {
+    if (active[idx])
+      active_tiles.push_back(idx);
+    if (!was_active[idx] || active[idx])
+      continue;
+    for (int l = 0; l < kBloomLevels; l++) {
+      int tile_size = kTileSize >> (l + kFirstLevelShift);
+      int x0 = (idx % tiles_x)*tile_size;
+      int y0 = (idx / tiles_x)*tile_size;
+      int x1 = std::min(x0 + tile_size, level_width[l]);
+      int y1 = std::min(y0 + tile_size, level_height[l]);
+      for (int y = y0; y < y1; y++) {
+        memset(levels[l] + ((size_t)y*level_width[l] + x0)*4, 0, (x1 - x0)*4*sizeof(float));
+        memset(scratch[l] + ((size_t)y*level_width[l] + x0)*4, 0, (x1 - x0)*4*sizeof(float));
+      }
+    }
+  }
+  was_active = active;
+}
+
+// Runs |fn(x_begin, x_end, y_begin, y_end)| over the texels of each active
+// tile on |level|.
+void Bloom::for_active_tiles(int level, const std::function<void(int, int, int, int)>& fn) {
+  int tile_size = kTileSize >> (level + kFirstLevelShift);
+  pool->parallel_for(0, active_tiles.size(), [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      int x0 = (active_tiles[i] % tiles_x)*tile_size;
+      int y0 = (active_tiles[i] / tiles_x)*tile_size;
+      fn(x0, std::min(x0 + tile_size, level_width[level]), y0, std::min(y0 + tile_size, level_height[level]));
+    }
+  });
+}
+
+// Sliding sum of the 2*kBlurRadius+1 texels around each of |count| texels
+// |step| floats apart, the first at |first| of |size|. Texels off the
+// level count as black.
+static inline void box_filter(const float* src, float* dst, int first, int count, int size, int step) {
+  const float scale = 1.0f / (2*kBlurRadius + 1);
+  Texel sum = texel_zero();
+  for (int k = std::max(first - kBlurRadius, 0); k <= std::min(first + kBlurRadius, size - 1); k++)
+    sum = texel_add(sum, texel_load(src + (size_t)k*step));
+
+  for (int i = first; i < first + count; i++) {
+    texel_store(dst + (size_t)i*step, texel_scale(sum, scale));
+    if (i + kBlurRadius + 1 < size)
+      sum = texel_add(sum, texel_load(src + (size_t)(i + kBlurRadius + 1)*step));
+    if (i - kBlurRadius >= 0)
+      sum = texel_sub(sum, texel_load(src + (size_t)(i - kBlurRadius)*step));
+  }
+}
+
+void Bloom::apply(const uint8_t* canvas, uint8_t* out) {
+  update_active_tiles();
+  const uint32_t* canvas_pixels = (const uint32_t*)canvas;
+
+  for (int l = 0; l < kBloomLevels; l++) {
+    int w = level_width[l];
+    int h = level_height[l];
+    float* level = levels[l];
+    float* tmp = scratch[l];
+
+    // Bright pass off the canvas, pixel by pixel, box downsampled into the
+    // first level; 2x2 box downsample of the previous level for the rest.
+    for_active_tiles(l, [&](int x0, int x1, int y0, int y1) {
+      for (int y = y0; y < y1; y++) {
+        float* row = level + (size_t)y*w*4;
+        if (l == 0) {
+          const uint32_t* rows[kBlockSize];
+          for (int i = 0; i < kBlockSize; i++)
+            rows[i] = canvas_pixels + (size_t)std::min(y*kBlockSize + i, height - 1)*width;
+          int full_blocks = std::min(x1, width / kBlockSize);
+          for (int x = x0; x < full_blocks; x++) {
+            const uint32_t* block[kBlockSize];
+            for (int i = 0; i < kBlockSize; i++)
+              block[i] = rows[i] + x*kBlockSize;
+            texel_store(row + x*4, texel_bright(block, threshold));
+          }
+          // A block hanging over the right edge repeats its last pixel.
+          for (int x = std::max(x0, full_blocks); x < x1; x++) {
+            const uint32_t* block[kBlockSize];
+            uint32_t edge[kBlockSize][kBlockSize];
+            for (int i = 0; i < kBlockSize; i++) {
+              for (int j = 0; j < kBlockSize; j++)
+                edge[i][j] = rows[i][std::min(x*kBlockSize + j, width - 1)];
+              block[i] = edge[i];
+            }
+            texel_store(row + x*4, texel_bright(block, threshold));
+          }
+        } else {
+          int prev_w = level_width[l-1];
+          const float* top = levels[l-1] + (size_t)(2*y)*prev_w*4;
+          const float* bottom = levels[l-1] + (size_t)std::min(2*y + 1, level_height[l-1] - 1)*prev_w*4;
+          for (int x = x0; x < x1; x++) {
+            int left = 2*x*4;
+            int right = std::min(2*x + 1, prev_w - 1)*4;
+            Texel sum = texel_add(texel_load(top + left), texel_load(top + right));
+            sum = texel_add(sum, texel_add(texel_load(bottom + left), texel_load(bottom + right)));
+            texel_store(row + x*4, texel_scale(sum, 0.25f));
+          }
+        }
+      }
+    });
+
+    // Two passes of the box filter each way, through the scratch level.
+    for (int pass = 0; pass < 4; pass++) {
+      const float* src = pass % 2 ? tmp : level;
+      float* dst = pass % 2 ? level : tmp;
+      if (pass < 2) {
+        for_active_tiles(l, [&](int x0, int x1, int y0, int y1) {
+          for (int y = y0; y < y1; y++)
+            box_filter(src + (size_t)y*w*4, dst + (size_t)y*w*4, x0, x1 - x0, w, 4);
+        });
+      } else {
+        for_active_tiles(l, [&](int x0, int x1, int y0, int y1) {
+          for (int x = x0; x < x1; x++)
+            box_filter(src + x*4, dst + x*4, y0, y1 - y0, h, w*4);
+        });
+      }
+    }
+  }
+
+  // Fold each level into the next finer one, and the finest into the
+  // canvas, with bilinear upsampling. Rows are blended first, then columns.
+  for (int l = kBloomLevels - 1; l >= 0; l--) {
+    const float* coarse = levels[l];
+    int coarse_w = level_width[l];
+    int coarse_h = level_height[l];
+    int fine_w = l ? level_width[l-1] : width;
+    int fine_h = l ? level_height[l-1] : height;
+    int shift = l ? 1 : kFirstLevelShift;
+    float scale = l ? 1.0f : intensity * 255;
+    int tile_size = l ? kTileSize >> (l - 1 + kFirstLevelShift) : kTileSize;
+    // The horizontal taps only depend on the phase of x.
+    int far_dir[kBlockSize];
+    float far_weight[kBlockSize];
+    for (int phase = 0; phase < (1 << shift); phase++) {
+      int near;
+      upsample_taps(phase + (1 << shift), shift, 3, near, far_dir[phase], far_weight[phase]);
+      far_dir[phase] -= near;
+    }
+
+    pool->parallel_for(0, fine_h, [&](int begin, int end) {
+      // One blended row, padded by a texel on each side that repeats the
+      // edge, so the horizontal taps need no clamping.
+      float* blend_buf = (float*)aligned_alloc(64, (((coarse_w + 2)*4*sizeof(float)) + 63) & ~(size_t)63);
+      float* blend = blend_buf + 4;
+      for (int y = begin; y < end; y++) {
+        int near_y, far_y;
+        float far_y_weight;
+        upsample_taps(y, shift, coarse_h, near_y, far_y, far_y_weight);
+        const float* near_row = coarse + (size_t)near_y*coarse_w*4;
+        const float* far_row = coarse + (size_t)far_y*coarse_w*4;
+        uint32_t* out_row = nullptr;
+        const uint32_t* canvas_row = nullptr;
+        float* fine_row = nullptr;
+        if (l) {
+          fine_row = levels[l-1] + (size_t)y*fine_w*4;
+        } else {
+          canvas_row = canvas_pixels + (size_t)y*width;
+          out_row = (uint32_t*)out + (size_t)y*width;
+          memcpy(out_row, canvas_row, width*sizeof(uint32_t));
+        }
+
+        const uint8_t* tile_row = active.data() + (y / tile_size)*tiles_x;
+        for (int tx = 0; tx < tiles_x; tx++) {
+          if (!tile_row[tx])
+            continue;
+          int x0 = tx*tile_size;
+          int x1 = std::min(x0 + tile_size, fine_w);
+          int blend_begin = std::max((x0 >> shift) - 1, 0);
+          int blend_end = std::min(((x1 - 1) >> shift) + 1, coarse_w - 1);
+          for (int cx = blend_begin; cx <= blend_end; cx++) {
+            Texel t = texel_add(texel_scale(texel_load(near_row + cx*4), (1 - far_y_weight) * scale),
+                                texel_scale(texel_load(far_row + cx*4), far_y_weight * scale));
+            texel_store(blend + cx*4, t);
+          }
+          if (blend_begin == 0)
+            texel_store(blend - 4, texel_load(blend));
+          if (blend_end == coarse_w - 1)
+            texel_store(blend + coarse_w*4, texel_load(blend + (coarse_w - 1)*4));
+
+          for (int x = x0; x < x1; x++) {
+            int near_x = x >> shift;
+            int phase = x & ((1 << shift) - 1);
+            Texel near = texel_load(blend + near_x*4);
+            Texel far = texel_load(blend + (near_x + far_dir[phase])*4);
+            Texel glow = texel_add(near, texel_scale(texel_sub(far, near), far_weight[phase]));
+            if (l)
+              texel_store(fine_row + x*4, texel_add(texel_load(fine_row + x*4), glow));
+            else
+              out_row[x] = texel_add_to_pixel(canvas_row[x], glow);
+          }
+        }
+      }
+      free(blend_buf);
+    });
+  }
+
+  std::fill(marked.begin(), marked.end(), 0);
+}
@@ -0,0 +1,59 @@
+#include <stdint.h>
+#include <functional>
+#include <vector>
+
+#include "thread_pool.h"
+
+#ifndef BLOOM_H
+#define BLOOM_H
+
+const int kBloomLevels = 4;
+
+// Glow post-process for a bgra canvas. Whatever is brighter than
+// |threshold| is downsampled into a pyramid of kBloomLevels levels (quarter
+// size, eighth size, ...), each level is blurred with two passes of a
+// separable box filter, and the levels are upsampled back onto each other
+// and added to the canvas. Coarse levels spread the glow wide at little
+// cost.
+//
+// The canvas is split into tiles. The caller marks every region that may
+// hold bright pixels each frame; only tiles within the bloom's reach of a
+// marked region are processed, and everywhere else the canvas is copied
+// through. Rows and tiles are spread over |pool|.
+class Bloom {
+private:
+  int width;
+  int height;
+  int tiles_x;
+  int tiles_y;
+  float threshold;
+  float intensity;
+  ThreadPool* pool;
+
+  // Four floats (b, g, r, unused) per texel.
+  int level_width[kBloomLevels];
+  int level_height[kBloomLevels];
+  float* levels[kBloomLevels];
+  float* scratch[kBloomLevels];
+
+  std::vector<uint8_t> marked;
+  std::vector<uint8_t> active;
+  std::vector<uint8_t> was_active;
+  std::vector<int> active_tiles;
+
+  void update_active_tiles();
+  void for_active_tiles(int level, const std::function<void(int, int, int, int)>& fn);
+
+public:
+  Bloom(int width, int height, float threshold, float intensity, ThreadPool* pool);
+  ~Bloom();
+
+  // Marks canvas pixels [x_begin, x_end) x [y_begin, y_end) as possibly
+  // bright this frame.
+  void mark(int x_begin, int y_begin, int x_end, int y_end);
+
+  // Writes |canvas| plus its glow to |out| and clears the marks.
+  void apply(const uint8_t* canvas, uint8_t* out);
+};
+
+#endif
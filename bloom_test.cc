@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <vector>
+
+#include "bloom.h"
+#include "thread_pool.h"
+
+// Checks that thin bright features glow. Lightning's traces and leads are
+// one pixel wide, so a bloom that only lets wide features through leaves
+// them bare.
+
+const int kWidth = 256;
+const int kHeight = 256;
+// As in lightning.
+const float kThreshold = 0.5;
+const float kIntensity = 2.0;
+
+struct Shape {
+  const char* name;
+  int x_begin;
+  int y_begin;
+  int x_end;
+  int y_end;
+};
+
+// Pixels of |out| that differ from |canvas| outside the shape itself.
+int count_glow(const Shape& shape, ThreadPool* pool) {
+  std::vector<uint32_t> canvas(kWidth*kHeight, 0xFF000000);
+  std::vector<uint32_t> out(kWidth*kHeight);
+  for (int y = shape.y_begin; y < shape.y_end; y++) {
+    for (int x = shape.x_begin; x < shape.x_end; x++)
+      canvas[y*kWidth + x] = 0xFFFFFFFF;
+  }
+
+  Bloom bloom(kWidth, kHeight, kThreshold, kIntensity, pool);
+  bloom.mark(shape.x_begin, shape.y_begin, shape.x_end, shape.y_end);
+  bloom.apply((const uint8_t*)canvas.data(), (uint8_t*)out.data());
+
+  int glow = 0;
+  for (int idx = 0; idx < kWidth*kHeight; idx++) {
+    if (canvas[idx] != 0xFFFFFFFF && out[idx] != canvas[idx])
+      glow++;
+  }
+  return glow;
+}
+
+int main(int argc, char** argv) {
+  // Odd offsets, so the features don't line up with the bloom's blocks.
+  const Shape kShapes[] = {
+    {"1 px horizontal line", 17, 101, 201, 102},
+    {"1 px vertical line", 77, 9, 78, 243},
+    {"single pixel", 131, 129, 132, 130},
+    {"5 px band", 17, 101, 201, 106},
+  };
+
+  ThreadPool pool;
+  int failures = 0;
+  for (const Shape& shape : kShapes) {
+    int glow = count_glow(shape, &pool);
+    printf("%s: %d pixels glow\n", shape.name, glow);
+    if (!glow)
+      failures++;
+  }
+  if (failures) {
+    printf("%d shapes have no glow\n", failures);
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,227 @@
+#include "checkpoint.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char kCheckpointMagic[8] = {'G', 'E', 'N', 'A', 'R', 'T', 'C', 'K'};
+
+static size_t align_up(size_t val) {
+  return (val + kCheckpointAlignment - 1) & ~(kCheckpointAlignment - 1);
+}
+
+CheckpointWriter::CheckpointWriter(const char* path, uint32_t program) {
+  this->path = path;
+  this->program = program;
+
+  frame = 0;
+  pending_frame = 0;
+  has_pending = false;
+  writing = false;
+  stopping = false;
+
+  writer_thread = new std::thread(&CheckpointWriter::writer_loop, this);
+}
+
+CheckpointWriter::~CheckpointWriter() {
+  {
+    std::lock_guard<std::mutex> lock(writer_mutex);
+    stopping = true;
+  }
+  work_ready.notify_all();
+  writer_thread->join();
+  delete writer_thread;
+}
+
+bool CheckpointWriter::begin(uint64_t frame) {
+  {
+    std::lock_guard<std::mutex> lock(writer_mutex);
+    if (has_pending || writing)
+      return false;
+  }
+
+  this->frame = frame;
+  sections.clear();
+  payload.clear();
+  return true;
+}
+
+void CheckpointWriter::add_section(uint32_t tag, const void* data, size_t size) {
+  CheckpointSection section;
+  section.tag = tag;
+  section.reserved = 0;
+  section.offset = align_up(payload.size());
+  section.size = size;
+  sections.push_back(section);
+
+  payload.resize(section.offset + size);
+  if (size)
+    memcpy(payload.data() + section.offset, data, size);
+}
+
+void CheckpointWriter::add_section(uint32_t tag, const void* data, size_t row_size, int rows, size_t stride) {
+  CheckpointSection section;
+  section.tag = tag;
+  section.reserved = 0;
+  section.offset = align_up(payload.size());
+  section.size = row_size*rows;
+  sections.push_back(section);
+
+  payload.resize(section.offset + section.size);
+  for (int y = 0; y < rows; y++)
+    memcpy(payload.data() + section.offset + y*row_size, (const uint8_t*)data + y*stride, row_size);
+}
+
+void CheckpointWriter::commit() {
+  {
+    std::lock_guard<std::mutex> lock(writer_mutex);
+    pending_sections.swap(sections);
+    pending_payload.swap(payload);
+    pending_frame = frame;
+    has_pending = true;
+  }
+  work_ready.notify_one();
+}
+
+void CheckpointWriter::writer_loop() {
+  std::vector<CheckpointSection> write_sections;
+  std::vector<uint8_t> write_payload;
+
+  while (1) {
+    uint64_t write_frame;
+    {
+      std::unique_lock<std::mutex> lock(writer_mutex);
+      work_ready.wait(lock, [this] { return has_pending || stopping; });
+      if (!has_pending)
+        return;
+      write_sections.swap(pending_sections);
+      write_payload.swap(pending_payload);
+      write_frame = pending_frame;
+      has_pending = false;
+      writing = true;
+    }
+
+    write_file(write_sections, write_payload, write_frame);
+
+    std::lock_guard<std::mutex> lock(writer_mutex);
+    writing = false;
+  }
+}
+
+bool CheckpointWriter::write_file(const std::vector<CheckpointSection>& sections,
+                                  const std::vector<uint8_t>& payload, uint64_t frame) {
+  CheckpointHeader header;
+  memcpy(header.magic, kCheckpointMagic, sizeof(header.magic));
+  header.version = kCheckpointVersion;
+  header.program = program;
+  header.frame = frame;
+  header.num_sections = sections.size();
+  header.reserved = 0;
+
+  size_t payload_start = align_up(sizeof(header) + sizeof(CheckpointSection)*sections.size());
+  std::vector<CheckpointSection> table = sections;
+  for (CheckpointSection& section : table)
+    section.offset += payload_start;
+
+  std::vector<uint8_t> head(payload_start, 0);
+  memcpy(head.data(), &header, sizeof(header));
+  memcpy(head.data() + sizeof(header), table.data(), sizeof(CheckpointSection)*table.size());
+
+  char tmp_path[4096];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+  FILE* fd = fopen(tmp_path, "wb");
+  if (!fd) {
+    printf("Could not open file %s\n", tmp_path);
+    return false;
+  }
+
+  bool ok = fwrite(head.data(), 1, head.size(), fd) == head.size() &&
+            fwrite(payload.data(), 1, payload.size(), fd) == payload.size();
+  ok = fflush(fd) == 0 && ok;
+  ok = fsync(fileno(fd)) == 0 && ok;
+  fclose(fd);
+
+  if (!ok || rename(tmp_path, path)) {
+    printf("Could not write checkpoint %s\n", path);
+    unlink(tmp_path);
+    return false;
+  }
+
+  return true;
+}
+
+CheckpointReader::CheckpointReader() {
+  data = nullptr;
+  size = 0;
+  header = nullptr;
+  sections = nullptr;
+}
+
+CheckpointReader::~CheckpointReader() {
+  if (data)
+    munmap((void*)data, size);
+}
+
+bool CheckpointReader::open(const char* path, uint32_t program) {
+  int fd = ::open(path, O_RDONLY);
+  if (fd < 0) {
+    printf("Could not open file %s\n", path);
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) || (size_t)st.st_size < sizeof(CheckpointHeader)) {
+    printf("Could not validate checkpoint header\n");
+    close(fd);
+    return false;
+  }
+
+  size = st.st_size;
+  void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    printf("Could not map checkpoint %s\n", path);
+    size = 0;
+    return false;
+  }
+  data = (const uint8_t*)mapping;
+
+  header = (const CheckpointHeader*)data;
+  sections = (const CheckpointSection*)(data + sizeof(CheckpointHeader));
+  if (memcmp(header->magic, kCheckpointMagic, sizeof(header->magic)) ||
+      sizeof(CheckpointHeader) + sizeof(CheckpointSection)*header->num_sections > size) {
+    printf("Could not validate checkpoint header\n");
+    return false;
+  }
+  if (header->version != kCheckpointVersion) {
+    printf("Unsupported checkpoint version %u\n", header->version);
+    return false;
+  }
+  if (header->program != program) {
+    printf("Checkpoint was written by a different program\n");
+    return false;
+  }
+  for (uint32_t i = 0; i < header->num_sections; i++) {
+    if (sections[i].offset + sections[i].size > size) {
+      printf("Checkpoint is truncated\n");
+      return false;
+    }
+  }
+
+  return true;
+}
+
+const void* CheckpointReader::section(uint32_t tag, size_t* size) const {
+  for (uint32_t i = 0; i < header->num_sections; i++) {
+    if (sections[i].tag == tag) {
+      if (size)
+        *size = sections[i].size;
+      return data + sections[i].offset;
+    }
+  }
+
+  return nullptr;
+}
@@ -0,0 +1,103 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+// Builds a section or program tag out of four characters, e.g. "GRID".
+constexpr uint32_t checkpoint_tag(const char* name) {
+  return (uint32_t)name[0] | ((uint32_t)name[1] << 8) | ((uint32_t)name[2] << 16) | ((uint32_t)name[3] << 24);
+}
+
+// On-disk layout: a header, a table of sections, then the section payloads,
+// each aligned to kCheckpointAlignment. All fields are little endian.
+const uint32_t kCheckpointVersion = 2;
+const size_t kCheckpointAlignment = 64;
+// Largest grid side a restore accepts. Kernels index cells with an int, so
+// width*height has to stay well inside one.
+const int32_t kCheckpointMaxGridSide = 1 << 15;
+
+struct CheckpointHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t program;
+  uint64_t frame;
+  uint32_t num_sections;
+  uint32_t reserved;
+};
+
+struct CheckpointSection {
+  uint32_t tag;
+  uint32_t reserved;
+  uint64_t offset;
+  uint64_t size;
+};
+
+// Snapshots program state on the calling thread and writes it out on a
+// background thread, so the frame loop only pays for copying the state into
+// memory. Files are written next to the target and renamed into place, so a
+// crash mid-write never leaves a torn checkpoint behind.
+class CheckpointWriter {
+private:
+  const char* path;
+  uint32_t program;
+
+  std::vector<CheckpointSection> sections;
+  std::vector<uint8_t> payload;
+  uint64_t frame;
+
+  std::vector<CheckpointSection> pending_sections;
+  std::vector<uint8_t> pending_payload;
+  uint64_t pending_frame;
+  bool has_pending;
+  bool writing;
+  bool stopping;
+
+  std::mutex writer_mutex;
+  std::condition_variable work_ready;
+  std::thread* writer_thread;
+
+  void writer_loop();
+  bool write_file(const std::vector<CheckpointSection>& sections, const std::vector<uint8_t>& payload, uint64_t frame);
+
+public:
+  CheckpointWriter(const char* path, uint32_t program);
+  ~CheckpointWriter();
+
+  // Starts a snapshot. Returns false without doing anything if the previous
+  // snapshot is still being written, so callers can skip building one.
+  bool begin(uint64_t frame);
+  void add_section(uint32_t tag, const void* data, size_t size);
+  // Packs |rows| rows of |row_size| bytes, |stride| bytes apart, into one
+  // section.
+  void add_section(uint32_t tag, const void* data, size_t row_size, int rows, size_t stride);
+  // Hands the snapshot to the writer thread.
+  void commit();
+};
+
+// Maps a checkpoint read-only. Section pointers stay valid for the lifetime
+// of the reader.
+class CheckpointReader {
+private:
+  const uint8_t* data;
+  size_t size;
+  const CheckpointHeader* header;
+  const CheckpointSection* sections;
+
+public:
+  CheckpointReader();
+  ~CheckpointReader();
+
+  // Returns false and prints why if the file is missing or does not look
+  // like a checkpoint of |program| in the current format version.
+  bool open(const char* path, uint32_t program);
+
+  uint64_t frame() const { return header->frame; }
+  const void* section(uint32_t tag, size_t* size) const;
+};
+
+#endif
@@ -0,0 +1,131 @@
+#include "colormap.h"
+
+#include <stdio.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Matplotlib's viridis and inferno sampled at 11 evenly spaced points.
+static const std::vector<uint32_t> kViridis = {
+  0x440154, 0x482475, 0x414487, 0x355f8d, 0x2a788e, 0x21918c,
+  0x22a884, 0x44bf70, 0x7ad151, 0xbddf26, 0xfde725,
+};
+static const std::vector<uint32_t> kInferno = {
+  0x000004, 0x160b39, 0x420a68, 0x6a176e, 0x932667, 0xbc3754,
+  0xdd513a, 0xf37819, 0xfca50a, 0xf6d746, 0xfcffa4,
+};
+static const std::vector<uint32_t> kGrey = {0x000000, 0xffffff};
+
+Colormap::Colormap(const std::vector<uint32_t>& stops, int size) {
+  lut.resize(size);
+  int segments = stops.size() - 1;
+  for (int i = 0; i < size; i++) {
+    float pos = (float)i / (size - 1) * segments;
+    int segment = pos;
+    if (segment >= segments)
+      segment = segments - 1;
+    float frac = pos - segment;
+
+    uint32_t color = 0xFF000000;
+    for (int shift = 0; shift < 24; shift += 8) {
+      float from = (stops[segment] >> shift) & 0xFF;
+      float to = (stops[segment + 1] >> shift) & 0xFF;
+      color |= (uint32_t)(from + (to - from) * frac + 0.5f) << shift;
+    }
+    lut[i] = color;
+  }
+}
+
+void Colormap::apply(const float* in, uint32_t* out, int count, float lo, float hi) const {
+  float scale = (lut.size() - 1) / (hi - lo);
+  float max_idx = lut.size() - 1;
+  const uint32_t* table = lut.data();
+  int i = 0;
+
+#ifdef __SSE2__
+  __m128 lo_vec = _mm_set1_ps(lo);
+  __m128 scale_vec = _mm_set1_ps(scale);
+  __m128 zero_vec = _mm_setzero_ps();
+  __m128 max_vec = _mm_set1_ps(max_idx);
+  for (; i + 4 <= count; i += 4) {
+    __m128 pos = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(in + i), lo_vec), scale_vec);
+    pos = _mm_min_ps(_mm_max_ps(pos, zero_vec), max_vec);
+    alignas(16) int32_t idx[4];
+    _mm_store_si128((__m128i*)idx, _mm_cvttps_epi32(pos));
+    __m128i pixels = _mm_setr_epi32(table[idx[0]], table[idx[1]], table[idx[2]], table[idx[3]]);
+    _mm_storeu_si128((__m128i*)(out + i), pixels);
+  }
+#endif
+
+  for (; i < count; i++) {
+    float pos = (in[i] - lo) * scale;
+    if (pos > max_idx)
+      pos = max_idx;
+    if (!(pos > 0))
+      pos = 0;
+    out[i] = table[(int)pos];
+  }
+}
+
+Colormap* parse_colormap(const char* spec, int size) {
+  if (size < 2)
+    return nullptr;
+  if (!strcmp(spec, "grey"))
+    return new Colormap(kGrey, size);
+  if (!strcmp(spec, "viridis"))
+    return new Colormap(kViridis, size);
+  if (!strcmp(spec, "inferno"))
+    return new Colormap(kInferno, size);
+
+  std::vector<uint32_t> stops;
+  const char* pos = spec;
+  while (*pos) {
+    uint32_t color;
+    int consumed;
+    if (sscanf(pos, "#%6x%n", &color, &consumed) != 1 || consumed != 7)
+      return nullptr;
+    stops.push_back(color);
+    pos += consumed;
+    if (*pos == ',')
+      pos++;
+    else if (*pos)
+      return nullptr;
+  }
+
+  if (stops.size() < 2)
+    return nullptr;
+  return new Colormap(stops, size);
+}
+
+void pack_blue_green(const float* blue, const float* green, uint32_t* out, int count) {
+  int i = 0;
+
+#ifdef __SSE2__
+  __m128 scale_vec = _mm_set1_ps(255);
+  __m128 zero_vec = _mm_setzero_ps();
+  __m128i alpha = _mm_set1_epi32(0xFF000000);
+  for (; i + 4 <= count; i += 4) {
+    __m128 b = _mm_mul_ps(_mm_loadu_ps(blue + i), scale_vec);
+    __m128 g = _mm_mul_ps(_mm_loadu_ps(green + i), scale_vec);
+    b = _mm_min_ps(_mm_max_ps(b, zero_vec), scale_vec);
+    g = _mm_min_ps(_mm_max_ps(g, zero_vec), scale_vec);
+    __m128i pixels = _mm_or_si128(_mm_cvttps_epi32(b), _mm_slli_epi32(_mm_cvttps_epi32(g), 8));
+    _mm_storeu_si128((__m128i*)(out + i), _mm_or_si128(pixels, alpha));
+  }
+#endif
+
+  for (; i < count; i++) {
+    float b = blue[i] * 255;
+    if (b > 255)
+      b = 255;
+    if (!(b > 0))
+      b = 0;
+    float g = green[i] * 255;
+    if (g > 255)
+      g = 255;
+    if (!(g > 0))
+      g = 0;
+    out[i] = 0xFF000000 | ((uint32_t)g << 8) | (uint32_t)b;
+  }
+}
@@ -0,0 +1,31 @@
+#include <stdint.h>
+#include <vector>
+
+#ifndef COLORMAP_H
+#define COLORMAP_H
+
+// Lookup table from a scalar range to RGB32 pixels (0xFFRRGGBB, as the
+// display expects), linearly interpolated between evenly spaced color
+// stops. 4096 entries are enough to avoid visible banding in smooth fields.
+class Colormap {
+private:
+  std::vector<uint32_t> lut;
+
+public:
+  Colormap(const std::vector<uint32_t>& stops, int size);
+
+  int size() const { return lut.size(); }
+
+  // Maps |count| values to pixels, with [lo, hi] spanning the table and
+  // values outside it clamped to the end colors.
+  void apply(const float* in, uint32_t* out, int count, float lo, float hi) const;
+};
+
+// Accepts "grey", "viridis", "inferno" or a comma separated list of
+// #rrggbb stops. Returns nullptr if |spec| is none of those.
+Colormap* parse_colormap(const char* spec, int size);
+
+// Packs two fields in [0, 1] into the blue and green channels.
+void pack_blue_green(const float* blue, const float* green, uint32_t* out, int count);
+
+#endif
@@ -2,166 +2,716 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <stdint.h>
 #include <png.h>
 #include <thread>
 
+#include "checkpoint.h"
+#include "colormap.h"
+#include "field_reducer.h"
+#include "frame_encoder.h"
+#include "frame_publisher.h"
+#include "frame_scheduler.h"
+#include "golden.h"
+#include "halo.h"
+#include "multigrid.h"
+#include "reaction_diffusion.h"
+#include "scalar.h"
+#include "simulation.h"
+#include "stage_profiler.h"
+#include "step_controller.h"
+#include "thread_pool.h"
 #include "qt_display.h"
 
 int width = 500;
 int height = 500;
+int grid_width = 500;
+int grid_height = 500;
 uint8_t* buf;
 QtDisplay* display;
+FrameScheduler* scheduler;
+FrameEncoder* encoder = nullptr;
+FramePublisher* publisher = nullptr;
+StepController* controller;
+const int kRefreshPeriod = 33000;
+const int kRenderAheadFrames = 8;
+// Headless runs use a fixed step count per frame instead of the wall clock
+// driven StepController, so their frames are reproducible.
+const int kHeadlessStepsPerFrame = 10;
 std::thread* paint_thread;
-double* concentration;
-double* grad_x;
-double* grad_y;
-double* double_grad_x;
-double* double_grad_y;
-double* laplacian;
-
-void compute_x_grad(double* vals, double* out_x) {
-  for (int y = 0; y < height; y++) {
-    for (int x = 0; x < width; x++) {
-      double prev_x, next_x;
+ThreadPool* pool;
+Simulation* sim;
+Precision precision = Precision::kDouble;
+CheckpointWriter* checkpoint_writer = nullptr;
+int checkpoint_interval = 300;
+uint64_t frame_count = 0;
+StageProfiler* profiler = nullptr;
+const uint32_t kCheckpointProgram = checkpoint_tag("DIFF");
 
-      if (x == 0) {
-        prev_x = 0;
-      } else {
-        prev_x = vals[y*width + x - 1];
-      }
-      if (x == width-1) {
-        next_x = 0;
-      } else {
-        next_x = vals[y*width + x + 1];
-      }
+// Leads every checkpoint so a restore can size the grid before constructing
+// the simulation.
+struct CheckpointGrid {
+  int32_t width;
+  int32_t height;
+  int32_t precision;
+  int32_t reserved;
+};
 
-      out_x[y*width + x] = next_x - prev_x;
-    }
+constexpr double kDiffusionCoefficient = 0.1;
+const double kMultigridTolerance = 1e-5;
+const int kMaxMultigridCycles = 30;
+
+// Coefficients for the explicit kernel. The specialized kernels take the
+// diffusion coefficient and the default time step as compile-time
+// constants; any other time step goes through the generic kernel with a
+// RuntimeStepParams.
+struct FixedStepParams {
+  static constexpr double diffusion = kDiffusionCoefficient;
+  static constexpr double dt = 1.0;
+};
+
+struct RuntimeStepParams {
+  double diffusion;
+  double dt;
+};
+
+enum class Solver {
+  kExplicit,
+  kBackwardEuler,
+  kCrankNicolson,
+};
+
+struct DiffusionOptions {
+  int width;
+  int height;
+  int display_width;
+  int display_height;
+  Viewport view;
+  Solver solver;
+  Boundary boundary;
+  double dt;
+  // Whether to use the kernel built for a fixed grid width and time step
+  // when there is one.
+  bool specialized_kernels;
+  const Colormap* colormap;
+  float color_min;
+  float color_max;
+};
+
+// Stores the field as S and does arithmetic in ScalarTraits<S>::compute_type.
+// The field is a double buffered halo grid. The implicit solvers only
+// support zero boundaries.
+template <typename S>
+class Diffusion : public Simulation {
+private:
+  typedef typename ScalarTraits<S>::compute_type C;
+
+  int width;
+  int height;
+  int display_width;
+  int display_height;
+  int stride;
+  Solver solver;
+  Boundary boundary;
+  double dt;
+  ThreadPool* pool;
+  FieldReducer reducer;
+  MultigridSolver<C>* multigrid;
+  SpeciesFields<S, 1> fields;
+  C* implicit_u;
+  C* implicit_rhs;
+  float* display_concentration;
+  // Cells outside |active| are exactly zero. It grows by the stencil reach
+  // every explicit step, so early steps only touch the cells the front has
+  // reached. The implicit solvers reach the whole grid every step, as does a
+  // periodic boundary once the front touches an edge, so those cover the
+  // whole grid.
+  GridBox active;
+  const Colormap* colormap;
+  float color_min;
+  float color_max;
+  uint64_t frame = 0;
+  bool specialized_kernels;
+
+  void process();
+  template <int kWidth, typename P>
+  void step_active(const P& params);
+  void process_implicit();
+  void seed();
+  void include_active(int x_begin, int x_end, int y_begin, int y_end);
+
+public:
+  Diffusion(const DiffusionOptions& options, ThreadPool* pool);
+  ~Diffusion();
+
+  void step() override;
+  void render(uint8_t* buf) override;
+  void save(CheckpointWriter* writer) override;
+  bool restore(const CheckpointReader& reader) override;
+};
+
+template <typename S>
+Diffusion<S>::Diffusion(const DiffusionOptions& options, ThreadPool* pool)
+    : reducer(options.width, options.height, options.display_width, options.display_height, pool),
+      fields(options.width, options.height, pool) {
+  width = options.width;
+  height = options.height;
+  display_width = options.display_width;
+  display_height = options.display_height;
+  stride = halo_stride(width);
+  solver = options.solver;
+  boundary = options.boundary;
+  dt = options.dt;
+  colormap = options.colormap;
+  color_min = options.color_min;
+  color_max = options.color_max;
+  specialized_kernels = options.specialized_kernels;
+  this->pool = pool;
+  reducer.set_viewport(options.view);
+
+  display_concentration = (float*)malloc(display_width*display_height*sizeof(float));
+
+  multigrid = nullptr;
+  implicit_u = nullptr;
+  implicit_rhs = nullptr;
+  if (solver != Solver::kExplicit) {
+    // The explicit Laplacian is the gradient of the gradient, a stencil of
+    // spacing 2, which diffuses 4x faster than the compact 5-point stencil
+    // the multigrid solves with. Scale the coefficient to match.
+    C alpha = 4 * kDiffusionCoefficient * dt;
+    if (solver == Solver::kCrankNicolson)
+      alpha /= 2;
+    multigrid = new MultigridSolver<C>(width, height, alpha, pool);
+    implicit_u = (C*)malloc(width*height*sizeof(C));
+    implicit_rhs = (C*)malloc(width*height*sizeof(C));
   }
+
+  active.x_begin = active.x_end = 0;
+  active.y_begin = active.y_end = 0;
+  if (solver != Solver::kExplicit)
+    include_active(0, width, 0, height);
+
+  seed();
 }
 
-void compute_y_grad(double* vals, double* out_y) {
-  for (int y = 0; y < height; y++) {
-    for (int x = 0; x < width; x++) {
-      double prev_y, next_y;
+template <typename S>
+Diffusion<S>::~Diffusion() {
+  free(display_concentration);
+  free(implicit_u);
+  free(implicit_rhs);
+  delete multigrid;
+}
 
-      if (y == 0) {
-        prev_y = 0;
-      } else {
-        prev_y = vals[(y-1)*width + x];
-      }
-      if (y == width-1) {
-        next_y = 0;
-      } else {
-        next_y = vals[(y+1)*width + x];
-      }
+// kWidth is 0 for the generic kernel.
+template <typename S>
+template <int kWidth, typename P>
+void Diffusion<S>::step_active(const P& params) {
+  DiffusionModel<P> model(params);
+  int x_begin = active.x_begin;
+  int cells = active.x_end - active.x_begin;
+  pool->parallel_for(active.y_begin, active.y_end, [&](int begin, int end) {
+    const int kStride = kWidth ? halo_stride(kWidth) : 0;
+    for (int y = begin; y < end; y++)
+      step_species_row<S, DiffusionModel<P>, kStride, 0, false>(fields, (size_t)y*stride + x_begin, cells, model);
+  });
+}
 
-      out_y[y*width + x] = next_y - prev_y;
-    }
+template <typename S>
+void Diffusion<S>::process() {
+  if (multigrid) {
+    process_implicit();
+    return;
   }
-}
 
-void compute_laplacian() {
-  compute_x_grad(concentration, grad_x);
-  compute_x_grad(grad_x, double_grad_x);
-  compute_y_grad(concentration, grad_y);
-  compute_y_grad(grad_y, double_grad_y);
+  include_active(active.x_begin - kHalo, active.x_end + kHalo, active.y_begin - kHalo, active.y_end + kHalo);
+  fields.fill_halo(boundary);
 
-  for (int y = 0; y < height; y++) {
-    for (int x = 0; x < width; x++) {
-      laplacian[y*width + x] = double_grad_x[y*width + x] + double_grad_y[y*width + x];
-    }
+  bool specialized = specialized_kernels && dt == FixedStepParams::dt &&
+                     dispatch_specialized_width(width, [this](auto fixed_width) {
+                       step_active<decltype(fixed_width)::value>(FixedStepParams());
+                     });
+  if (!specialized) {
+    RuntimeStepParams params = {kDiffusionCoefficient, dt};
+    step_active<0>(params);
   }
+
+  fields.swap();
 }
 
-void process() {
-  double diffusion_coefficient = 0.1;
-  double step = 1.0;
+template <typename S>
+void Diffusion<S>::process_implicit() {
+  C alpha = 4 * kDiffusionCoefficient * dt;
 
-  compute_laplacian();
+  pool->parallel_for(0, height, [&](int begin, int end) {
+    for (int y = begin; y < end; y++) {
+      for (int x = 0; x < width; x++)
+        implicit_u[y*width + x] = fields.current[0][y*stride + x];
+    }
+  });
 
-  for (int y = 0; y < height; y++) {
-    for (int x = 0; x < width; x++) {
-      concentration[y*width + x] += step*(diffusion_coefficient*laplacian[y*width+x]);
+  if (solver == Solver::kCrankNicolson)
+    multigrid->apply_explicit(implicit_u, implicit_rhs, alpha/2);
+  else
+    memcpy(implicit_rhs, implicit_u, width*height*sizeof(C));
+
+  if (multigrid->solve(implicit_u, implicit_rhs, kMultigridTolerance, kMaxMultigridCycles) < 0)
+    printf("Warning! Multigrid did not converge in %d cycles\n", kMaxMultigridCycles);
+
+  pool->parallel_for(0, height, [&](int begin, int end) {
+    for (int y = begin; y < end; y++) {
+      for (int x = 0; x < width; x++)
+        fields.current[0][y*stride + x] = implicit_u[y*width + x];
     }
-  }
+  });
 }
 
-uint64_t frame = 0;
-
-void seed() {
+template <typename S>
+void Diffusion<S>::seed() {
   if (frame++ > 100)
     return;
-  int seed_x = 50;
-  int seed_y = 50;
-  concentration[seed_y*width + seed_x] = 10.0;
-  concentration[seed_y*width + seed_x+1] = 10.0;
-  concentration[(seed_y+1)*width + seed_x] = 10.0;
-  concentration[(seed_y+1)*width + seed_x+1] = 10.0;
+  int seed_x = width/10;
+  int seed_y = height/10;
+  include_active(seed_x, seed_x+2, seed_y, seed_y+2);
+  fields.current[0][seed_y*stride + seed_x] = 10.0;
+  fields.current[0][seed_y*stride + seed_x+1] = 10.0;
+  fields.current[0][(seed_y+1)*stride + seed_x] = 10.0;
+  fields.current[0][(seed_y+1)*stride + seed_x+1] = 10.0;
+}
+
+template <typename S>
+void Diffusion<S>::include_active(int x_begin, int x_end, int y_begin, int y_end) {
+  if (active.x_begin < active.x_end) {
+    x_begin = std::min(x_begin, active.x_begin);
+    x_end = std::max(x_end, active.x_end);
+    y_begin = std::min(y_begin, active.y_begin);
+    y_end = std::max(y_end, active.y_end);
+  }
+
+  active.x_begin = std::max(x_begin, 0);
+  active.x_end = std::min(x_end, width);
+  active.y_begin = std::max(y_begin, 0);
+  active.y_end = std::min(y_end, height);
+
+  if (boundary == Boundary::kPeriodic &&
+      (active.x_begin == 0 || active.y_begin == 0 || active.x_end == width || active.y_end == height)) {
+    active.x_begin = 0;
+    active.x_end = width;
+    active.y_begin = 0;
+    active.y_end = height;
+  }
+}
+
+template <typename S>
+void Diffusion<S>::step() {
+  process();
+  seed();
+}
+
+template <typename S>
+void Diffusion<S>::render(uint8_t* buf) {
+  reducer.reduce(fields.current[0], display_concentration, stride, &active);
+
+  uint32_t* color_buf = (uint32_t*)buf;
+  pool->parallel_for(0, display_height, [&](int begin, int end) {
+    int offset = begin*display_width;
+    colormap->apply(display_concentration + offset, color_buf + offset, (end - begin)*display_width,
+                    color_min, color_max);
+  });
+}
+
+template <typename S>
+void Diffusion<S>::save(CheckpointWriter* writer) {
+  writer->add_section(checkpoint_tag("CONC"), fields.current[0], width*sizeof(S), height, stride*sizeof(S));
+  writer->add_section(checkpoint_tag("STEP"), &frame, sizeof(frame));
 }
 
-void render() {
+template <typename S>
+bool Diffusion<S>::restore(const CheckpointReader& reader) {
+  size_t concentration_size, step_size;
+  const void* concentration_data = reader.section(checkpoint_tag("CONC"), &concentration_size);
+  const void* step_data = reader.section(checkpoint_tag("STEP"), &step_size);
+  if (!concentration_data || !step_data || concentration_size != width*height*sizeof(S) ||
+      step_size != sizeof(frame))
+    return false;
+
+  for (int y = 0; y < height; y++)
+    memcpy(fields.current[0] + y*stride, (const S*)concentration_data + y*width, width*sizeof(S));
+  memcpy(&frame, step_data, step_size);
+
+  // The restored front may be anywhere; bound its nonzero cells again.
+  active.x_begin = active.x_end = 0;
+  active.y_begin = active.y_end = 0;
+  if (multigrid)
+    include_active(0, width, 0, height);
   for (int y = 0; y < height; y++) {
+    const S* row = fields.current[0] + y*stride;
     for (int x = 0; x < width; x++) {
-      double y_val = concentration[y*width + x] * 255.0;
-      if (y_val > 255.0)
-        y_val = 255.0;
-      if (y_val < 0.0)
-        y_val = 0;
-
-      buf[4*(y*width+x)] = y_val;
-      buf[4*(y*width+x)+1] = y_val;
-      buf[4*(y*width+x)+2] = y_val;
-      buf[4*(y*width+x)+3] = 255;
+      if ((float)row[x] != 0)
+        include_active(x, x+1, y, y+1);
     }
   }
+  return true;
+}
+
+Simulation* make_simulation(Precision precision, const DiffusionOptions& options) {
+  switch (precision) {
+    case Precision::kFloat:
+      return new Diffusion<float>(options, pool);
+    case Precision::kHalf:
+      return new Diffusion<Half>(options, pool);
+    case Precision::kBFloat16:
+      return new Diffusion<BFloat16>(options, pool);
+    default:
+      return new Diffusion<double>(options, pool);
+  }
+}
+
+void save_checkpoint() {
+  if (!checkpoint_writer->begin(frame_count))
+    return;
+
+  CheckpointGrid grid;
+  grid.width = grid_width;
+  grid.height = grid_height;
+  grid.precision = (int32_t)precision;
+  grid.reserved = 0;
+  checkpoint_writer->add_section(checkpoint_tag("GRID"), &grid, sizeof(grid));
+  sim->save(checkpoint_writer);
+  checkpoint_writer->commit();
 }
 
 void paint_loop() {
-  auto last_buf_swap = std::chrono::high_resolution_clock::now();
-  int kRefreshPeriod = 33000;
-  uint64_t frame_count = 0;
-  seed();
+  if (profiler)
+    profiler->add_current_thread();
+
   while(1) {
-    process();
-    seed();
-    render();
+    int steps = controller->steps();
+    {
+      StageScope stage(profiler, "step");
+      auto step_start = std::chrono::high_resolution_clock::now();
+      for (int i = 0; i < steps; i++)
+        sim->step();
+      auto step_end = std::chrono::high_resolution_clock::now();
+      controller->record_steps(steps, std::chrono::duration_cast<std::chrono::microseconds>(step_end - step_start).count());
+    }
 
-    display->swap_buf(buf);
+    {
+      StageScope stage(profiler, "wait");
+      buf = scheduler->begin_frame();
+    }
+    {
+      StageScope stage(profiler, "render");
+      auto render_start = std::chrono::high_resolution_clock::now();
+      sim->render(buf);
+      auto render_end = std::chrono::high_resolution_clock::now();
+      controller->record_render(std::chrono::duration_cast<std::chrono::microseconds>(render_end - render_start).count());
+    }
+    {
+      StageScope stage(profiler, "present");
+      scheduler->end_frame(controller->periods());
+    }
+
+    frame_count++;
+    if (checkpoint_writer && frame_count % checkpoint_interval == 0) {
+      StageScope stage(profiler, "checkpoint");
+      save_checkpoint();
+    }
+  }
+}
 
-    auto curr_time = std::chrono::high_resolution_clock::now();
-    auto time_in_microseconds =
-        std::chrono::duration_cast<std::chrono::microseconds>(curr_time -
-                                                              last_buf_swap);
+void headless_loop(int frames, GoldenRecorder* recorder) {
+  if (profiler)
+    profiler->add_current_thread();
 
-    if (time_in_microseconds.count() < kRefreshPeriod) {
-      usleep(kRefreshPeriod - time_in_microseconds.count());
-    } else {
-      printf("Warning! Frame lag! %lu us\n", time_in_microseconds.count());
+  for (int frame = 0; frame < frames; frame++) {
+    {
+      StageScope stage(profiler, "step");
+      for (int i = 0; i < kHeadlessStepsPerFrame; i++)
+        sim->step();
+    }
+    {
+      StageScope stage(profiler, "wait");
+      buf = scheduler->begin_frame();
+    }
+    {
+      StageScope stage(profiler, "render");
+      sim->render(buf);
+    }
+    recorder->add_frame(buf);
+    {
+      StageScope stage(profiler, "present");
+      scheduler->end_frame();
     }
-    last_buf_swap = std::chrono::high_resolution_clock::now();
   }
 }
 
+void usage(const char* name) {
+  printf("Usage: %s [-p double|float|half|bfloat16] [-a accuracy_steps] [-g grid_width x grid_height]\n"
+         "          [-d display_width x display_height] [-z zoom] [-o center_x,center_y]\n"
+         "          [-s explicit|implicit|crank-nicolson] [-t time_step]\n"
+         "          [-B zero|periodic|reflective] [-N none|cpu|node] [-T benchmark_steps]\n"
+         "          [-c checkpoint_path] [-k checkpoint_interval_frames] [-r restore_path]\n"
+         "          [-m grey|viridis|inferno|#rrggbb,#rrggbb,...] [-L 256|4096] [-l color_min:color_max]\n"
+         "          [-n headless_frames [-W golden_path] [-C golden_path] [-e tolerance]]\n"
+         "          [-E png:pattern|y4m:path|raw:path] [-X shm_name] [-P]\n"
+         "-T times that many explicit steps with the kernel specialized for the grid width against the\n"
+         "generic one. Widths 500, 512, 1024, 2048 and 4096 at the default time step have one.\n"
+         "The implicit and crank-nicolson solvers only support -B zero.\n"
+         "-N pins the simulation workers to a CPU or a NUMA node each, spread over all nodes.\n"
+         "-X publishes frames to a shared memory ring for other processes, see frame_ring.h.\n"
+         "-P reports hardware counters for each stage of the frame loop at exit, plus the achieved steps/s\n"
+         "for GUI runs.\n", name);
+  exit(-1);
+}
+
 int main(int argc, char** argv) {
   time_t t;
 
   srand((unsigned) time(&t));
 
-  buf = (uint8_t*)malloc(width*height*4);
-  concentration = (double*)malloc(width*height*sizeof(double));
-  grad_x = (double*)malloc(width*height*sizeof(double));
-  grad_y = (double*)malloc(width*height*sizeof(double));
-  double_grad_x = (double*)malloc(width*height*sizeof(double));
-  double_grad_y = (double*)malloc(width*height*sizeof(double));
-  laplacian = (double*)malloc(width*height*sizeof(double));
+  int accuracy_steps = 0;
+  int benchmark_steps = 0;
+  Viewport view;
+  view.zoom = 1.0;
+  bool has_center = false;
+  Solver solver = Solver::kExplicit;
+  Boundary boundary = Boundary::kZero;
+  ThreadPinning pinning = ThreadPinning::kNone;
+  double dt = 1.0;
+  const char* checkpoint_path = nullptr;
+  const char* restore_path = nullptr;
+  int headless_frames = 0;
+  const char* golden_write_path = nullptr;
+  const char* golden_compare_path = nullptr;
+  int tolerance = 0;
+  const char* colormap_spec = "grey";
+  int lut_size = 256;
+  float color_min = 0;
+  float color_max = 1;
+  EncoderFormat encoder_format;
+  const char* encoder_path = nullptr;
+  const char* publish_name = nullptr;
+  bool profile = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "p:a:g:d:z:o:s:t:c:k:r:n:W:C:e:m:L:l:E:B:PX:N:T:")) != -1) {
+    switch (opt) {
+      case 'p':
+        if (!parse_precision(optarg, precision))
+          usage(argv[0]);
+        break;
+      case 'a':
+        accuracy_steps = atoi(optarg);
+        break;
+      case 'T':
+        benchmark_steps = atoi(optarg);
+        break;
+      case 'g':
+        if (sscanf(optarg, "%dx%d", &grid_width, &grid_height) != 2 || grid_width <= 0 || grid_height <= 0)
+          usage(argv[0]);
+        break;
+      case 'd':
+        if (sscanf(optarg, "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0)
+          usage(argv[0]);
+        break;
+      case 'z':
+        view.zoom = atof(optarg);
+        if (view.zoom <= 0)
+          usage(argv[0]);
+        break;
+      case 'o':
+        if (sscanf(optarg, "%lf,%lf", &view.center_x, &view.center_y) != 2)
+          usage(argv[0]);
+        has_center = true;
+        break;
+      case 's':
+        if (!strcmp(optarg, "implicit"))
+          solver = Solver::kBackwardEuler;
+        else if (!strcmp(optarg, "crank-nicolson"))
+          solver = Solver::kCrankNicolson;
+        else if (strcmp(optarg, "explicit"))
+          usage(argv[0]);
+        break;
+      case 't':
+        dt = atof(optarg);
+        break;
+      case 'B':
+        if (!parse_boundary(optarg, boundary))
+          usage(argv[0]);
+        break;
+      case 'N':
+        if (!parse_thread_pinning(optarg, pinning))
+          usage(argv[0]);
+        break;
+      case 'c':
+        checkpoint_path = optarg;
+        break;
+      case 'k':
+        checkpoint_interval = atoi(optarg);
+        if (checkpoint_interval <= 0)
+          usage(argv[0]);
+        break;
+      case 'r':
+        restore_path = optarg;
+        break;
+      case 'n':
+        headless_frames = atoi(optarg);
+        break;
+      case 'W':
+        golden_write_path = optarg;
+        break;
+      case 'C':
+        golden_compare_path = optarg;
+        break;
+      case 'e':
+        tolerance = atoi(optarg);
+        break;
+      case 'm':
+        colormap_spec = optarg;
+        break;
+      case 'L':
+        lut_size = atoi(optarg);
+        break;
+      case 'l':
+        if (sscanf(optarg, "%f:%f", &color_min, &color_max) != 2 || color_max <= color_min)
+          usage(argv[0]);
+        break;
+      case 'E':
+        if (!parse_encoder_spec(optarg, encoder_format, encoder_path))
+          usage(argv[0]);
+        break;
+      case 'X':
+        publish_name = optarg;
+        break;
+      case 'P':
+        profile = true;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (solver != Solver::kExplicit && boundary != Boundary::kZero)
+    usage(argv[0]);
+
+  // The checkpoint's grid and precision take precedence over the flags, since
+  // the saved state only makes sense on the grid it was computed on.
+  CheckpointReader reader;
+  if (restore_path) {
+    if (!reader.open(restore_path, kCheckpointProgram))
+      exit(-1);
+
+    size_t grid_size;
+    const CheckpointGrid* grid = (const CheckpointGrid*)reader.section(checkpoint_tag("GRID"), &grid_size);
+    if (!grid || grid_size != sizeof(CheckpointGrid)) {
+      printf("Checkpoint is missing its grid description\n");
+      exit(-1);
+    }
+    if (grid->width <= 0 || grid->height <= 0 ||
+        grid->width > kCheckpointMaxGridSide || grid->height > kCheckpointMaxGridSide) {
+      printf("Checkpoint has invalid grid %dx%d\n", grid->width, grid->height);
+      exit(-1);
+    }
+    if (grid->precision < (int32_t)Precision::kDouble || grid->precision > (int32_t)Precision::kBFloat16) {
+      printf("Checkpoint has unknown precision %d\n", grid->precision);
+      exit(-1);
+    }
+    grid_width = grid->width;
+    grid_height = grid->height;
+    precision = (Precision)grid->precision;
+    frame_count = reader.frame();
+  }
+
+  if (!has_center) {
+    view.center_x = grid_width / 2.0;
+    view.center_y = grid_height / 2.0;
+  }
+
+  DiffusionOptions options;
+  options.width = grid_width;
+  options.height = grid_height;
+  options.display_width = width;
+  options.display_height = height;
+  options.view = view;
+  options.solver = solver;
+  options.boundary = boundary;
+  options.dt = dt;
+  options.specialized_kernels = true;
+  options.colormap = nullptr;
+  if (colormap_spec) {
+    options.colormap = parse_colormap(colormap_spec, lut_size);
+    if (!options.colormap)
+      usage(argv[0]);
+  }
+  options.color_min = color_min;
+  options.color_max = color_max;
+
+  pool = new ThreadPool(0, pinning);
+  if (profile) {
+    profiler = new StageProfiler();
+    profiler->add_pool(pool);
+  }
+  sim = make_simulation(precision, options);
+  if (restore_path && !sim->restore(reader)) {
+    printf("Checkpoint does not match the simulation\n");
+    exit(-1);
+  }
+  if (checkpoint_path)
+    checkpoint_writer = new CheckpointWriter(checkpoint_path, kCheckpointProgram);
+
+  if (accuracy_steps) {
+    Simulation* reference = make_simulation(Precision::kDouble, options);
+    compare_to_reference(reference, sim, width, height, accuracy_steps, accuracy_steps / 10 + 1);
+    return 0;
+  }
+
+  if (benchmark_steps) {
+    if (solver != Solver::kExplicit || dt != FixedStepParams::dt ||
+        !dispatch_specialized_width(grid_width, [](auto) {})) {
+      printf("No specialized kernel for this grid, solver and time step, both runs are generic\n");
+    }
+    options.specialized_kernels = false;
+    Simulation* generic = make_simulation(precision, options);
+    if (restore_path)
+      generic->restore(reader);
+    benchmark_kernels(sim, generic, width, height, benchmark_steps);
+    return 0;
+  }
+
+  if (encoder_path)
+    encoder = new FrameEncoder(encoder_format, encoder_path, width, height, 1000000 / kRefreshPeriod);
+
+  if (publish_name)
+    publisher = new FramePublisher(publish_name, width, height);
+
+  if (headless_frames) {
+    scheduler = new FrameScheduler(nullptr, width, height, kRenderAheadFrames, kRefreshPeriod);
+    scheduler->set_encoder(encoder);
+    scheduler->set_publisher(publisher);
+    GoldenRecorder recorder(width, height);
+    headless_loop(headless_frames, &recorder);
+    delete encoder;
+    delete publisher;
+    if (profiler)
+      profiler->report();
+    return recorder.finish(golden_write_path, golden_compare_path, kCheckpointProgram, tolerance);
+  }
 
   QApplication app(argc, argv);
 
   display = new QtDisplay(width, height);
+  scheduler = new FrameScheduler(display, width, height, kRenderAheadFrames, kRefreshPeriod);
+  scheduler->set_encoder(encoder);
+  scheduler->set_publisher(publisher);
+  controller = new StepController(kRefreshPeriod);
 
   paint_thread = new std::thread(paint_loop);
 
-  return app.exec();
+  int ret = app.exec();
+  if (publisher)
+    publisher->unlink();
+  if (profiler) {
+    profiler->report();
+    printf("Achieved %.0f steps/s\n", controller->achieved_steps_per_second());
+  }
+  return ret;
 }
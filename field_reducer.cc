@@ -0,0 +1,57 @@
+#include "field_reducer.h"
+
+#include <math.h>
+
+FieldReducer::FieldReducer(int src_width, int src_height, int dst_width, int dst_height, ThreadPool* pool) {
+  this->src_width = src_width;
+  this->src_height = src_height;
+  this->dst_width = dst_width;
+  this->dst_height = dst_height;
+  this->pool = pool;
+
+  col_begin.resize(dst_width);
+  col_end.resize(dst_width);
+  row_begin.resize(dst_height);
+  row_end.resize(dst_height);
+
+  Viewport view;
+  view.center_x = src_width / 2.0;
+  view.center_y = src_height / 2.0;
+  view.zoom = 1.0;
+  set_viewport(view);
+}
+
+static void box_range(double origin, double scale, int idx, int limit, int& begin, int& end) {
+  double start = floor(origin + idx*scale);
+  double stop = floor(origin + (idx+1)*scale);
+  if (stop < start + 1)
+    stop = start + 1;
+
+  begin = start < 0 ? 0 : (start > limit ? limit : (int)start);
+  end = stop < 0 ? 0 : (stop > limit ? limit : (int)stop);
+}
+
+void FieldReducer::set_viewport(const Viewport& view) {
+  double scale = (double)src_width / dst_width;
+  if ((double)src_height / dst_height > scale)
+    scale = (double)src_height / dst_height;
+  scale /= view.zoom;
+
+  double origin_x = view.center_x - dst_width*scale/2;
+  double origin_y = view.center_y - dst_height*scale/2;
+
+  span_begin = src_width;
+  span_end = 0;
+  for (int dx = 0; dx < dst_width; dx++) {
+    box_range(origin_x, scale, dx, src_width, col_begin[dx], col_end[dx]);
+    if (col_begin[dx] < col_end[dx]) {
+      if (col_begin[dx] < span_begin)
+        span_begin = col_begin[dx];
+      if (col_end[dx] > span_end)
+        span_end = col_end[dx];
+    }
+  }
+
+  for (int dy = 0; dy < dst_height; dy++)
+    box_range(origin_y, scale, dy, src_height, row_begin[dy], row_end[dy]);
+}
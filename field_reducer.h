@@ -0,0 +1,109 @@
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include "thread_pool.h"
+
+#ifndef FIELD_REDUCER_H
+#define FIELD_REDUCER_H
+
+// Which part of the simulation grid the display shows. The center is in
+// grid cells; zoom 1 fits the whole grid in the display.
+struct Viewport {
+  double center_x;
+  double center_y;
+  double zoom;
+};
+
+// Half-open block of grid cells, [x_begin, x_end) x [y_begin, y_end).
+struct GridBox {
+  int x_begin;
+  int x_end;
+  int y_begin;
+  int y_end;
+};
+
+// Box-filters a simulation field down (or samples it up) to display size,
+// so only display-sized data is ever colorized and handed to the display.
+// Each display pixel averages the grid cells under it. Rows are summed
+// with a contiguous, vectorizable loop before the horizontal box sums, and
+// display rows are spread over the thread pool.
+class FieldReducer {
+private:
+  int src_width;
+  int src_height;
+  int dst_width;
+  int dst_height;
+  ThreadPool* pool;
+
+  std::vector<int> col_begin;
+  std::vector<int> col_end;
+  std::vector<int> row_begin;
+  std::vector<int> row_end;
+  int span_begin;
+  int span_end;
+
+public:
+  FieldReducer(int src_width, int src_height, int dst_width, int dst_height, ThreadPool* pool);
+
+  void set_viewport(const Viewport& view);
+
+  // |src_stride| is the distance between source rows, if they are padded.
+  // If |active| is given, cells outside it are known to be zero and are
+  // never read.
+  template <typename T>
+  void reduce(const T* src, float* dst, int src_stride = 0, const GridBox* active = nullptr) const;
+};
+
+template <typename T>
+void FieldReducer::reduce(const T* src, float* dst, int src_stride, const GridBox* active) const {
+  if (!src_stride)
+    src_stride = src_width;
+  GridBox box = {0, src_width, 0, src_height};
+  if (active)
+    box = *active;
+
+  pool->parallel_for(0, dst_height, [&](int begin, int end) {
+    int span_width = span_end - span_begin;
+    std::vector<float> acc(span_width > 0 ? span_width : 1);
+
+    for (int dy = begin; dy < end; dy++) {
+      float* out = dst + (size_t)dy*dst_width;
+      int y0 = row_begin[dy];
+      int y1 = row_end[dy];
+      int active_y0 = std::max(y0, box.y_begin);
+      int active_y1 = std::min(y1, box.y_end);
+      int active_x0 = std::max(span_begin, box.x_begin);
+      int active_x1 = std::min(span_end, box.x_end);
+      if (y0 >= y1 || span_width <= 0 || active_y0 >= active_y1 || active_x0 >= active_x1) {
+        memset(out, 0, sizeof(float)*dst_width);
+        continue;
+      }
+
+      std::fill(acc.begin(), acc.end(), 0.0f);
+      for (int y = active_y0; y < active_y1; y++) {
+        const T* row = src + (size_t)y*src_stride;
+        for (int x = active_x0; x < active_x1; x++)
+          acc[x - span_begin] += row[x];
+      }
+
+      float row_scale = 1.0f / (y1 - y0);
+      for (int dx = 0; dx < dst_width; dx++) {
+        int x0 = col_begin[dx];
+        int x1 = col_end[dx];
+        if (x0 >= x1) {
+          out[dx] = 0;
+          continue;
+        }
+
+        float sum = 0;
+        for (int x = x0; x < x1; x++)
+          sum += acc[x - span_begin];
+        out[dx] = sum * row_scale / (x1 - x0);
+      }
+    }
+  });
+}
+
+#endif
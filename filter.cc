@@ -0,0 +1,146 @@
+#include "filter.h"
+
+#include <algorithm>
+#include <math.h>
+#include <numeric>
+#include <string.h>
+
+bool parse_filter_shape(const char* name, FilterShape& shape) {
+  if (!strcmp(name, "square")) {
+    shape = FilterShape::kSquareBand;
+  } else if (!strcmp(name, "lowpass")) {
+    shape = FilterShape::kLowPass;
+  } else if (!strcmp(name, "highpass")) {
+    shape = FilterShape::kHighPass;
+  } else if (!strcmp(name, "bandpass")) {
+    shape = FilterShape::kBandPass;
+  } else if (!strcmp(name, "annulus")) {
+    shape = FilterShape::kAnnulus;
+  } else if (!strcmp(name, "gaussian")) {
+    shape = FilterShape::kGaussian;
+  } else {
+    return false;
+  }
+
+  return true;
+}
+
+SpectralFilter::SpectralFilter(int width, int height, FilterShape shape, double band_start, double ring_width) {
+  this->width = width;
+  this->height = height;
+  this->shape = shape;
+  this->band_start = band_start;
+  this->ring_width = ring_width;
+
+  primed = false;
+  pass_begin = 0;
+  pass_end = 0;
+
+  if (shape == FilterShape::kGaussian) {
+    gauss_x.resize(width);
+    gauss_y.resize(height);
+    return;
+  }
+
+  // The square band is the old L-shaped mask: max(x, y) in [start, end).
+  std::vector<float> metric(width*height);
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      if (shape == FilterShape::kSquareBand)
+        metric[y*width + x] = std::max(x, y);
+      else
+        metric[y*width + x] = sqrt((double)x*x + (double)y*y);
+    }
+  }
+
+  sorted_idx.resize(width*height);
+  std::iota(sorted_idx.begin(), sorted_idx.end(), 0);
+  std::stable_sort(sorted_idx.begin(), sorted_idx.end(), [&](uint32_t a, uint32_t b) {
+    return metric[a] < metric[b];
+  });
+
+  sorted_metric.resize(width*height);
+  for (int i = 0; i < width*height; i++)
+    sorted_metric[i] = metric[sorted_idx[i]];
+}
+
+void SpectralFilter::pass_interval(double param, double& lo, double& hi) const {
+  switch (shape) {
+    case FilterShape::kLowPass:
+      lo = 0;
+      hi = param;
+      break;
+    case FilterShape::kHighPass:
+      lo = param;
+      hi = INFINITY;
+      break;
+    case FilterShape::kAnnulus:
+      lo = param - ring_width/2;
+      hi = param + ring_width/2;
+      break;
+    default:
+      lo = band_start;
+      hi = param;
+      break;
+  }
+
+  if (hi < lo)
+    hi = lo;
+}
+
+size_t SpectralFilter::lower_bound(double metric) const {
+  return std::lower_bound(sorted_metric.begin(), sorted_metric.end(), metric) - sorted_metric.begin();
+}
+
+void SpectralFilter::copy_range(const double* in, double* out, size_t begin, size_t end) const {
+  for (size_t i = begin; i < end; i++)
+    out[sorted_idx[i]] = in[sorted_idx[i]];
+}
+
+void SpectralFilter::zero_range(double* out, size_t begin, size_t end) const {
+  for (size_t i = begin; i < end; i++)
+    out[sorted_idx[i]] = 0.0;
+}
+
+void SpectralFilter::apply_gaussian(const double* in, double* out, double sigma) {
+  // exp(-(x^2+y^2)/2s^2) = exp(-x^2/2s^2) * exp(-y^2/2s^2), so the per-frame
+  // cost of the mask is width+height exponentials instead of width*height.
+  for (int x = 0; x < width; x++)
+    gauss_x[x] = sigma > 0 ? exp(-(double)x*x / (2*sigma*sigma)) : (x == 0);
+  for (int y = 0; y < height; y++)
+    gauss_y[y] = sigma > 0 ? exp(-(double)y*y / (2*sigma*sigma)) : (y == 0);
+
+  for (int y = 0; y < height; y++) {
+    double row_weight = gauss_y[y];
+    const double* in_row = in + y*width;
+    double* out_row = out + y*width;
+    for (int x = 0; x < width; x++)
+      out_row[x] = in_row[x] * row_weight * gauss_x[x];
+  }
+}
+
+void SpectralFilter::apply(const double* in, double* out, double param) {
+  if (shape == FilterShape::kGaussian) {
+    apply_gaussian(in, out, param);
+    return;
+  }
+
+  if (!primed) {
+    memset(out, 0, sizeof(double)*width*height);
+    primed = true;
+  }
+
+  double lo, hi;
+  pass_interval(param, lo, hi);
+  size_t begin = lower_bound(lo);
+  size_t end = lower_bound(hi);
+
+  // Only the symmetric difference of the old and new pass ranges changes.
+  zero_range(out, pass_begin, std::min(pass_end, begin));
+  zero_range(out, std::max(pass_begin, end), pass_end);
+  copy_range(in, out, begin, std::min(end, pass_begin));
+  copy_range(in, out, std::max(begin, pass_end), end);
+
+  pass_begin = begin;
+  pass_end = end;
+}
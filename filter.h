@@ -0,0 +1,58 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#ifndef FILTER_H
+#define FILTER_H
+
+enum class FilterShape {
+  kSquareBand,
+  kLowPass,
+  kHighPass,
+  kBandPass,
+  kAnnulus,
+  kGaussian,
+};
+
+bool parse_filter_shape(const char* name, FilterShape& shape);
+
+// Frequency domain mask driven by a single swept parameter.
+//
+// The binary shapes pass every coefficient whose distance metric falls in an
+// interval that depends on the parameter. Coefficients are sorted by metric
+// once up front, so moving the interval only touches the coefficients that
+// crossed one of its edges since the last call. The Gaussian is separable and
+// is evaluated on the fly inside the multiply, so no mask is ever stored.
+class SpectralFilter {
+private:
+  int width;
+  int height;
+  FilterShape shape;
+  double band_start;
+  double ring_width;
+
+  std::vector<uint32_t> sorted_idx;
+  std::vector<float> sorted_metric;
+
+  bool primed;
+  size_t pass_begin;
+  size_t pass_end;
+
+  std::vector<double> gauss_x;
+  std::vector<double> gauss_y;
+
+  void pass_interval(double param, double& lo, double& hi) const;
+  size_t lower_bound(double metric) const;
+  void copy_range(const double* in, double* out, size_t begin, size_t end) const;
+  void zero_range(double* out, size_t begin, size_t end) const;
+  void apply_gaussian(const double* in, double* out, double sigma);
+
+public:
+  SpectralFilter(int width, int height, FilterShape shape, double band_start, double ring_width);
+
+  // |out| must hold the result of the previous apply() call (or anything
+  // before the first call), since only the changed coefficients are written.
+  void apply(const double* in, double* out, double param);
+};
+
+#endif
@@ -0,0 +1,209 @@
+#include "frame_encoder.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "png_writer.h"
+
+bool parse_encoder_spec(const char* spec, EncoderFormat& format, const char*& path) {
+  const char* sep = strchr(spec, ':');
+  if (!sep || !sep[1])
+    return false;
+
+  std::string name(spec, sep - spec);
+  if (name == "png")
+    format = EncoderFormat::kPng;
+  else if (name == "y4m")
+    format = EncoderFormat::kY4m;
+  else if (name == "raw")
+    format = EncoderFormat::kRaw;
+  else
+    return false;
+
+  path = sep + 1;
+  return true;
+}
+
+FrameEncoder::FrameEncoder(EncoderFormat format, const char* path, int width, int height, int fps, int num_threads) {
+  this->format = format;
+  this->path = path;
+  this->width = width;
+  this->height = height;
+
+  stream = nullptr;
+  failed = false;
+  next_seq = 0;
+  next_write = 0;
+  in_flight = 0;
+  stopping = false;
+
+  if (format != EncoderFormat::kPng) {
+    if (!strcmp(path, "-")) {
+      // Everything else the programs print goes to stdout, so move that to
+      // stderr and keep the real stdout for the stream.
+      int stream_fd = dup(STDOUT_FILENO);
+      dup2(STDERR_FILENO, STDOUT_FILENO);
+      stream = fdopen(stream_fd, "wb");
+    } else {
+      stream = fopen(path, "wb");
+    }
+    if (!stream) {
+      printf("Could not open file %s\n", path);
+      exit(-1);
+    }
+
+    if (format == EncoderFormat::kY4m)
+      fprintf(stream, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", width, height, fps);
+    else
+      fprintf(stderr, "Raw output: -f rawvideo -pix_fmt bgra -s %dx%d -r %d\n", width, height, fps);
+  }
+
+  if (num_threads <= 0)
+    num_threads = std::thread::hardware_concurrency();
+  if (num_threads <= 0)
+    num_threads = 1;
+  for (int i = 0; i < num_threads; i++)
+    workers.emplace_back(&FrameEncoder::worker_loop, this);
+}
+
+FrameEncoder::~FrameEncoder() {
+  finish();
+
+  {
+    std::lock_guard<std::mutex> lock(encoder_mutex);
+    stopping = true;
+  }
+  job_ready.notify_all();
+  for (std::thread& worker : workers)
+    worker.join();
+
+  if (stream)
+    fclose(stream);
+}
+
+void FrameEncoder::submit(const uint8_t* frame, std::function<void()> done) {
+  {
+    std::lock_guard<std::mutex> lock(encoder_mutex);
+    Job job;
+    job.frame = frame;
+    job.seq = next_seq++;
+    job.done = std::move(done);
+    jobs.push_back(std::move(job));
+    in_flight++;
+  }
+  job_ready.notify_one();
+}
+
+void FrameEncoder::finish() {
+  std::unique_lock<std::mutex> lock(encoder_mutex);
+  drained.wait(lock, [this] { return in_flight == 0; });
+  if (stream)
+    fflush(stream);
+}
+
+void FrameEncoder::worker_loop() {
+  std::vector<uint8_t> scratch;
+
+  while (1) {
+    Job job;
+    {
+      std::unique_lock<std::mutex> lock(encoder_mutex);
+      job_ready.wait(lock, [this] { return !jobs.empty() || stopping; });
+      if (jobs.empty())
+        return;
+      job = std::move(jobs.front());
+      jobs.pop_front();
+    }
+
+    encode(job, scratch);
+
+    {
+      std::lock_guard<std::mutex> lock(encoder_mutex);
+      in_flight--;
+    }
+    drained.notify_all();
+  }
+}
+
+void FrameEncoder::encode(Job& job, std::vector<uint8_t>& scratch) {
+  switch (format) {
+    case EncoderFormat::kPng: {
+      char file_name[4096];
+      snprintf(file_name, sizeof(file_name), path.c_str(), (int)job.seq);
+      write_png_file(file_name, width, height, job.frame, PixelLayout::kRGB32, Z_BEST_SPEED);
+      job.done();
+      break;
+    }
+    case EncoderFormat::kY4m: {
+      int chroma_size = ((width + 1) / 2) * ((height + 1) / 2);
+      scratch.resize(width*height + 2*chroma_size);
+      convert_yuv420(job.frame, scratch.data());
+      // The frame slot can be recycled while this one waits for its turn.
+      job.done();
+      write_in_order(job.seq, "FRAME\n", scratch.data(), scratch.size());
+      break;
+    }
+    case EncoderFormat::kRaw:
+      write_in_order(job.seq, "", job.frame, width*height*4);
+      job.done();
+      break;
+  }
+}
+
+// BT.601 studio range, with chroma averaged over each 2x2 block.
+void FrameEncoder::convert_yuv420(const uint8_t* frame, uint8_t* out) const {
+  int chroma_width = (width + 1) / 2;
+  int chroma_height = (height + 1) / 2;
+  uint8_t* y_plane = out;
+  uint8_t* u_plane = out + width*height;
+  uint8_t* v_plane = u_plane + chroma_width*chroma_height;
+
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      const uint8_t* pixel = frame + (y*width + x)*4;
+      int r = pixel[2];
+      int g = pixel[1];
+      int b = pixel[0];
+      y_plane[y*width + x] = ((66*r + 129*g + 25*b + 128) >> 8) + 16;
+    }
+  }
+
+  for (int cy = 0; cy < chroma_height; cy++) {
+    for (int cx = 0; cx < chroma_width; cx++) {
+      int r = 0, g = 0, b = 0, samples = 0;
+      for (int y = 2*cy; y < 2*cy + 2 && y < height; y++) {
+        for (int x = 2*cx; x < 2*cx + 2 && x < width; x++) {
+          const uint8_t* pixel = frame + (y*width + x)*4;
+          r += pixel[2];
+          g += pixel[1];
+          b += pixel[0];
+          samples++;
+        }
+      }
+      r /= samples;
+      g /= samples;
+      b /= samples;
+
+      u_plane[cy*chroma_width + cx] = ((-38*r - 74*g + 112*b + 128) >> 8) + 128;
+      v_plane[cy*chroma_width + cx] = ((112*r - 94*g - 18*b + 128) >> 8) + 128;
+    }
+  }
+}
+
+void FrameEncoder::write_in_order(uint64_t seq, const char* prefix, const uint8_t* data, size_t size) {
+  std::unique_lock<std::mutex> lock(write_mutex);
+  write_turn.wait(lock, [this, seq] { return next_write == seq; });
+
+  if (!failed) {
+    size_t prefix_size = strlen(prefix);
+    if (fwrite(prefix, 1, prefix_size, stream) != prefix_size || fwrite(data, 1, size, stream) != size) {
+      fprintf(stderr, "Could not write to %s, dropping further frames\n", path.c_str());
+      failed = true;
+    }
+  }
+
+  next_write++;
+  write_turn.notify_all();
+}
@@ -0,0 +1,79 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef FRAME_ENCODER_H
+#define FRAME_ENCODER_H
+
+enum class EncoderFormat {
+  // One PNG per frame, named by a printf pattern such as frames/%06d.png.
+  kPng,
+  // YUV4MPEG2 (4:2:0, BT.601) stream.
+  kY4m,
+  // Frames as they sit in memory (bgra on little endian).
+  kRaw,
+};
+
+// Parses "png:pattern", "y4m:path" or "raw:path". Stream paths may be "-"
+// for stdout.
+bool parse_encoder_spec(const char* spec, EncoderFormat& format, const char*& path);
+
+// Encodes frames on its own worker threads. Frames are borrowed rather than
+// copied: the |done| callback passed with each frame runs once the encoder
+// no longer needs it, which for streams is as soon as the frame has been
+// converted. Stream output is written strictly in submission order.
+//
+// Submitting never blocks. Back-pressure comes from the producer's frame
+// ring, whose slots are only recycled once the encoder releases them.
+class FrameEncoder {
+private:
+  struct Job {
+    const uint8_t* frame;
+    uint64_t seq;
+    std::function<void()> done;
+  };
+
+  EncoderFormat format;
+  std::string path;
+  int width;
+  int height;
+  FILE* stream;
+  bool failed;
+
+  std::vector<std::thread> workers;
+  std::deque<Job> jobs;
+  uint64_t next_seq;
+  uint64_t next_write;
+  int in_flight;
+  bool stopping;
+
+  std::mutex encoder_mutex;
+  std::condition_variable job_ready;
+  std::condition_variable drained;
+  // Separate from encoder_mutex so a slow write never blocks submit().
+  std::mutex write_mutex;
+  std::condition_variable write_turn;
+
+  void worker_loop();
+  void encode(Job& job, std::vector<uint8_t>& scratch);
+  void convert_yuv420(const uint8_t* frame, uint8_t* out) const;
+  void write_in_order(uint64_t seq, const char* prefix, const uint8_t* data, size_t size);
+
+public:
+  // |fps| only ends up in the Y4M header. |num_threads| defaults to one per
+  // hardware thread.
+  FrameEncoder(EncoderFormat format, const char* path, int width, int height, int fps, int num_threads = 0);
+  ~FrameEncoder();
+
+  void submit(const uint8_t* frame, std::function<void()> done);
+  // Blocks until every submitted frame has been written.
+  void finish();
+};
+
+#endif
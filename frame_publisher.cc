@@ -0,0 +1,90 @@
+#include "frame_publisher.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static const size_t kPageSize = 4096;
+
+static size_t page_align(size_t size) {
+  return (size + kPageSize - 1) & ~(kPageSize - 1);
+}
+
+FramePublisher::FramePublisher(const char* name, int width, int height, int num_slots) {
+  this->name = name;
+  this->width = width;
+  this->height = height;
+  this->num_slots = num_slots;
+  sequence = 0;
+  linked = true;
+
+  size_t first_slot = page_align(sizeof(FrameRingHeader));
+  size_t slot_size = page_align(kFrameRingSlotHeaderSize + (size_t)width*height*4);
+  size = first_slot + num_slots*slot_size;
+
+  shm_unlink(name);
+  int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+  if (fd < 0) {
+    printf("Could not create shared memory %s: %s\n", name, strerror(errno));
+    exit(-1);
+  }
+  if (ftruncate(fd, size)) {
+    printf("Could not size shared memory %s: %s\n", name, strerror(errno));
+    exit(-1);
+  }
+  mapping = (uint8_t*)mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    printf("Could not map shared memory %s: %s\n", name, strerror(errno));
+    exit(-1);
+  }
+
+  // ftruncate() zero fills, so every slot starts out empty.
+  header = (FrameRingHeader*)mapping;
+  header->version = kFrameRingVersion;
+  header->writer_pid = getpid();
+  header->width = width;
+  header->height = height;
+  header->stride = width*4;
+  header->num_slots = num_slots;
+  header->first_slot = first_slot;
+  header->slot_size = slot_size;
+  header->latest.store(0, std::memory_order_relaxed);
+  header->notify.store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  memcpy(header->magic, kFrameRingMagic, sizeof(kFrameRingMagic));
+}
+
+FramePublisher::~FramePublisher() {
+  munmap(mapping, size);
+  unlink();
+}
+
+void FramePublisher::unlink() {
+  // Only once, since by a second time another process may have taken the
+  // name.
+  if (linked)
+    shm_unlink(name);
+  linked = false;
+}
+
+// A seqlock per slot: the slot reads as empty while it is overwritten, and
+// readers that raced with the copy see the sequence change under them.
+void FramePublisher::publish(const uint8_t* frame) {
+  sequence++;
+  FrameRingSlot* target = slot(sequence % num_slots);
+  target->sequence.store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  memcpy((uint8_t*)target + kFrameRingSlotHeaderSize, frame, (size_t)width*height*4);
+  target->timestamp_us = frame_ring_now_us();
+  target->sequence.store(sequence, std::memory_order_release);
+
+  header->latest.store(sequence, std::memory_order_release);
+  header->notify.fetch_add(1, std::memory_order_release);
+  frame_ring_wake(&header->notify);
+}
@@ -0,0 +1,43 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "frame_ring.h"
+
+#ifndef FRAME_PUBLISHER_H
+#define FRAME_PUBLISHER_H
+
+// Publishes frames into a POSIX shared memory ring (see frame_ring.h), so
+// other processes on the host can pick up the latest frame in place
+// without going through the display. Publishing copies the frame into the
+// next slot and wakes any waiting readers; it never waits on them.
+class FramePublisher {
+private:
+  const char* name;
+  int width;
+  int height;
+  int num_slots;
+  size_t size;
+  uint8_t* mapping;
+  FrameRingHeader* header;
+  uint64_t sequence;
+  bool linked;
+
+  FrameRingSlot* slot(int idx) { return (FrameRingSlot*)(mapping + header->first_slot + idx*header->slot_size); }
+
+public:
+  // Creates shared memory object |name| (e.g. "/lightning"), replacing any
+  // left behind by an earlier run. Readers still mapping the old one keep
+  // it until they reopen |name|.
+  FramePublisher(const char* name, int width, int height, int num_slots = 3);
+  // Unlinks |name| if unlink() hasn't already.
+  ~FramePublisher();
+
+  void publish(const uint8_t* frame);
+
+  // Removes |name|, so the ring goes away once the last reader unmaps it.
+  // Frames can still be published until the publisher is deleted, so this
+  // is safe to call while the producer thread is still running.
+  void unlink();
+};
+
+#endif
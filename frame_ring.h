@@ -0,0 +1,81 @@
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#ifndef FRAME_RING_H
+#define FRAME_RING_H
+
+// Layout of the POSIX shared memory ring a FramePublisher writes frames
+// into, for readers in other processes to map. Offsets are from the start
+// of the mapping and all fields are native endian, since writer and
+// readers share a host.
+//
+// Reading the latest frame in place:
+//  1. seq = header->latest (acquire). 0 means no frame yet.
+//  2. The frame lives in slot seq % num_slots. Check that the slot's
+//     sequence (acquire) is seq, use the pixels, then issue an acquire
+//     fence and check the slot's sequence again. If it changed the writer
+//     overwrote the frame while it was in use and whatever was read from
+//     it must be discarded. The writer only comes back to a slot after
+//     num_slots - 1 further frames, so that's rare.
+//  3. To wait for the next frame, note header->notify before step 1 and
+//     FUTEX_WAIT on it with that value.
+const char kFrameRingMagic[8] = {'F', 'R', 'M', 'R', 'I', 'N', 'G', '1'};
+const uint32_t kFrameRingVersion = 1;
+// Pixels within a slot start this far in, past the slot header.
+const size_t kFrameRingSlotHeaderSize = 64;
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "frame ring atomics must be lock free");
+
+struct FrameRingHeader {
+  // Written last, so a reader that sees it sees the rest of the header.
+  char magic[8];
+  uint32_t version;
+  uint32_t writer_pid;
+  uint32_t width;
+  uint32_t height;
+  // Bytes between rows. Pixels are 0xFFRRGGBB words, as the display takes
+  // them.
+  uint32_t stride;
+  uint32_t num_slots;
+  // Offset of slot 0 and the distance between slots, both page aligned.
+  uint64_t first_slot;
+  uint64_t slot_size;
+  // Sequence number of the newest complete frame, counting from 1.
+  std::atomic<uint64_t> latest;
+  // Bumped after every frame.
+  std::atomic<uint32_t> notify;
+};
+
+struct FrameRingSlot {
+  // Sequence number of the frame in the slot, 0 while empty or being
+  // written.
+  std::atomic<uint64_t> sequence;
+  // CLOCK_MONOTONIC time the frame was published.
+  uint64_t timestamp_us;
+};
+
+inline uint64_t frame_ring_now_us() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec*1000000 + now.tv_nsec/1000;
+}
+
+// Shared (not process private) futex operations on |word|.
+inline void frame_ring_wake(std::atomic<uint32_t>* word) {
+  syscall(SYS_futex, (uint32_t*)word, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+// Sleeps while |word| still holds |seen|, for at most |timeout_ms|.
+inline void frame_ring_wait(std::atomic<uint32_t>* word, uint32_t seen, int timeout_ms) {
+  timespec timeout;
+  timeout.tv_sec = timeout_ms / 1000;
+  timeout.tv_nsec = (long)(timeout_ms % 1000)*1000000;
+  syscall(SYS_futex, (uint32_t*)word, FUTEX_WAIT, seen, &timeout, nullptr, 0);
+}
+
+#endif
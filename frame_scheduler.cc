@@ -0,0 +1,148 @@
+#include "frame_scheduler.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+FrameScheduler::FrameScheduler(QtDisplay* display, int width, int height, int num_frames, int refresh_period) {
+  this->display = display;
+  encoder = nullptr;
+  publisher = nullptr;
+  this->frame_size = width*height*4;
+  this->refresh_period = refresh_period;
+
+  for (int i = 0; i < num_frames; i++)
+    frames.push_back((uint8_t*)malloc(frame_size));
+  frame_periods.resize(num_frames, 1);
+  frame_dirty.resize(num_frames);
+  frame_partial.resize(num_frames, 0);
+  frame_refs.resize(num_frames, 0);
+  oldest = 0;
+  live = 0;
+  head = 0;
+  count = 0;
+  stopping = false;
+
+  pacing_thread = nullptr;
+  if (display)
+    pacing_thread = new std::thread(&FrameScheduler::pacing_loop, this);
+}
+
+FrameScheduler::~FrameScheduler() {
+  {
+    std::lock_guard<std::mutex> lock(ring_mutex);
+    stopping = true;
+  }
+  frame_ready.notify_all();
+  frame_free.notify_all();
+  if (pacing_thread) {
+    pacing_thread->join();
+    delete pacing_thread;
+  }
+
+  for (uint8_t* frame : frames)
+    free(frame);
+}
+
+uint8_t* FrameScheduler::begin_frame() {
+  std::unique_lock<std::mutex> lock(ring_mutex);
+  frame_free.wait(lock, [this] { return live < (int)frames.size() || stopping; });
+
+  return frames[(oldest + live) % frames.size()];
+}
+
+void FrameScheduler::end_frame(int periods, const std::vector<DirtyRect>* dirty) {
+  int slot;
+  {
+    std::lock_guard<std::mutex> lock(ring_mutex);
+    slot = (oldest + live) % frames.size();
+    frame_periods[slot] = periods;
+    frame_partial[slot] = display && dirty;
+    if (frame_partial[slot])
+      frame_dirty[slot] = *dirty;
+    // Held until submission below so the slot can't retire early.
+    frame_refs[slot] = 1 + (display ? 1 : 0) + (encoder ? 1 : 0);
+    live++;
+    if (display)
+      count++;
+  }
+  frame_ready.notify_one();
+
+  if (publisher)
+    publisher->publish(frames[slot]);
+  if (encoder)
+    encoder->submit(frames[slot], [this, slot] { release(slot); });
+  release(slot);
+}
+
+void FrameScheduler::release(int slot) {
+  {
+    std::lock_guard<std::mutex> lock(ring_mutex);
+    frame_refs[slot]--;
+    while (live && !frame_refs[oldest]) {
+      oldest = (oldest + 1) % frames.size();
+      live--;
+    }
+  }
+  frame_free.notify_one();
+}
+
+void FrameScheduler::push_frame(const uint8_t* frame, int periods, const std::vector<DirtyRect>* dirty) {
+  memcpy(begin_frame(), frame, frame_size);
+  end_frame(periods, dirty);
+}
+
+void FrameScheduler::pacing_loop() {
+  auto period = std::chrono::microseconds(refresh_period);
+  auto last_publish = std::chrono::high_resolution_clock::now();
+  auto next_publish = last_publish;
+  bool published_any = false;
+
+  while (1) {
+    std::this_thread::sleep_until(next_publish);
+
+    uint8_t* frame;
+    int periods;
+    const std::vector<DirtyRect>* dirty;
+    {
+      std::unique_lock<std::mutex> lock(ring_mutex);
+      if (!count && !stopping) {
+        // Underrun: the producer fell behind the buffered lead. Publish as
+        // soon as the next frame lands and restart the cadence from there.
+        frame_ready.wait(lock, [this] { return count > 0 || stopping; });
+        if (published_any && !stopping) {
+          auto lag = std::chrono::duration_cast<std::chrono::microseconds>(
+              std::chrono::high_resolution_clock::now() - last_publish);
+          printf("Warning! Frame lag! %lu us\n", lag.count());
+        }
+        next_publish = std::chrono::high_resolution_clock::now();
+      }
+      if (stopping)
+        return;
+      frame = frames[head];
+      periods = frame_periods[head];
+      dirty = frame_partial[head] ? &frame_dirty[head] : nullptr;
+    }
+
+    // The slot's rects aren't touched again until it is released.
+    if (dirty)
+      display->swap_buf(frame, *dirty);
+    else
+      display->swap_buf(frame);
+    last_publish = std::chrono::high_resolution_clock::now();
+    published_any = true;
+
+    int slot;
+    {
+      std::lock_guard<std::mutex> lock(ring_mutex);
+      slot = head;
+      head = (head + 1) % frames.size();
+      count--;
+    }
+    release(slot);
+
+    next_publish += period * periods;
+    if (next_publish < last_publish - period)
+      next_publish = last_publish;
+  }
+}
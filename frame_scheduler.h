@@ -0,0 +1,82 @@
+#include <stdint.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "frame_encoder.h"
+#include "frame_publisher.h"
+#include "qt_display.h"
+
+#ifndef FRAME_SCHEDULER_H
+#define FRAME_SCHEDULER_H
+
+// Bounded ring of preallocated frames between a producer (the simulation)
+// and a pacing thread that publishes one frame per refresh period to the
+// display. The producer renders ahead until the ring is full, so a slow
+// frame eats into the buffered lead instead of stuttering the output.
+//
+// Frames can also be handed to a FrameEncoder. Each slot is reference
+// counted between the display and the encoder and only recycled once both
+// are done with it, so a lagging encoder holds the producer back rather
+// than losing frames. Without a display the scheduler runs headless and
+// frames only go to the encoder.
+//
+// Every frame reaches the display in order, so a producer that knows which
+// parts of a frame changed since the one before can pass those rects along
+// and the display only copies and repaints them.
+class FrameScheduler {
+private:
+  QtDisplay* display;
+  FrameEncoder* encoder;
+  FramePublisher* publisher;
+  int frame_size;
+  int refresh_period;
+
+  std::vector<uint8_t*> frames;
+  std::vector<int> frame_periods;
+  // Empty where the whole frame is to be shown.
+  std::vector<std::vector<DirtyRect>> frame_dirty;
+  std::vector<uint8_t> frame_partial;
+  std::vector<int> frame_refs;
+  // Slots [oldest, oldest + live) are in use, the first |count| of those
+  // starting at |head| still waiting for the display.
+  int oldest;
+  int live;
+  int head;
+  int count;
+  bool stopping;
+
+  std::mutex ring_mutex;
+  std::condition_variable frame_free;
+  std::condition_variable frame_ready;
+  std::thread* pacing_thread;
+
+  void pacing_loop();
+  void release(int slot);
+
+public:
+  // |refresh_period| is in microseconds. |display| may be null.
+  FrameScheduler(QtDisplay* display, int width, int height, int num_frames, int refresh_period);
+  // The encoder must have finished with every frame by now.
+  ~FrameScheduler();
+
+  // Must be called before the first frame.
+  void set_encoder(FrameEncoder* encoder) { this->encoder = encoder; }
+  // Frames are published as they are produced, on the producer's thread.
+  // Must be called before the first frame.
+  void set_publisher(FramePublisher* publisher) { this->publisher = publisher; }
+
+  // Returns the next free slot, blocking while the ring is full. The slot
+  // contents are stale, so callers must overwrite the whole frame.
+  uint8_t* begin_frame();
+  // |periods| is how many refresh periods the frame stays on screen. If
+  // |dirty| is given the frame only differs from the previous one within
+  // those rects.
+  void end_frame(int periods = 1, const std::vector<DirtyRect>* dirty = nullptr);
+
+  // Copies a fully rendered frame into the ring.
+  void push_frame(const uint8_t* frame, int periods = 1, const std::vector<DirtyRect>* dirty = nullptr);
+};
+
+#endif
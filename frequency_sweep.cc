@@ -8,7 +8,14 @@
 #include <unordered_map>
 #include <fftw3.h>
 
+#include "checkpoint.h"
+#include "filter.h"
+#include "frame_encoder.h"
+#include "frame_publisher.h"
+#include "frame_scheduler.h"
+#include "golden.h"
 #include "qt_display.h"
+#include "stage_profiler.h"
 
 int width;
 int height;
@@ -18,9 +25,22 @@ double* dct_buf;
 double* dct_filtered_buf;
 double* idct_buf;
 fftw_plan idct_plan;
-double* filter;
+SpectralFilter* filter;
+FilterShape filter_shape = FilterShape::kSquareBand;
+int bandpass_start = 0;
+double ring_width = 20.0;
 QtDisplay* display;
+FrameScheduler* scheduler;
+FrameEncoder* encoder = nullptr;
+FramePublisher* publisher = nullptr;
+StageProfiler* profiler = nullptr;
+const int kRefreshPeriod = 33000;
+const int kRenderAheadFrames = 8;
 std::thread* paint_thread;
+const uint32_t kCheckpointProgram = checkpoint_tag("FSWP");
+int bandpass_end = 0;
+int bandpass_dir = 5;
+std::unordered_map<int, uint8_t*> cache;
 
 void read_png_file(const char* file_name, int& width, int& height, uint8_t*& buf) {
   unsigned char header[8];
@@ -92,7 +112,6 @@ void setup() {
   dct_buf = (double*)fftw_malloc(sizeof(double)*width*height);
   dct_filtered_buf = (double*)fftw_malloc(sizeof(double)*width*height);
   idct_buf = (double*)fftw_malloc(sizeof(double)*width*height);
-  filter = (double*)fftw_malloc(sizeof(double)*width*height);
 
   double* tmp_ret = greyscale_buf;
   for (int i = 0; i < width*height; i++) {
@@ -117,26 +136,7 @@ void setup() {
 
   idct_plan = fftw_plan_r2r_2d(width, height, dct_filtered_buf, idct_buf, FFTW_REDFT01, FFTW_REDFT01, FFTW_ESTIMATE);
 
-  filter[0] = 1.0;
-}
-
-void create_bandpass(int start, int end) {
-  for (int y = 0; y < height; y++) {
-    for (int x = 0; x < width; x++) {
-      if ((x >= start && x < end && y < start) ||
-          (y >= start && y < end && x < end)) {
-        filter[y*width + x] = 1.0;
-      } else {
-        filter[y*width + x] = 0.0;
-      }
-    }
-  }
-}
-
-void do_filter() {
-  //TODO: SIMDify this? It might autovectorize
-  for (int i = 0; i < width*height; i++)
-    dct_filtered_buf[i] = dct_buf[i] * filter[i];
+  filter = new SpectralFilter(width, height, filter_shape, bandpass_start, ring_width);
 }
 
 void render_dct() {
@@ -154,61 +154,155 @@ void render_dct() {
   }
 }
 
-void paint_loop() {
-  auto last_buf_swap = std::chrono::high_resolution_clock::now();
-  int kRefreshPeriod = 33000;
-  uint64_t frame_count = 0;
-  int bandpass_start = 0;
-  int bandpass_end = 0;
-  int bandpass_dir = 5;
-  std::unordered_map<int, uint8_t*> cache;
-  while(1) {
-    bandpass_end += bandpass_dir;
-    printf("Bandpass end: %d\n", bandpass_end);
-    if (bandpass_end >= width || bandpass_end < -1*bandpass_dir)
-      bandpass_dir *= -1;
-    if (!cache.count(bandpass_end)) {
-      create_bandpass(bandpass_start, bandpass_end);
-      do_filter();
+// Moves the band edge one step along its sweep and returns the filtered
+// image for it. Each band is filtered once; the sweep goes back and forth,
+// so later passes come from the cache.
+const uint8_t* next_frame() {
+  bandpass_end += bandpass_dir;
+  printf("Bandpass end: %d\n", bandpass_end);
+  if (bandpass_end >= width || bandpass_end < -1*bandpass_dir)
+    bandpass_dir *= -1;
+  if (!cache.count(bandpass_end)) {
+    {
+      StageScope stage(profiler, "filter");
+      filter->apply(dct_buf, dct_filtered_buf, bandpass_end);
+    }
+    {
+      StageScope stage(profiler, "render");
       render_dct();
-      display->swap_buf(buf);
-      uint8_t* cache_entry = (uint8_t*)malloc(width*height*4);
-      memcpy(cache_entry, buf, width*height*4);
-      cache[bandpass_end] = cache_entry;
-    } else {
-      display->swap_buf(cache[bandpass_end]);
     }
+    uint8_t* cache_entry = (uint8_t*)malloc(width*height*4);
+    memcpy(cache_entry, buf, width*height*4);
+    cache[bandpass_end] = cache_entry;
+  }
+  return cache[bandpass_end];
+}
+
+void paint_loop() {
+  if (profiler)
+    profiler->add_current_thread();
 
-    frame_count++;
+  while(1) {
+    const uint8_t* frame = next_frame();
+    StageScope stage(profiler, "present");
+    scheduler->push_frame(frame);
+  }
+}
 
-    auto curr_time = std::chrono::high_resolution_clock::now();
-    auto time_in_microseconds =
-        std::chrono::duration_cast<std::chrono::microseconds>(curr_time -
-                                                              last_buf_swap);
+void headless_loop(int frames, GoldenRecorder* recorder) {
+  if (profiler)
+    profiler->add_current_thread();
 
-    if (time_in_microseconds.count() < kRefreshPeriod) {
-      usleep(kRefreshPeriod - time_in_microseconds.count());
-    } else {
-      printf("Warning! Frame lag! %lu us\n", time_in_microseconds.count());
-    }
-    last_buf_swap = std::chrono::high_resolution_clock::now();
+  for (int i = 0; i < frames; i++) {
+    const uint8_t* frame = next_frame();
+    recorder->add_frame(frame);
+    StageScope stage(profiler, "present");
+    scheduler->push_frame(frame);
   }
 }
 
+void usage(const char* name) {
+  printf("Usage: %s [-s square|lowpass|highpass|bandpass|annulus|gaussian] [-b band_start] [-r ring_width]\n"
+         "          [-n headless_frames [-W golden_path] [-C golden_path] [-e tolerance]]\n"
+         "          [-E png:pattern|y4m:path|raw:path] [-X shm_name] [-P] image.png\n"
+         "-X publishes frames to a shared memory ring for other processes, see frame_ring.h.\n"
+         "-P reports hardware counters for each stage of the frame loop at exit.\n", name);
+  exit(-1);
+}
+
 int main(int argc, char** argv) {
   time_t t;
 
   srand((unsigned) time(&t));
 
-  read_png_file(argv[1], width, height, buf);
+  EncoderFormat encoder_format;
+  const char* encoder_path = nullptr;
+  const char* publish_name = nullptr;
+  int headless_frames = 0;
+  const char* golden_write_path = nullptr;
+  const char* golden_compare_path = nullptr;
+  int tolerance = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "s:b:r:n:W:C:e:E:PX:")) != -1) {
+    switch (opt) {
+      case 's':
+        if (!parse_filter_shape(optarg, filter_shape)) {
+          printf("Unknown filter shape %s\n", optarg);
+          exit(-1);
+        }
+        break;
+      case 'b':
+        bandpass_start = atoi(optarg);
+        break;
+      case 'r':
+        ring_width = atof(optarg);
+        break;
+      case 'n':
+        headless_frames = atoi(optarg);
+        break;
+      case 'W':
+        golden_write_path = optarg;
+        break;
+      case 'C':
+        golden_compare_path = optarg;
+        break;
+      case 'e':
+        tolerance = atoi(optarg);
+        break;
+      case 'E':
+        if (!parse_encoder_spec(optarg, encoder_format, encoder_path))
+          usage(argv[0]);
+        break;
+      case 'X':
+        publish_name = optarg;
+        break;
+      case 'P':
+        profiler = new StageProfiler();
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (optind >= argc) {
+    usage(argv[0]);
+  }
+
+  read_png_file(argv[optind], width, height, buf);
 
   setup();
 
+  if (encoder_path)
+    encoder = new FrameEncoder(encoder_format, encoder_path, width, height, 1000000 / kRefreshPeriod);
+
+  if (publish_name)
+    publisher = new FramePublisher(publish_name, width, height);
+
+  if (headless_frames) {
+    scheduler = new FrameScheduler(nullptr, width, height, kRenderAheadFrames, kRefreshPeriod);
+    scheduler->set_encoder(encoder);
+    scheduler->set_publisher(publisher);
+    GoldenRecorder recorder(width, height);
+    headless_loop(headless_frames, &recorder);
+    delete encoder;
+    delete publisher;
+    if (profiler)
+      profiler->report();
+    return recorder.finish(golden_write_path, golden_compare_path, kCheckpointProgram, tolerance);
+  }
+
   QApplication app(argc, argv);
 
   display = new QtDisplay(width, height);
+  scheduler = new FrameScheduler(display, width, height, kRenderAheadFrames, kRefreshPeriod);
+  scheduler->set_encoder(encoder);
+  scheduler->set_publisher(publisher);
 
   paint_thread = new std::thread(paint_loop);
 
-  return app.exec();
+  int ret = app.exec();
+  if (publisher)
+    publisher->unlink();
+  if (profiler)
+    profiler->report();
+  return ret;
 }
@@ -0,0 +1,112 @@
+#include "golden.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "checkpoint.h"
+
+struct GoldenDims {
+  int32_t width;
+  int32_t height;
+};
+
+// 64 bit FNV-1a.
+static uint64_t hash_frame(const uint8_t* frame, size_t size) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= frame[i];
+    hash *= 0x100000001b3ULL;
+  }
+
+  return hash;
+}
+
+GoldenRecorder::GoldenRecorder(int width, int height) {
+  this->width = width;
+  this->height = height;
+}
+
+void GoldenRecorder::add_frame(const uint8_t* frame) {
+  hashes.push_back(hash_frame(frame, width*height*4));
+  last_frame.assign(frame, frame + width*height*4);
+}
+
+void GoldenRecorder::write(const char* path, uint32_t program) const {
+  GoldenDims dims;
+  dims.width = width;
+  dims.height = height;
+
+  // The writer flushes on destruction, so the golden is on disk once this
+  // returns.
+  CheckpointWriter writer(path, program);
+  writer.begin(hashes.size());
+  writer.add_section(checkpoint_tag("DIMS"), &dims, sizeof(dims));
+  writer.add_section(checkpoint_tag("HASH"), hashes.data(), hashes.size()*sizeof(uint64_t));
+  writer.add_section(checkpoint_tag("LAST"), last_frame.data(), last_frame.size());
+  writer.commit();
+}
+
+bool GoldenRecorder::compare(const char* path, uint32_t program, int tolerance) const {
+  CheckpointReader reader;
+  if (!reader.open(path, program))
+    return false;
+
+  size_t dims_size, hashes_size, frame_size;
+  const GoldenDims* dims = (const GoldenDims*)reader.section(checkpoint_tag("DIMS"), &dims_size);
+  const uint64_t* golden_hashes = (const uint64_t*)reader.section(checkpoint_tag("HASH"), &hashes_size);
+  const uint8_t* golden_frame = (const uint8_t*)reader.section(checkpoint_tag("LAST"), &frame_size);
+  if (!dims || !golden_hashes || !golden_frame || dims_size != sizeof(GoldenDims) ||
+      dims->width != width || dims->height != height || frame_size != last_frame.size()) {
+    printf("Golden does not match the frame size\n");
+    return false;
+  }
+  if (hashes_size != hashes.size()*sizeof(uint64_t)) {
+    printf("Golden has %lu frames, run has %lu\n", hashes_size / sizeof(uint64_t), hashes.size());
+    return false;
+  }
+
+  if (!tolerance) {
+    for (size_t i = 0; i < hashes.size(); i++) {
+      if (hashes[i] != golden_hashes[i]) {
+        printf("Frame %lu: hash %016lx, golden %016lx\n", i, hashes[i], golden_hashes[i]);
+        return false;
+      }
+    }
+    printf("All %lu frames match\n", hashes.size());
+    return true;
+  }
+
+  int max_diff = 0;
+  uint64_t total_diff = 0;
+  int out_of_tolerance = 0;
+  for (int p = 0; p < width*height; p++) {
+    bool exceeds = false;
+    for (int c = 0; c < 3; c++) {
+      int diff = abs(last_frame[p*4+c] - golden_frame[p*4+c]);
+      if (diff > max_diff)
+        max_diff = diff;
+      total_diff += diff;
+      exceeds |= diff > tolerance;
+    }
+    out_of_tolerance += exceeds;
+  }
+
+  printf("Final frame: max diff %d, mean diff %.4f, pixels over tolerance %d\n",
+         max_diff, (double)total_diff / (width*height*3), out_of_tolerance);
+  return !out_of_tolerance;
+}
+
+int GoldenRecorder::finish(const char* write_path, const char* compare_path, uint32_t program, int tolerance) const {
+  if (!hashes.empty())
+    printf("Final frame hash %016lx\n", hashes.back());
+
+  if (write_path)
+    write(write_path, program);
+  if (compare_path && !compare(compare_path, program, tolerance)) {
+    printf("FAILED\n");
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,32 @@
+#include <stdint.h>
+#include <vector>
+
+#ifndef GOLDEN_H
+#define GOLDEN_H
+
+// Collects the frames of a headless run and checks them against a golden
+// file recorded by an earlier run. Goldens hold a hash of every frame plus
+// the full final frame, so bit-exact paths are checked frame by frame and
+// floating point paths can be checked against a per-channel tolerance.
+class GoldenRecorder {
+private:
+  int width;
+  int height;
+  std::vector<uint64_t> hashes;
+  std::vector<uint8_t> last_frame;
+
+  void write(const char* path, uint32_t program) const;
+  bool compare(const char* path, uint32_t program, int tolerance) const;
+
+public:
+  GoldenRecorder(int width, int height);
+
+  void add_frame(const uint8_t* frame);
+
+  // Writes the golden to |write_path| and/or checks the run against the one
+  // at |compare_path|, either of which may be null. A |tolerance| of 0
+  // requires every frame hash to match. Returns the process exit code.
+  int finish(const char* write_path, const char* compare_path, uint32_t program, int tolerance) const;
+};
+
+#endif
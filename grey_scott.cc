@@ -2,198 +2,845 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <stdint.h>
 #include <png.h>
+#include <algorithm>
+#include <cmath>
 #include <thread>
 
+#include "checkpoint.h"
+#include "colormap.h"
+#include "field_reducer.h"
+#include "frame_encoder.h"
+#include "frame_publisher.h"
+#include "frame_scheduler.h"
+#include "golden.h"
+#include "grey_scott_batch.h"
+#include "halo.h"
+#include "reaction_diffusion.h"
+#include "png_writer.h"
+#include "scalar.h"
+#include "simulation.h"
+#include "spectral_solver.h"
+#include "stage_profiler.h"
+#include "step_controller.h"
+#include "thread_pool.h"
 #include "qt_display.h"
 
 int width = 500;
 int height = 500;
+int grid_width = 500;
+int grid_height = 500;
 uint8_t* buf;
 QtDisplay* display;
+FrameScheduler* scheduler;
+FrameEncoder* encoder = nullptr;
+FramePublisher* publisher = nullptr;
+StepController* controller;
+const int kRefreshPeriod = 33000;
+const int kRenderAheadFrames = 8;
+// Headless runs use a fixed step count per frame instead of the wall clock
+// driven StepController, so their frames are reproducible.
+const int kHeadlessStepsPerFrame = 10;
+const int kSweepTileSize = 96;
+// The explicit solver tracks which parts of the grid are changing in blocks
+// of this many cells on a side.
+const int kActivityTileSize = 32;
 std::thread* paint_thread;
-double* u_concentration;
-double* v_concentration;
-double* grad_x;
-double* grad_y;
-double* double_grad_x;
-double* double_grad_y;
-double* u_laplacian;
-double* v_laplacian;
-
-void compute_x_grad(double* vals, double* out_x) {
-  for (int y = 0; y < height; y++) {
-    for (int x = 0; x < width; x++) {
-      double prev_x, next_x;
+ThreadPool* pool;
+Simulation* sim;
+Precision precision = Precision::kDouble;
+CheckpointWriter* checkpoint_writer = nullptr;
+int checkpoint_interval = 300;
+uint64_t frame_count = 0;
+StageProfiler* profiler = nullptr;
+const uint32_t kCheckpointProgram = checkpoint_tag("GSCT");
 
-      if (x == 0) {
-        prev_x = 0;
-      } else {
-        prev_x = vals[y*width + x - 1];
-      }
-      if (x == width-1) {
-        next_x = 0;
-      } else {
-        next_x = vals[y*width + x + 1];
-      }
+// Leads every checkpoint so a restore can size the grid before constructing
+// the simulation.
+struct CheckpointGrid {
+  int32_t width;
+  int32_t height;
+  int32_t precision;
+  int32_t reserved;
+};
 
-      out_x[y*width + x] = next_x - prev_x;
-    }
-  }
+constexpr GreyScottParams kParams = {
+  .diffusion = 0.05,
+  .replacement = 0.05,
+  .v_decay = 0.05,
+  .reaction = 1.0,
+};
+
+// Coefficients for the explicit kernel's GreyScottModel. The specialized
+// kernels take kParams and the default time step as compile-time
+// constants; any other time step goes through the generic kernel with a
+// RuntimeStepParams.
+struct FixedStepParams {
+  static constexpr double diffusion = kParams.diffusion;
+  static constexpr double replacement = kParams.replacement;
+  static constexpr double v_decay = kParams.v_decay;
+  static constexpr double reaction = kParams.reaction;
+  static constexpr double dt = 1.0;
+};
+
+struct RuntimeStepParams {
+  double diffusion;
+  double replacement;
+  double v_decay;
+  double reaction;
+  double dt;
+};
+
+enum class Solver {
+  kExplicit,
+  kSpectral,
+};
+
+struct GreyScottOptions {
+  int width;
+  int height;
+  int display_width;
+  int display_height;
+  Viewport view;
+  Solver solver;
+  Boundary boundary;
+  double dt;
+  // Tiles whose cells all change by at most this much in a step are quiet.
+  double sleep_epsilon;
+  // Whether quiet tiles sleep. Without it every tile steps every step.
+  bool tile_sleeping;
+  // Whether to use the kernels built for a fixed grid width and time step
+  // when there is one.
+  bool specialized_kernels;
+  const Colormap* colormap;
+  float color_min;
+  float color_max;
+};
+
+// Stores both species as S and does arithmetic in
+// ScalarTraits<S>::compute_type. The fields are halo grids, double
+// buffered so each step reads one pair and writes the other.
+//
+// The explicit solver only steps awake tiles. A tile is awake while it or
+// one of its neighbours changed by more than the sleep epsilon in the last
+// step; otherwise its inputs are (nearly) what they were, so it sleeps and
+// keeps its values until a neighbour becomes active again. With an epsilon
+// of 0 the result is exactly that of stepping every cell, and the large
+// untouched u=1, v=0 region is still skipped.
+template <typename S>
+class GreyScott : public Simulation {
+private:
+  typedef typename ScalarTraits<S>::compute_type C;
+
+  int width;
+  int height;
+  int display_width;
+  int display_height;
+  int stride;
+  Boundary boundary;
+  double dt;
+  ThreadPool* pool;
+  FieldReducer reducer;
+  SpectralGreyScott* spectral;
+  // u is species 0 and v species 1.
+  SpeciesFields<S, 2> fields;
+  float* u_display;
+  float* v_display;
+  const Colormap* colormap;
+  float color_min;
+  float color_max;
+  C sleep_epsilon;
+  bool tile_sleeping;
+  int tiles_x;
+  int tiles_y;
+  uint8_t* tile_awake;
+  uint8_t* tile_changing;
+  int* awake_tiles;
+  int num_awake_tiles;
+  bool specialized_kernels;
+
+  void process();
+  template <int kWidth, typename P>
+  void step_awake_tiles(const P& params);
+  void wake_tiles();
+  void wake_all_tiles();
+  void seed();
+
+public:
+  GreyScott(const GreyScottOptions& options, ThreadPool* pool);
+  ~GreyScott();
+
+  void step() override;
+  void render(uint8_t* buf) override;
+  void save(CheckpointWriter* writer) override;
+  bool restore(const CheckpointReader& reader) override;
+};
+
+template <typename S>
+GreyScott<S>::GreyScott(const GreyScottOptions& options, ThreadPool* pool)
+    : reducer(options.width, options.height, options.display_width, options.display_height, pool),
+      fields(options.width, options.height, pool) {
+  width = options.width;
+  height = options.height;
+  display_width = options.display_width;
+  display_height = options.display_height;
+  stride = halo_stride(width);
+  boundary = options.boundary;
+  dt = options.dt;
+  colormap = options.colormap;
+  color_min = options.color_min;
+  color_max = options.color_max;
+  sleep_epsilon = options.sleep_epsilon;
+  tile_sleeping = options.tile_sleeping;
+  specialized_kernels = options.specialized_kernels;
+  this->pool = pool;
+  reducer.set_viewport(options.view);
+
+  spectral = nullptr;
+  if (options.solver == Solver::kSpectral)
+    spectral = new SpectralGreyScott(width, height, kParams, dt, pool);
+
+  u_display = (float*)malloc(display_width*display_height*sizeof(float));
+  v_display = (float*)malloc(display_width*display_height*sizeof(float));
+
+  tiles_x = (width + kActivityTileSize - 1) / kActivityTileSize;
+  tiles_y = (height + kActivityTileSize - 1) / kActivityTileSize;
+  tile_awake = (uint8_t*)malloc(tiles_x*tiles_y);
+  tile_changing = (uint8_t*)malloc(tiles_x*tiles_y);
+  awake_tiles = (int*)malloc(tiles_x*tiles_y*sizeof(int));
+  wake_all_tiles();
+
+  seed();
 }
 
-void compute_y_grad(double* vals, double* out_y) {
-  for (int y = 0; y < height; y++) {
-    for (int x = 0; x < width; x++) {
-      double prev_y, next_y;
+template <typename S>
+GreyScott<S>::~GreyScott() {
+  delete spectral;
+  free(u_display);
+  free(v_display);
+  free(tile_awake);
+  free(tile_changing);
+  free(awake_tiles);
+}
 
-      if (y == 0) {
-        prev_y = 0;
-      } else {
-        prev_y = vals[(y-1)*width + x];
-      }
-      if (y == width-1) {
-        next_y = 0;
-      } else {
-        next_y = vals[(y+1)*width + x];
+// Marks every tile as changing, so the next step runs the whole grid.
+template <typename S>
+void GreyScott<S>::wake_all_tiles() {
+  memset(tile_awake, 1, tiles_x*tiles_y);
+  memset(tile_changing, 1, tiles_x*tiles_y);
+}
+
+// Collects the tiles next to a changing one into |awake_tiles|, or every
+// tile without sleeping. A tile that falls asleep is copied into the buffer
+// about to be written, so both buffers hold its values for as long as it
+// sleeps.
+template <typename S>
+void GreyScott<S>::wake_tiles() {
+  bool periodic = boundary == Boundary::kPeriodic;
+  num_awake_tiles = 0;
+  for (int ty = 0; ty < tiles_y; ty++) {
+    for (int tx = 0; tx < tiles_x; tx++) {
+      bool awake = !tile_sleeping;
+      for (int dy = -1; dy <= 1 && !awake; dy++) {
+        for (int dx = -1; dx <= 1 && !awake; dx++) {
+          int ny = ty + dy;
+          int nx = tx + dx;
+          if (periodic) {
+            ny = (ny + tiles_y) % tiles_y;
+            nx = (nx + tiles_x) % tiles_x;
+          } else if (ny < 0 || ny >= tiles_y || nx < 0 || nx >= tiles_x) {
+            continue;
+          }
+          awake = tile_changing[ny*tiles_x + nx];
+        }
       }
 
-      out_y[y*width + x] = next_y - prev_y;
+      int idx = ty*tiles_x + tx;
+      if (tile_awake[idx] && !awake) {
+        int x0 = tx*kActivityTileSize;
+        int x1 = std::min(x0 + kActivityTileSize, width);
+        int y1 = std::min((ty+1)*kActivityTileSize, height);
+        for (int y = ty*kActivityTileSize; y < y1; y++) {
+          for (int s = 0; s < 2; s++)
+            memcpy(fields.next[s] + y*stride + x0, fields.current[s] + y*stride + x0, (x1 - x0)*sizeof(S));
+        }
+      }
+      tile_awake[idx] = awake;
+      if (awake)
+        awake_tiles[num_awake_tiles++] = idx;
     }
   }
+
+  // Sleeping tiles don't change; awake ones are measured as they step.
+  memset(tile_changing, 0, tiles_x*tiles_y);
 }
 
-void compute_laplacian() {
-  compute_x_grad(u_concentration, grad_x);
-  compute_x_grad(grad_x, double_grad_x);
-  compute_y_grad(u_concentration, grad_y);
-  compute_y_grad(grad_y, double_grad_y);
+// kWidth is 0 for the generic kernel. Whole tiles of a specialized kernel
+// also get a fixed row length; only the last column of tiles can be
+// narrower.
+template <typename S>
+template <int kWidth, typename P>
+void GreyScott<S>::step_awake_tiles(const P& params) {
+  GreyScottModel<P> model(params);
+  pool->parallel_for(0, num_awake_tiles, [&](int begin, int end) {
+    const int kStride = kWidth ? halo_stride(kWidth) : 0;
+    for (int i = begin; i < end; i++) {
+      int idx = awake_tiles[i];
+      int x0 = (idx % tiles_x)*kActivityTileSize;
+      int x1 = std::min(x0 + kActivityTileSize, width);
+      int y0 = (idx / tiles_x)*kActivityTileSize;
+      int y1 = std::min(y0 + kActivityTileSize, height);
+      bool changing = false;
 
-  for (int y = 0; y < height; y++) {
-    for (int x = 0; x < width; x++) {
-      u_laplacian[y*width + x] = double_grad_x[y*width + x] + double_grad_y[y*width + x];
+      for (int y = y0; y < y1; y++) {
+        size_t offset = (size_t)y*stride + x0;
+        if (kWidth && x1 - x0 == kActivityTileSize) {
+          changing |= step_species_row<S, GreyScottModel<P>, kStride, kActivityTileSize, true>(
+              fields, offset, x1 - x0, model, sleep_epsilon);
+        } else {
+          changing |= step_species_row<S, GreyScottModel<P>, kStride, 0, true>(
+              fields, offset, x1 - x0, model, sleep_epsilon);
+        }
+      }
+      tile_changing[idx] = changing;
     }
+  });
+}
+
+template <typename S>
+void GreyScott<S>::process() {
+  if (spectral) {
+    spectral->step(fields.current[0], fields.current[1], stride);
+    return;
   }
 
-  compute_x_grad(v_concentration, grad_x);
-  compute_x_grad(grad_x, double_grad_x);
-  compute_y_grad(v_concentration, grad_y);
-  compute_y_grad(grad_y, double_grad_y);
+  fields.fill_halo(boundary);
+  wake_tiles();
 
+  bool specialized = specialized_kernels && dt == FixedStepParams::dt &&
+                     dispatch_specialized_width(width, [this](auto fixed_width) {
+                       step_awake_tiles<decltype(fixed_width)::value>(FixedStepParams());
+                     });
+  if (!specialized) {
+    RuntimeStepParams params = {kParams.diffusion, kParams.replacement, kParams.v_decay, kParams.reaction, dt};
+    step_awake_tiles<0>(params);
+  }
+
+  fields.swap();
+}
+
+template <typename S>
+void GreyScott<S>::seed() {
   for (int y = 0; y < height; y++) {
     for (int x = 0; x < width; x++) {
-      v_laplacian[y*width + x] = double_grad_x[y*width + x] + double_grad_y[y*width + x];
+      fields.current[0][y*stride + x] = 1.0;
+      fields.current[1][y*stride + x] = 0.0;
     }
   }
+
+  fields.current[1][(height/2)*stride + width/2] = 1.0;
+  fields.current[1][(height/2)*stride + width/2+1] = 1.0;
+  fields.current[1][(height/2+1)*stride + width/2] = 1.0;
+  fields.current[1][(height/2+1)*stride + width/2+1] = 1.0;
 }
 
-void process() {
-  double diffusion_coefficient = 0.05;
-  double replacement_coefficient = 0.05;
-  double v_decay = 0.05;
-  double reaction_coefficient = 1.0;
-  double step = 1.0;
+template <typename S>
+void GreyScott<S>::step() {
+  process();
+}
 
-  compute_laplacian();
+template <typename S>
+void GreyScott<S>::render(uint8_t* buf) {
+  // With a colormap only v is shown, since it carries the patterns.
+  if (!colormap)
+    reducer.reduce(fields.current[0], u_display, stride);
+  reducer.reduce(fields.current[1], v_display, stride);
 
-  for (int y = 0; y < height; y++) {
-    for (int x = 0; x < width; x++) {
-      double u_val = u_concentration[y*width + x];
-      double v_val = v_concentration[y*width + x];
-      u_concentration[y*width + x] += step * (diffusion_coefficient*u_laplacian[y*width+x]
-                                              - reaction_coefficient * u_val * v_val * v_val
-                                              + replacement_coefficient*(1.0 - u_val));
-      v_concentration[y*width + x] += step * (diffusion_coefficient*v_laplacian[y*width+x]
-                                              + reaction_coefficient * u_val * v_val * v_val
-                                              - (replacement_coefficient + v_decay) * v_val);
-    }
-  }
+  uint32_t* color_buf = (uint32_t*)buf;
+  pool->parallel_for(0, display_height, [&](int begin, int end) {
+    int offset = begin*display_width;
+    int count = (end - begin)*display_width;
+    if (colormap)
+      colormap->apply(v_display + offset, color_buf + offset, count, color_min, color_max);
+    else
+      pack_blue_green(u_display + offset, v_display + offset, color_buf + offset, count);
+  });
 }
 
-uint64_t frame = 0;
+template <typename S>
+void GreyScott<S>::save(CheckpointWriter* writer) {
+  writer->add_section(checkpoint_tag("UCON"), fields.current[0], width*sizeof(S), height, stride*sizeof(S));
+  writer->add_section(checkpoint_tag("VCON"), fields.current[1], width*sizeof(S), height, stride*sizeof(S));
+}
+
+template <typename S>
+bool GreyScott<S>::restore(const CheckpointReader& reader) {
+  size_t u_size, v_size;
+  const void* u_data = reader.section(checkpoint_tag("UCON"), &u_size);
+  const void* v_data = reader.section(checkpoint_tag("VCON"), &v_size);
+  if (!u_data || !v_data || u_size != width*height*sizeof(S) || v_size != width*height*sizeof(S))
+    return false;
 
-void seed() {
   for (int y = 0; y < height; y++) {
-    for (int x = 0; x < width; x++) {
-      u_concentration[y*width + x] = 1.0;
-      v_concentration[y*width + x] = 0.0;
-    }
+    memcpy(fields.current[0] + y*stride, (const S*)u_data + y*width, width*sizeof(S));
+    memcpy(fields.current[1] + y*stride, (const S*)v_data + y*width, width*sizeof(S));
   }
+  wake_all_tiles();
+  return true;
+}
 
-  v_concentration[(height/2)*width + width/2] = 1.0;
-  v_concentration[(height/2)*width + width/2+1] = 1.0;
-  v_concentration[(height/2+1)*width + width/2] = 1.0;
-  v_concentration[(height/2+1)*width + width/2+1] = 1.0;
+Simulation* make_simulation(Precision precision, const GreyScottOptions& options) {
+  switch (precision) {
+    case Precision::kFloat:
+      return new GreyScott<float>(options, pool);
+    case Precision::kHalf:
+      return new GreyScott<Half>(options, pool);
+    case Precision::kBFloat16:
+      return new GreyScott<BFloat16>(options, pool);
+    default:
+      return new GreyScott<double>(options, pool);
+  }
 }
 
-void render() {
-  for (int y = 0; y < height; y++) {
-    for (int x = 0; x < width; x++) {
-      double u_val = u_concentration[y*width + x] * 255.0;
-      if (u_val > 255.0)
-        u_val = 255.0;
-      if (u_val < 0.0)
-        u_val = 0;
-      double v_val = v_concentration[y*width + x] * 255.0;
-      if (v_val > 255.0)
-        v_val = 255.0;
-      if (v_val < 0.0)
-        v_val = 0;
+void save_checkpoint() {
+  if (!checkpoint_writer->begin(frame_count))
+    return;
 
-      buf[4*(y*width+x)] = u_val;
-      buf[4*(y*width+x)+1] = v_val;
-      buf[4*(y*width+x)+2] = 0;
-      buf[4*(y*width+x)+3] = 255;
-    }
-  }
+  CheckpointGrid grid;
+  grid.width = grid_width;
+  grid.height = grid_height;
+  grid.precision = (int32_t)precision;
+  grid.reserved = 0;
+  checkpoint_writer->add_section(checkpoint_tag("GRID"), &grid, sizeof(grid));
+  sim->save(checkpoint_writer);
+  checkpoint_writer->commit();
 }
 
 void paint_loop() {
-  auto last_buf_swap = std::chrono::high_resolution_clock::now();
-  int kRefreshPeriod = 33000;
-  uint64_t frame_count = 0;
-  seed();
+  if (profiler)
+    profiler->add_current_thread();
+
   while(1) {
-    process();
-    render();
+    int steps = controller->steps();
+    {
+      StageScope stage(profiler, "step");
+      auto step_start = std::chrono::high_resolution_clock::now();
+      for (int i = 0; i < steps; i++)
+        sim->step();
+      auto step_end = std::chrono::high_resolution_clock::now();
+      controller->record_steps(steps, std::chrono::duration_cast<std::chrono::microseconds>(step_end - step_start).count());
+    }
+
+    {
+      StageScope stage(profiler, "wait");
+      buf = scheduler->begin_frame();
+    }
+    {
+      StageScope stage(profiler, "render");
+      auto render_start = std::chrono::high_resolution_clock::now();
+      sim->render(buf);
+      auto render_end = std::chrono::high_resolution_clock::now();
+      controller->record_render(std::chrono::duration_cast<std::chrono::microseconds>(render_end - render_start).count());
+    }
+    {
+      StageScope stage(profiler, "present");
+      scheduler->end_frame(controller->periods());
+    }
 
-    display->swap_buf(buf);
+    frame_count++;
+    if (checkpoint_writer && frame_count % checkpoint_interval == 0) {
+      StageScope stage(profiler, "checkpoint");
+      save_checkpoint();
+    }
+  }
+}
 
-    auto curr_time = std::chrono::high_resolution_clock::now();
-    auto time_in_microseconds =
-        std::chrono::duration_cast<std::chrono::microseconds>(curr_time -
-                                                              last_buf_swap);
+void headless_loop(int frames, GoldenRecorder* recorder) {
+  if (profiler)
+    profiler->add_current_thread();
 
-    if (time_in_microseconds.count() < kRefreshPeriod) {
-      usleep(kRefreshPeriod - time_in_microseconds.count());
-    } else {
-      printf("Warning! Frame lag! %lu us\n", time_in_microseconds.count());
+  for (int frame = 0; frame < frames; frame++) {
+    {
+      StageScope stage(profiler, "step");
+      for (int i = 0; i < kHeadlessStepsPerFrame; i++)
+        sim->step();
+    }
+    {
+      StageScope stage(profiler, "wait");
+      buf = scheduler->begin_frame();
+    }
+    {
+      StageScope stage(profiler, "render");
+      sim->render(buf);
+    }
+    recorder->add_frame(buf);
+    {
+      StageScope stage(profiler, "present");
+      scheduler->end_frame();
     }
-    last_buf_swap = std::chrono::high_resolution_clock::now();
   }
 }
 
+// Runs one simulation per (F, k, D) combination and tiles the results into
+// an atlas. Columns sweep the feed rate F, rows sweep the kill rate k, and
+// each value of D gets its own band of rows.
+void run_sweep(const SweepRange& feed, const SweepRange& kill, const SweepRange& diffusion,
+               int steps, double dt, const char* atlas_path) {
+  std::vector<GreyScottParams> params;
+  for (int d = 0; d < diffusion.count; d++) {
+    for (int k = 0; k < kill.count; k++) {
+      for (int f = 0; f < feed.count; f++) {
+        GreyScottParams param = kParams;
+        param.replacement = feed.value(f);
+        param.v_decay = kill.value(k);
+        param.diffusion = diffusion.value(d);
+        params.push_back(param);
+        printf("tile (%d, %d): F=%.4f k=%.4f D=%.4f\n", f, d*kill.count + k,
+               param.replacement, param.v_decay, param.diffusion);
+      }
+    }
+  }
+
+  GreyScottBatch batch(grid_width, grid_height, params, dt, pool);
+
+  auto start = std::chrono::high_resolution_clock::now();
+  for (int i = 1; i <= steps; i++) {
+    batch.step();
+    if (i % 1000 == 0 || i == steps) {
+      auto now = std::chrono::high_resolution_clock::now();
+      double seconds = std::chrono::duration_cast<std::chrono::microseconds>(now - start).count() / 1e6;
+      printf("step %d/%d, %.0f cell updates/s\n", i, steps, (double)i * grid_width * grid_height * batch.size() / seconds);
+    }
+  }
+
+  int atlas_width = feed.count * grid_width;
+  int atlas_height = kill.count * diffusion.count * grid_height;
+  uint8_t* atlas = (uint8_t*)malloc(atlas_width*atlas_height*3);
+  for (int idx = 0; idx < batch.size(); idx++) {
+    int tile_x = idx % feed.count;
+    int tile_y = idx / feed.count;
+    batch.render_tile(idx, atlas + (tile_y*grid_height*atlas_width + tile_x*grid_width)*3, atlas_width*3);
+  }
+
+  write_png_file(atlas_path, atlas_width, atlas_height, atlas, PixelLayout::kRGB);
+  free(atlas);
+}
+
+void usage(const char* name) {
+  printf("Usage: %s [-p double|float|half|bfloat16] [-a accuracy_steps] [-g grid_width x grid_height]\n"
+         "          [-d display_width x display_height] [-z zoom] [-o center_x,center_y]\n"
+         "          [-s explicit|spectral] [-t time_step] [-B zero|periodic|reflective] [-q sleep_epsilon|off]\n"
+         "          [-N none|cpu|node] [-T benchmark_steps]\n"
+         "          [-c checkpoint_path] [-k checkpoint_interval_frames] [-r restore_path]\n"
+         "          [-m grey|viridis|inferno|#rrggbb,#rrggbb,...] [-L 256|4096] [-l color_min:color_max]\n"
+         "          [-n headless_frames [-W golden_path] [-C golden_path] [-e tolerance]]\n"
+         "          [-E png:pattern|y4m:path|raw:path] [-X shm_name] [-P]\n"
+         "          [-A atlas.png [-F feed_sweep] [-K kill_sweep] [-D diffusion_sweep] [-b sweep_steps]]\n"
+         "-T times that many explicit steps with the kernel specialized for the grid width against the\n"
+         "generic one, with every tile awake. Widths 500, 512, 1024, 2048 and 4096 at the default time\n"
+         "step have one.\n"
+         "Sweeps are min:max:count or a single value. A sleep epsilon of 0 steps exactly like the full grid;\n"
+         "-q off also steps the tiles that aren't changing at all.\n"
+         "-N pins the simulation workers to a CPU or a NUMA node each, spread over all nodes.\n"
+         "-X publishes frames to a shared memory ring for other processes, see frame_ring.h.\n"
+         "-P reports hardware counters for each stage of the frame loop at exit, plus the achieved steps/s\n"
+         "for GUI runs.\n", name);
+  exit(-1);
+}
+
 int main(int argc, char** argv) {
   time_t t;
 
   srand((unsigned) time(&t));
 
-  buf = (uint8_t*)malloc(width*height*4);
-  u_concentration = (double*)malloc(width*height*sizeof(double));
-  v_concentration = (double*)malloc(width*height*sizeof(double));
-  grad_x = (double*)malloc(width*height*sizeof(double));
-  grad_y = (double*)malloc(width*height*sizeof(double));
-  double_grad_x = (double*)malloc(width*height*sizeof(double));
-  double_grad_y = (double*)malloc(width*height*sizeof(double));
-  u_laplacian = (double*)malloc(width*height*sizeof(double));
-  v_laplacian = (double*)malloc(width*height*sizeof(double));
+  int accuracy_steps = 0;
+  int benchmark_steps = 0;
+  Viewport view;
+  view.zoom = 1.0;
+  bool has_center = false;
+  Solver solver = Solver::kExplicit;
+  Boundary boundary = Boundary::kZero;
+  ThreadPinning pinning = ThreadPinning::kNone;
+  double dt = 1.0;
+  double sleep_epsilon = 1e-6;
+  bool tile_sleeping = true;
+  const char* checkpoint_path = nullptr;
+  const char* restore_path = nullptr;
+  int headless_frames = 0;
+  const char* golden_write_path = nullptr;
+  const char* golden_compare_path = nullptr;
+  int tolerance = 0;
+  const char* colormap_spec = nullptr;
+  int lut_size = 256;
+  float color_min = 0;
+  float color_max = 0.5;
+  const char* atlas_path = nullptr;
+  SweepRange feed = {0.01, 0.09, 16};
+  SweepRange kill = {0.03, 0.07, 16};
+  SweepRange diffusion = {kParams.diffusion, kParams.diffusion, 1};
+  int sweep_steps = 5000;
+  bool has_grid = false;
+  EncoderFormat encoder_format;
+  const char* encoder_path = nullptr;
+  const char* publish_name = nullptr;
+  bool profile = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "p:a:g:d:z:o:s:t:c:k:r:n:W:C:e:A:F:K:D:b:m:L:l:E:B:q:PX:N:T:")) != -1) {
+    switch (opt) {
+      case 'p':
+        if (!parse_precision(optarg, precision))
+          usage(argv[0]);
+        break;
+      case 'a':
+        accuracy_steps = atoi(optarg);
+        break;
+      case 'T':
+        benchmark_steps = atoi(optarg);
+        break;
+      case 'g':
+        if (sscanf(optarg, "%dx%d", &grid_width, &grid_height) != 2 || grid_width <= 0 || grid_height <= 0)
+          usage(argv[0]);
+        has_grid = true;
+        break;
+      case 'd':
+        if (sscanf(optarg, "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0)
+          usage(argv[0]);
+        break;
+      case 'z':
+        view.zoom = atof(optarg);
+        if (view.zoom <= 0)
+          usage(argv[0]);
+        break;
+      case 'o':
+        if (sscanf(optarg, "%lf,%lf", &view.center_x, &view.center_y) != 2)
+          usage(argv[0]);
+        has_center = true;
+        break;
+      case 's':
+        if (!strcmp(optarg, "spectral"))
+          solver = Solver::kSpectral;
+        else if (strcmp(optarg, "explicit"))
+          usage(argv[0]);
+        break;
+      case 't':
+        dt = atof(optarg);
+        break;
+      case 'B':
+        if (!parse_boundary(optarg, boundary))
+          usage(argv[0]);
+        break;
+      case 'N':
+        if (!parse_thread_pinning(optarg, pinning))
+          usage(argv[0]);
+        break;
+      case 'q':
+        if (!strcmp(optarg, "off")) {
+          tile_sleeping = false;
+          break;
+        }
+        sleep_epsilon = atof(optarg);
+        if (sleep_epsilon < 0)
+          usage(argv[0]);
+        break;
+      case 'c':
+        checkpoint_path = optarg;
+        break;
+      case 'k':
+        checkpoint_interval = atoi(optarg);
+        if (checkpoint_interval <= 0)
+          usage(argv[0]);
+        break;
+      case 'r':
+        restore_path = optarg;
+        break;
+      case 'n':
+        headless_frames = atoi(optarg);
+        break;
+      case 'W':
+        golden_write_path = optarg;
+        break;
+      case 'C':
+        golden_compare_path = optarg;
+        break;
+      case 'e':
+        tolerance = atoi(optarg);
+        break;
+      case 'm':
+        colormap_spec = optarg;
+        break;
+      case 'L':
+        lut_size = atoi(optarg);
+        break;
+      case 'l':
+        if (sscanf(optarg, "%f:%f", &color_min, &color_max) != 2 || color_max <= color_min)
+          usage(argv[0]);
+        break;
+      case 'A':
+        atlas_path = optarg;
+        break;
+      case 'F':
+        if (!parse_sweep_range(optarg, feed))
+          usage(argv[0]);
+        break;
+      case 'K':
+        if (!parse_sweep_range(optarg, kill))
+          usage(argv[0]);
+        break;
+      case 'D':
+        if (!parse_sweep_range(optarg, diffusion))
+          usage(argv[0]);
+        break;
+      case 'b':
+        sweep_steps = atoi(optarg);
+        break;
+      case 'E':
+        if (!parse_encoder_spec(optarg, encoder_format, encoder_path))
+          usage(argv[0]);
+        break;
+      case 'X':
+        publish_name = optarg;
+        break;
+      case 'P':
+        profile = true;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+
+  if (atlas_path) {
+    if (!has_grid)
+      grid_width = grid_height = kSweepTileSize;
+    pool = new ThreadPool(0, pinning);
+    run_sweep(feed, kill, diffusion, sweep_steps, dt, atlas_path);
+    return 0;
+  }
+
+  // The checkpoint's grid and precision take precedence over the flags, since
+  // the saved state only makes sense on the grid it was computed on.
+  CheckpointReader reader;
+  if (restore_path) {
+    if (!reader.open(restore_path, kCheckpointProgram))
+      exit(-1);
+
+    size_t grid_size;
+    const CheckpointGrid* grid = (const CheckpointGrid*)reader.section(checkpoint_tag("GRID"), &grid_size);
+    if (!grid || grid_size != sizeof(CheckpointGrid)) {
+      printf("Checkpoint is missing its grid description\n");
+      exit(-1);
+    }
+    if (grid->width <= 0 || grid->height <= 0 ||
+        grid->width > kCheckpointMaxGridSide || grid->height > kCheckpointMaxGridSide) {
+      printf("Checkpoint has invalid grid %dx%d\n", grid->width, grid->height);
+      exit(-1);
+    }
+    if (grid->precision < (int32_t)Precision::kDouble || grid->precision > (int32_t)Precision::kBFloat16) {
+      printf("Checkpoint has unknown precision %d\n", grid->precision);
+      exit(-1);
+    }
+    grid_width = grid->width;
+    grid_height = grid->height;
+    precision = (Precision)grid->precision;
+    frame_count = reader.frame();
+  }
+
+  if (!has_center) {
+    view.center_x = grid_width / 2.0;
+    view.center_y = grid_height / 2.0;
+  }
+
+  GreyScottOptions options;
+  options.width = grid_width;
+  options.height = grid_height;
+  options.display_width = width;
+  options.display_height = height;
+  options.view = view;
+  options.solver = solver;
+  options.boundary = boundary;
+  options.dt = dt;
+  options.sleep_epsilon = sleep_epsilon;
+  // Benchmarks step the whole grid. With sleeping, most of a freshly seeded
+  // grid is skipped and the runs would mostly time the tile bookkeeping.
+  options.tile_sleeping = tile_sleeping && !benchmark_steps;
+  options.specialized_kernels = true;
+  options.colormap = nullptr;
+  if (colormap_spec) {
+    options.colormap = parse_colormap(colormap_spec, lut_size);
+    if (!options.colormap)
+      usage(argv[0]);
+  }
+  options.color_min = color_min;
+  options.color_max = color_max;
+
+  pool = new ThreadPool(0, pinning);
+  if (profile) {
+    profiler = new StageProfiler();
+    profiler->add_pool(pool);
+  }
+  sim = make_simulation(precision, options);
+  if (restore_path && !sim->restore(reader)) {
+    printf("Checkpoint does not match the simulation\n");
+    exit(-1);
+  }
+  if (checkpoint_path)
+    checkpoint_writer = new CheckpointWriter(checkpoint_path, kCheckpointProgram);
+
+  if (accuracy_steps) {
+    Simulation* reference = make_simulation(Precision::kDouble, options);
+    compare_to_reference(reference, sim, width, height, accuracy_steps, accuracy_steps / 10 + 1);
+    return 0;
+  }
+
+  if (benchmark_steps) {
+    if (solver != Solver::kExplicit || dt != FixedStepParams::dt ||
+        !dispatch_specialized_width(grid_width, [](auto) {})) {
+      printf("No specialized kernel for this grid, solver and time step, both runs are generic\n");
+    }
+    options.specialized_kernels = false;
+    Simulation* generic = make_simulation(precision, options);
+    if (restore_path)
+      generic->restore(reader);
+    benchmark_kernels(sim, generic, width, height, benchmark_steps);
+    return 0;
+  }
+
+  if (encoder_path)
+    encoder = new FrameEncoder(encoder_format, encoder_path, width, height, 1000000 / kRefreshPeriod);
+
+  if (publish_name)
+    publisher = new FramePublisher(publish_name, width, height);
+
+  if (headless_frames) {
+    scheduler = new FrameScheduler(nullptr, width, height, kRenderAheadFrames, kRefreshPeriod);
+    scheduler->set_encoder(encoder);
+    scheduler->set_publisher(publisher);
+    GoldenRecorder recorder(width, height);
+    headless_loop(headless_frames, &recorder);
+    delete encoder;
+    delete publisher;
+    if (profiler)
+      profiler->report();
+    return recorder.finish(golden_write_path, golden_compare_path, kCheckpointProgram, tolerance);
+  }
 
   QApplication app(argc, argv);
 
   display = new QtDisplay(width, height);
+  scheduler = new FrameScheduler(display, width, height, kRenderAheadFrames, kRefreshPeriod);
+  scheduler->set_encoder(encoder);
+  scheduler->set_publisher(publisher);
+  controller = new StepController(kRefreshPeriod);
 
   paint_thread = new std::thread(paint_loop);
 
-  return app.exec();
+  int ret = app.exec();
+  if (publisher)
+    publisher->unlink();
+  if (profiler) {
+    profiler->report();
+    printf("Achieved %.0f steps/s\n", controller->achieved_steps_per_second());
+  }
+  return ret;
 }
@@ -0,0 +1,574 @@
+#include <QApplication>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+#include "checkpoint.h"
+#include "colormap.h"
+#include "field_reducer.h"
+#include "frame_encoder.h"
+#include "frame_publisher.h"
+#include "frame_scheduler.h"
+#include "golden.h"
+#include "grid_memory.h"
+#include "halo.h"
+#include "stage_profiler.h"
+#include "step_controller.h"
+#include "thread_pool.h"
+#include "qt_display.h"
+
+int width = 512;
+int height = 512;
+int grid_width = 256;
+int grid_height = 256;
+int grid_depth = 256;
+QtDisplay* display;
+FrameScheduler* scheduler;
+FrameEncoder* encoder = nullptr;
+FramePublisher* publisher = nullptr;
+StepController* controller;
+const int kRefreshPeriod = 33000;
+const int kRenderAheadFrames = 8;
+// Headless runs use a fixed step count per frame instead of the wall clock
+// driven StepController, so their frames are reproducible.
+const int kHeadlessStepsPerFrame = 10;
+// Rows a worker steps together while streaming through the volume plane by
+// plane. The planes the stencil reads for one block then stay in the L2
+// cache from one plane to the next, instead of every plane being fetched
+// from memory five times.
+const int kBlockRows = 8;
+std::thread* paint_thread;
+std::thread* render_thread;
+ThreadPool* pool;
+StageProfiler* profiler = nullptr;
+const uint32_t kGoldenProgram = checkpoint_tag("GS3D");
+
+struct VolumeParams {
+  double u_diffusion;
+  double v_diffusion;
+  double replacement;
+  double v_decay;
+  double reaction;
+};
+
+// The 2D parameters die out in a volume, where the seed loses v to six
+// neighbours instead of four. With u diffusing twice as fast as v the seed
+// grows into the usual Turing patterns. The spacing 2 Laplacian of the 2D
+// simulation becomes a 7-point stencil, stable with a time step of 1 for
+// diffusion up to 1/6.
+const VolumeParams kParams = {
+  .u_diffusion = 0.1,
+  .v_diffusion = 0.05,
+  .replacement = 0.03,
+  .v_decay = 0.06,
+  .reaction = 1.0,
+};
+
+// How the volume is flattened for the display.
+enum class VolumeView {
+  // Maximum of v along z.
+  kProjection,
+  // One z plane of v.
+  kSlice,
+};
+
+// Both species as floats in halo volumes, double buffered. Rows are
+// halo_stride(width) floats apart and planes are the (height + 2*kHalo)
+// rows of one z layer, so cell (x, y, z) is at
+// field[z*plane_stride + y*stride + x].
+class GreyScottVolume {
+private:
+  int width;
+  int height;
+  int depth;
+  int stride;
+  size_t plane_stride;
+  Boundary boundary;
+  float dt;
+  ThreadPool* pool;
+  float* u;
+  float* v;
+  float* next_u;
+  float* next_v;
+
+  size_t field_size() const { return plane_stride*(depth + 2*kHalo)*sizeof(float); }
+  float* alloc_field();
+  void free_field(float* field);
+  void fill_halo(float* field);
+  void seed();
+
+public:
+  GreyScottVolume(int width, int height, int depth, Boundary boundary, double dt, ThreadPool* pool);
+  ~GreyScottVolume();
+
+  // Advances by one step. If |view_out| is given it receives the width x
+  // height image of v after the step, taken as the stencil writes it, so
+  // flattening the volume costs no extra pass over it.
+  void step(VolumeView view, int slice, float* view_out);
+};
+
+GreyScottVolume::GreyScottVolume(int width, int height, int depth, Boundary boundary, double dt, ThreadPool* pool) {
+  this->width = width;
+  this->height = height;
+  this->depth = depth;
+  this->boundary = boundary;
+  this->dt = dt;
+  this->pool = pool;
+  stride = halo_stride(width);
+  plane_stride = (size_t)stride*(height + 2*kHalo);
+
+  u = alloc_field();
+  v = alloc_field();
+  next_u = alloc_field();
+  next_v = alloc_field();
+
+  seed();
+}
+
+GreyScottVolume::~GreyScottVolume() {
+  free_field(u);
+  free_field(v);
+  free_field(next_u);
+  free_field(next_v);
+}
+
+// Zeroed by the same blocks of rows step() gives each worker, in every
+// plane, so a worker's rows sit on its own NUMA node. A worker's share of
+// one plane is all that is contiguous, so that decides on huge pages.
+float* GreyScottVolume::alloc_field() {
+  size_t size = field_size();
+  size_t plane_size = plane_stride*sizeof(float);
+  float* base = (float*)map_grid_memory(size, use_huge_pages(plane_size / pool->size()));
+
+  int num_blocks = (height + kBlockRows - 1) / kBlockRows;
+  pool->parallel_for(0, num_blocks, [&](int begin, int end) {
+    int first = begin ? begin*kBlockRows + kHalo : 0;
+    int last = end < num_blocks ? end*kBlockRows + kHalo : height + 2*kHalo;
+    for (int z = 0; z < depth + 2*kHalo; z++)
+      memset(base + z*plane_stride + (size_t)first*stride, 0, (size_t)(last - first)*stride*sizeof(float));
+  });
+  return base + kHalo*plane_stride + kHalo*stride + kHalo;
+}
+
+void GreyScottVolume::free_field(float* field) {
+  unmap_grid_memory(field - kHalo*plane_stride - kHalo*stride - kHalo, field_size());
+}
+
+// Like the 2D fill_halo(): x, then whole padded rows, then whole padded
+// planes, which fills edges and corners too.
+void GreyScottVolume::fill_halo(float* field) {
+  if (boundary == Boundary::kZero)
+    return;
+
+  pool->parallel_for(0, depth, [&](int begin, int end) {
+    for (int z = begin; z < end; z++) {
+      float* plane = field + z*plane_stride;
+      for (int y = 0; y < height; y++) {
+        float* row = plane + y*stride;
+        for (int i = 1; i <= kHalo; i++) {
+          row[-i] = row[halo_source(-i, width, boundary)];
+          row[width-1+i] = row[halo_source(width-1+i, width, boundary)];
+        }
+      }
+      for (int i = 1; i <= kHalo; i++) {
+        memcpy(plane + (-i)*stride - kHalo, plane + halo_source(-i, height, boundary)*stride - kHalo,
+               stride*sizeof(float));
+        memcpy(plane + (height-1+i)*stride - kHalo, plane + halo_source(height-1+i, height, boundary)*stride - kHalo,
+               stride*sizeof(float));
+      }
+    }
+  });
+
+  float* first_plane = field - kHalo*stride - kHalo;
+  for (int i = 1; i <= kHalo; i++) {
+    memcpy(first_plane + (-i)*plane_stride, first_plane + halo_source(-i, depth, boundary)*plane_stride,
+           plane_stride*sizeof(float));
+    memcpy(first_plane + (depth-1+i)*plane_stride, first_plane + halo_source(depth-1+i, depth, boundary)*plane_stride,
+           plane_stride*sizeof(float));
+  }
+}
+
+// A 2x2x2 seed in the middle, which covers every sublattice of the spacing
+// 2 stencil.
+void GreyScottVolume::seed() {
+  pool->parallel_for(0, depth, [&](int begin, int end) {
+    for (int z = begin; z < end; z++) {
+      for (int y = 0; y < height; y++)
+        std::fill(u + z*plane_stride + y*stride, u + z*plane_stride + y*stride + width, 1.0f);
+    }
+  });
+
+  for (int z = depth/2; z <= depth/2 + 1; z++) {
+    for (int y = height/2; y <= height/2 + 1; y++) {
+      for (int x = width/2; x <= width/2 + 1; x++)
+        v[z*plane_stride + y*stride + x] = 1.0;
+    }
+  }
+}
+
+// Blocks of kBlockRows rows are spread over the pool, and each streams
+// through z. The x loop is unit stride with fixed offsets, so it
+// vectorizes.
+void GreyScottVolume::step(VolumeView view, int slice, float* view_out) {
+  float u_diffusion = kParams.u_diffusion;
+  float v_diffusion = kParams.v_diffusion;
+  float replacement = kParams.replacement;
+  float v_decay = kParams.v_decay;
+  float reaction = kParams.reaction;
+  float step = dt;
+  int x_offset = 2;
+  int y_offset = 2*stride;
+  ptrdiff_t z_offset = 2*(ptrdiff_t)plane_stride;
+
+  fill_halo(u);
+  fill_halo(v);
+
+  int num_blocks = (height + kBlockRows - 1) / kBlockRows;
+  pool->parallel_for(0, num_blocks, [&](int begin, int end) {
+#ifdef __SSE__
+    // v decays towards zero away from the patterns, and denormal arithmetic
+    // is far slower than the rest of the update.
+    _mm_setcsr(_mm_getcsr() | 0x8040);
+#endif
+    for (int block = begin; block < end; block++) {
+      int y0 = block*kBlockRows;
+      int y1 = std::min(y0 + kBlockRows, height);
+      if (view_out && view == VolumeView::kProjection)
+        std::fill(view_out + (size_t)y0*width, view_out + (size_t)y1*width, -INFINITY);
+
+      for (int z = 0; z < depth; z++) {
+        for (int y = y0; y < y1; y++) {
+          size_t idx = z*plane_stride + y*stride;
+          const float* __restrict__ u_row = u + idx;
+          const float* __restrict__ v_row = v + idx;
+          float* __restrict__ next_u_row = next_u + idx;
+          float* __restrict__ next_v_row = next_v + idx;
+
+          for (int x = 0; x < width; x++) {
+            float u_val = u_row[x];
+            float v_val = v_row[x];
+            float u_laplacian = u_row[x - x_offset] + u_row[x + x_offset] + u_row[x - y_offset] +
+                                u_row[x + y_offset] + u_row[x - z_offset] + u_row[x + z_offset] - 6*u_val;
+            float v_laplacian = v_row[x - x_offset] + v_row[x + x_offset] + v_row[x - y_offset] +
+                                v_row[x + y_offset] + v_row[x - z_offset] + v_row[x + z_offset] - 6*v_val;
+            float uvv = reaction * u_val * v_val * v_val;
+            next_u_row[x] = u_val + step * (u_diffusion*u_laplacian - uvv + replacement*(1 - u_val));
+            next_v_row[x] = v_val + step * (v_diffusion*v_laplacian + uvv - (replacement + v_decay)*v_val);
+          }
+
+          if (!view_out)
+            continue;
+          // The row is still in L1.
+          float* view_row = view_out + (size_t)y*width;
+          if (view == VolumeView::kProjection) {
+            for (int x = 0; x < width; x++)
+              view_row[x] = std::max(view_row[x], next_v_row[x]);
+          } else if (z == slice) {
+            memcpy(view_row, next_v_row, width*sizeof(float));
+          }
+        }
+      }
+    }
+  });
+
+  std::swap(u, next_u);
+  std::swap(v, next_v);
+}
+
+GreyScottVolume* volume;
+VolumeView view = VolumeView::kProjection;
+int slice = -1;
+int slice_dir = 1;
+bool sweep_slice = false;
+
+// Flattened views are handed from the simulation thread to the render
+// thread through two buffers, so the render of one frame overlaps the steps
+// of the next. |pending_view| is waiting for the render thread and
+// |rendering_view| is being rendered; neither may be written.
+float* views[2];
+int next_view = 0;
+int pending_view = -1;
+int pending_periods = 1;
+int rendering_view = -1;
+bool render_stopping = false;
+std::mutex view_mutex;
+std::condition_variable view_changed;
+
+FieldReducer* reducer;
+float* display_view;
+const Colormap* colormap;
+float color_min = 0;
+float color_max = 0.5;
+
+// Runs |steps| steps, the last of which also writes the next view, and
+// queues that view for rendering.
+void simulate_frame(int steps, int periods) {
+  int idx = next_view;
+  for (int i = 0; i < steps - 1; i++)
+    volume->step(view, slice, nullptr);
+  {
+    std::unique_lock<std::mutex> lock(view_mutex);
+    view_changed.wait(lock, [idx] { return pending_view != idx && rendering_view != idx; });
+  }
+  volume->step(view, slice, views[idx]);
+
+  {
+    std::unique_lock<std::mutex> lock(view_mutex);
+    view_changed.wait(lock, [] { return pending_view < 0; });
+    pending_view = idx;
+    pending_periods = periods;
+  }
+  view_changed.notify_all();
+  next_view = 1 - idx;
+
+  if (sweep_slice) {
+    if (slice + slice_dir < 0 || slice + slice_dir >= grid_depth)
+      slice_dir = -slice_dir;
+    slice += slice_dir;
+  }
+}
+
+// Renders queued views until render_stopping is set and the queue is empty.
+// |recorder| may be null.
+void render_loop(GoldenRecorder* recorder) {
+  while (1) {
+    int idx;
+    int periods;
+    {
+      std::unique_lock<std::mutex> lock(view_mutex);
+      view_changed.wait(lock, [] { return pending_view >= 0 || render_stopping; });
+      if (pending_view < 0)
+        return;
+      idx = pending_view;
+      periods = pending_periods;
+      rendering_view = idx;
+      pending_view = -1;
+    }
+    view_changed.notify_all();
+
+    uint8_t* buf = scheduler->begin_frame();
+    reducer->reduce(views[idx], display_view);
+    colormap->apply(display_view, (uint32_t*)buf, width*height, color_min, color_max);
+    if (recorder)
+      recorder->add_frame(buf);
+    scheduler->end_frame(periods);
+
+    {
+      std::lock_guard<std::mutex> lock(view_mutex);
+      rendering_view = -1;
+    }
+    view_changed.notify_all();
+  }
+}
+
+void stop_render_thread() {
+  {
+    std::lock_guard<std::mutex> lock(view_mutex);
+    render_stopping = true;
+  }
+  view_changed.notify_all();
+  render_thread->join();
+}
+
+// The controller's render cost is whatever the simulation thread waits on
+// the render thread, which is nothing while rendering keeps up.
+void paint_loop() {
+  if (profiler)
+    profiler->add_current_thread();
+
+  while(1) {
+    int steps = controller->steps();
+    StageScope stage(profiler, "step");
+    auto step_start = std::chrono::high_resolution_clock::now();
+    simulate_frame(steps, controller->periods());
+    auto step_end = std::chrono::high_resolution_clock::now();
+    controller->record_steps(steps, std::chrono::duration_cast<std::chrono::microseconds>(step_end - step_start).count());
+  }
+}
+
+void headless_loop(int frames) {
+  if (profiler)
+    profiler->add_current_thread();
+
+  for (int frame = 0; frame < frames; frame++) {
+    StageScope stage(profiler, "step");
+    simulate_frame(kHeadlessStepsPerFrame, 1);
+  }
+}
+
+void usage(const char* name) {
+  printf("Usage: %s [-g grid_width x grid_height x grid_depth] [-d display_width x display_height]\n"
+         "          [-v mip|slice|slice:z] [-t time_step] [-B zero|periodic|reflective] [-N none|cpu|node]\n"
+         "          [-m grey|viridis|inferno|#rrggbb,#rrggbb,...] [-L 256|4096] [-l color_min:color_max]\n"
+         "          [-n headless_frames [-W golden_path] [-C golden_path] [-e tolerance]]\n"
+         "          [-E png:pattern|y4m:path|raw:path] [-X shm_name] [-P]\n"
+         "-v mip shows the maximum of v along z, -v slice sweeps a z plane back and forth through the\n"
+         "volume and -v slice:z holds plane z.\n"
+         "-N pins the simulation workers to a CPU or a NUMA node each, spread over all nodes.\n"
+         "-X publishes frames to a shared memory ring for other processes, see frame_ring.h.\n"
+         "-P reports hardware counters for the simulation thread and its pool at exit; the render\n"
+         "thread runs alongside and isn't counted. GUI runs also report the achieved steps/s.\n", name);
+  exit(-1);
+}
+
+int main(int argc, char** argv) {
+  double dt = 1.0;
+  Boundary boundary = Boundary::kZero;
+  ThreadPinning pinning = ThreadPinning::kNone;
+  int headless_frames = 0;
+  const char* golden_write_path = nullptr;
+  const char* golden_compare_path = nullptr;
+  int tolerance = 0;
+  const char* colormap_spec = "inferno";
+  int lut_size = 256;
+  EncoderFormat encoder_format;
+  const char* encoder_path = nullptr;
+  const char* publish_name = nullptr;
+  bool profile = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "g:d:v:t:B:m:L:l:n:W:C:e:E:PX:N:")) != -1) {
+    switch (opt) {
+      case 'g':
+        if (sscanf(optarg, "%dx%dx%d", &grid_width, &grid_height, &grid_depth) != 3 ||
+            grid_width <= 0 || grid_height <= 0 || grid_depth <= 0)
+          usage(argv[0]);
+        break;
+      case 'd':
+        if (sscanf(optarg, "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0)
+          usage(argv[0]);
+        break;
+      case 'v':
+        if (!strcmp(optarg, "mip")) {
+          view = VolumeView::kProjection;
+        } else if (!strcmp(optarg, "slice")) {
+          view = VolumeView::kSlice;
+          sweep_slice = true;
+        } else if (sscanf(optarg, "slice:%d", &slice) == 1) {
+          view = VolumeView::kSlice;
+          sweep_slice = false;
+        } else {
+          usage(argv[0]);
+        }
+        break;
+      case 't':
+        dt = atof(optarg);
+        break;
+      case 'B':
+        if (!parse_boundary(optarg, boundary))
+          usage(argv[0]);
+        break;
+      case 'N':
+        if (!parse_thread_pinning(optarg, pinning))
+          usage(argv[0]);
+        break;
+      case 'm':
+        colormap_spec = optarg;
+        break;
+      case 'L':
+        lut_size = atoi(optarg);
+        break;
+      case 'l':
+        if (sscanf(optarg, "%f:%f", &color_min, &color_max) != 2 || color_max <= color_min)
+          usage(argv[0]);
+        break;
+      case 'n':
+        headless_frames = atoi(optarg);
+        break;
+      case 'W':
+        golden_write_path = optarg;
+        break;
+      case 'C':
+        golden_compare_path = optarg;
+        break;
+      case 'e':
+        tolerance = atoi(optarg);
+        break;
+      case 'E':
+        if (!parse_encoder_spec(optarg, encoder_format, encoder_path))
+          usage(argv[0]);
+        break;
+      case 'X':
+        publish_name = optarg;
+        break;
+      case 'P':
+        profile = true;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+
+  if (view == VolumeView::kSlice) {
+    if (sweep_slice)
+      slice = 0;
+    else if (slice < 0 || slice >= grid_depth)
+      usage(argv[0]);
+  }
+  colormap = parse_colormap(colormap_spec, lut_size);
+  if (!colormap)
+    usage(argv[0]);
+
+  pool = new ThreadPool(0, pinning);
+  if (profile) {
+    profiler = new StageProfiler();
+    profiler->add_pool(pool);
+  }
+  volume = new GreyScottVolume(grid_width, grid_height, grid_depth, boundary, dt, pool);
+  for (int i = 0; i < 2; i++)
+    views[i] = (float*)malloc((size_t)grid_width*grid_height*sizeof(float));
+  // The render thread brings its own worker, so it never queues behind the
+  // simulation on |pool|.
+  reducer = new FieldReducer(grid_width, grid_height, width, height, new ThreadPool(1));
+  display_view = (float*)malloc(width*height*sizeof(float));
+
+  if (encoder_path)
+    encoder = new FrameEncoder(encoder_format, encoder_path, width, height, 1000000 / kRefreshPeriod);
+
+  if (publish_name)
+    publisher = new FramePublisher(publish_name, width, height);
+
+  if (headless_frames) {
+    scheduler = new FrameScheduler(nullptr, width, height, kRenderAheadFrames, kRefreshPeriod);
+    scheduler->set_encoder(encoder);
+    scheduler->set_publisher(publisher);
+    GoldenRecorder recorder(width, height);
+    render_thread = new std::thread(render_loop, &recorder);
+    headless_loop(headless_frames);
+    stop_render_thread();
+    delete encoder;
+    delete publisher;
+    if (profiler)
+      profiler->report();
+    return recorder.finish(golden_write_path, golden_compare_path, kGoldenProgram, tolerance);
+  }
+
+  QApplication app(argc, argv);
+
+  display = new QtDisplay(width, height);
+  scheduler = new FrameScheduler(display, width, height, kRenderAheadFrames, kRefreshPeriod);
+  scheduler->set_encoder(encoder);
+  scheduler->set_publisher(publisher);
+  controller = new StepController(kRefreshPeriod);
+
+  render_thread = new std::thread(render_loop, nullptr);
+  paint_thread = new std::thread(paint_loop);
+
+  int ret = app.exec();
+  if (publisher)
+    publisher->unlink();
+  if (profiler) {
+    profiler->report();
+    printf("Achieved %.0f steps/s\n", controller->achieved_steps_per_second());
+  }
+  return ret;
+}
@@ -0,0 +1,63 @@
+#include "grid_memory.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static const int kMinHugePagesPerBand = 8;
+
+// Huge page mappings must be unmapped in whole huge pages. Rounding every
+// mapping of at least one huge page the same way means unmapping doesn't
+// need to know which kind it was; the tail of a small page mapping is
+// never touched, so it costs no memory.
+static size_t mapped_size(size_t size) {
+  size_t page_size = size >= kHugePageSize ? kHugePageSize : (size_t)sysconf(_SC_PAGESIZE);
+  return (size + page_size - 1) & ~(page_size - 1);
+}
+
+bool use_huge_pages(size_t band_size) {
+  return band_size >= kMinHugePagesPerBand*kHugePageSize;
+}
+
+void* map_grid_memory(size_t size, bool huge_pages) {
+  size_t length = mapped_size(size);
+  if (huge_pages && size >= kHugePageSize) {
+    void* memory = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (memory != MAP_FAILED)
+      return memory;
+
+    // No reserved huge pages. Transparent huge pages only cover aligned
+    // 2MB ranges, so over-allocate and trim to an aligned start.
+    uint8_t* mapping = (uint8_t*)mmap(nullptr, length + kHugePageSize, PROT_READ | PROT_WRITE,
+                                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) {
+      printf("Can't map %zu bytes for a grid: %s\n", size, strerror(errno));
+      exit(-1);
+    }
+    uint8_t* aligned = (uint8_t*)(((uintptr_t)mapping + kHugePageSize - 1) & ~(uintptr_t)(kHugePageSize - 1));
+    if (aligned > mapping)
+      munmap(mapping, aligned - mapping);
+    if (aligned + length < mapping + length + kHugePageSize)
+      munmap(aligned + length, mapping + kHugePageSize - aligned);
+    // Not fatal, the grid just ends up on small pages.
+    madvise(aligned, length, MADV_HUGEPAGE);
+    return aligned;
+  }
+
+  void* memory = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    printf("Can't map %zu bytes for a grid: %s\n", size, strerror(errno));
+    exit(-1);
+  }
+  madvise(memory, length, MADV_NOHUGEPAGE);
+  return memory;
+}
+
+void unmap_grid_memory(void* memory, size_t size) {
+  if (memory)
+    munmap(memory, mapped_size(size));
+}
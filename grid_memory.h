@@ -0,0 +1,26 @@
+#include <stddef.h>
+
+#ifndef GRID_MEMORY_H
+#define GRID_MEMORY_H
+
+const size_t kHugePageSize = 2 << 20;
+
+// Memory for large grids, mapped straight from the kernel rather than
+// malloc'd so that nothing touches it before the caller does. Pages are
+// placed on the NUMA node of the thread that first writes them, so callers
+// should zero the grid from the same pool bands that will later step it.
+//
+// With |huge_pages| a mapping of at least 2MB is backed by 2MB pages: from
+// the reserved hugetlb pool if there is one, otherwise by asking for
+// transparent huge pages. Without it, transparent huge pages are turned off
+// for the mapping, since a 2MB page can only live on one node.
+void* map_grid_memory(size_t size, bool huge_pages);
+// |size| must be the size the memory was mapped with.
+void unmap_grid_memory(void* memory, size_t size);
+
+// Whether a grid whose bands are |band_size| bytes each should use huge
+// pages. Each band boundary can leave up to one page on the wrong node, so
+// this needs a band to span several of them.
+bool use_huge_pages(size_t band_size);
+
+#endif
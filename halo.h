@@ -0,0 +1,132 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <type_traits>
+
+#include "grid_memory.h"
+#include "thread_pool.h"
+
+#ifndef HALO_H
+#define HALO_H
+
+// How a grid continues past its edges.
+enum class Boundary {
+  // Zero valued cells outside the grid.
+  kZero,
+  // The grid wraps around, so it tiles seamlessly.
+  kPeriodic,
+  // Mirrored about the outer cell faces, so nothing flows across the edge.
+  kReflective,
+};
+
+inline bool parse_boundary(const char* name, Boundary& boundary) {
+  if (!strcmp(name, "zero"))
+    boundary = Boundary::kZero;
+  else if (!strcmp(name, "periodic"))
+    boundary = Boundary::kPeriodic;
+  else if (!strcmp(name, "reflective"))
+    boundary = Boundary::kReflective;
+  else
+    return false;
+  return true;
+}
+
+// Width of the border kept around halo grids, enough for the spacing 2
+// Laplacian the solvers use.
+const int kHalo = 2;
+
+constexpr int halo_stride(int width) {
+  return width + 2*kHalo;
+}
+
+// Calls |fn| with std::integral_constant<int, width>() if the stencils have
+// kernels specialized for |width|, the sizes we usually run at, and returns
+// whether it did. With the width, and so the stride, fixed at compile time
+// the neighbour offsets become constants.
+template <typename F>
+bool dispatch_specialized_width(int width, F&& fn) {
+  switch (width) {
+    case 500:
+      fn(std::integral_constant<int, 500>());
+      return true;
+    case 512:
+      fn(std::integral_constant<int, 512>());
+      return true;
+    case 1024:
+      fn(std::integral_constant<int, 1024>());
+      return true;
+    case 2048:
+      fn(std::integral_constant<int, 2048>());
+      return true;
+    case 4096:
+      fn(std::integral_constant<int, 4096>());
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Allocates a zeroed width x height grid with a kHalo border and returns a
+// pointer to its first interior cell. Rows are halo_stride(width) apart, so
+// cell (x, y) is at grid[y*stride + x] for x and y in [-kHalo, size + kHalo).
+//
+// The grid is zeroed by |pool| in the bands of parallel_for(0, height), the
+// border rows going with the first and last band, so each band's pages sit
+// on the NUMA node of the worker that steps it.
+template <typename T>
+T* alloc_halo_grid(int width, int height, ThreadPool* pool) {
+  size_t row_size = halo_stride(width) * sizeof(T);
+  size_t size = row_size * (height + 2*kHalo);
+  uint8_t* base = (uint8_t*)map_grid_memory(size, use_huge_pages(size / pool->size()));
+  pool->parallel_for(0, height, [&](int begin, int end) {
+    int first = begin ? begin + kHalo : 0;
+    int last = end < height ? end + kHalo : height + 2*kHalo;
+    memset(base + first*row_size, 0, (last - first)*row_size);
+  });
+  return (T*)base + kHalo*halo_stride(width) + kHalo;
+}
+
+template <typename T>
+void free_halo_grid(T* grid, int width, int height) {
+  if (grid)
+    unmap_grid_memory(grid - kHalo*halo_stride(width) - kHalo, halo_stride(width) * (height + 2*kHalo) * sizeof(T));
+}
+
+// Index of the interior cell that halo cell |i| mirrors along an axis of
+// size |n|.
+inline int halo_source(int i, int n, Boundary boundary) {
+  if (boundary == Boundary::kPeriodic)
+    return (i + n) % n;
+  return i < 0 ? -1 - i : 2*n - 1 - i;
+}
+
+// Rewrites the border from the interior. This runs once per step and only
+// touches O(width + height) cells, so the stencils themselves can read
+// their neighbours without any edge checks.
+template <typename T>
+void fill_halo(T* grid, int width, int height, Boundary boundary) {
+  int stride = halo_stride(width);
+
+  if (boundary == Boundary::kZero) {
+    // The border starts out zero and nothing else writes to it.
+    return;
+  }
+
+  for (int y = 0; y < height; y++) {
+    T* row = grid + y*stride;
+    for (int i = 1; i <= kHalo; i++) {
+      row[-i] = row[halo_source(-i, width, boundary)];
+      row[width-1+i] = row[halo_source(width-1+i, width, boundary)];
+    }
+  }
+
+  // Whole padded rows, which fills the corners too.
+  for (int i = 1; i <= kHalo; i++) {
+    memcpy(grid + (-i)*stride - kHalo, grid + halo_source(-i, height, boundary)*stride - kHalo,
+           stride*sizeof(T));
+    memcpy(grid + (height-1+i)*stride - kHalo, grid + halo_source(height-1+i, height, boundary)*stride - kHalo,
+           stride*sizeof(T));
+  }
+}
+
+#endif
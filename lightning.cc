@@ -2,26 +2,78 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <stdint.h>
 #include <png.h>
 #include <thread>
+#include <algorithm>
 #include <vector>
 #include <math.h>
-
+#include <limits.h>
+
+#include "bloom.h"
+#include "checkpoint.h"
+#include "frame_encoder.h"
+#include "frame_publisher.h"
+#include "frame_scheduler.h"
+#include "golden.h"
 #include "qt_display.h"
 #include "markov.h"
+#include "stage_profiler.h"
+#include "thread_pool.h"
 
 int width = 1000;
 int height = 1000;
 uint8_t* buf;
 QtDisplay* display;
+FrameScheduler* scheduler;
+FrameEncoder* encoder = nullptr;
+FramePublisher* publisher = nullptr;
+const int kRefreshPeriod = 33000;
+const int kRenderAheadFrames = 8;
 std::thread* paint_thread;
+CheckpointWriter* checkpoint_writer = nullptr;
+int checkpoint_interval = 300;
+uint64_t frame_count = 0;
+StageProfiler* profiler = nullptr;
+ThreadPool* pool;
+// Optional glow over the canvas. The bolts' dim trace color stays under the
+// threshold; leads and flashes bloom.
+Bloom* bloom = nullptr;
+const float kBloomThreshold = 0.5;
+const float kBloomIntensity = 2.0;
+const uint32_t kCheckpointProgram = checkpoint_tag("LTNG");
+// What the bolts drew this frame, which is all that changed on the canvas.
+std::vector<DirtyRect> dirty_rects;
 
 struct Coord {
   int x;
   int y;
 };
 
+// Checkpoint records. Leads are stored by position and heading, their
+// samplers are rebuilt from the heading on restore.
+struct CheckpointCanvas {
+  int32_t width;
+  int32_t height;
+};
+
+struct BoltRecord {
+  uint32_t num_trace;
+  uint32_t num_leads;
+  uint32_t flash_color;
+  uint8_t is_flashing;
+  uint8_t is_done;
+  uint16_t reserved;
+  uint32_t rand_state;
+};
+
+struct LeadRecord {
+  int32_t x;
+  int32_t y;
+  double heading_angle;
+};
+
 class Lead {
 public:
   Coord coord;
@@ -93,7 +145,15 @@ Lead::Lead(Lead&& lead) {
 
 class Bolt {
 private:
+  // Pixels the bolt's leads have visited, each once, in order of first
+  // visit. |occupied| holds one bit per canvas pixel for the pixels already
+  // in |trace|, so a bolt's trace is bounded by the canvas size rather
+  // than by how long its leads wander.
   std::vector<Coord> trace;
+  std::vector<uint64_t> occupied;
+  // Bounding box of |trace|, inclusive.
+  Coord trace_min = {INT_MAX, INT_MAX};
+  Coord trace_max = {INT_MIN, INT_MIN};
   std::vector<Lead> leads;
   static const uint32_t trace_color = 0xFF444488;
   uint32_t flash_color = 0xFFFFFFFF;
@@ -103,29 +163,79 @@ private:
   std::unique_ptr<MarkovSampler> split_dir_sampler = std::make_unique<MarkovSampler>(split_dir_pdf);
   bool is_flashing = false;
   static const int flash_decay = 1;
+  // Bolts are processed on their own threads, so each draws from its own
+  // rand_r() state to keep runs reproducible.
+  unsigned int rand_state;
+
+  void add_trace(Coord coord);
 
 public:
-  Bolt(Coord seed);
+  Bolt(Coord seed, unsigned int rand_state);
+  // Restores a bolt from its checkpoint record, consuming its trace points
+  // and leads from the front of |trace| and |leads|.
+  Bolt(const BoltRecord& record, const Coord*& trace, const LeadRecord*& leads);
   Bolt(Bolt&& bolt);
 
   bool is_done = false;
   void process();
-  void render();
+  // Draws the bolt and appends the area it drew to |dirty|.
+  void render(std::vector<DirtyRect>& dirty);
+  // Marks the pixels this bolt may have drawn bright on |bloom|.
+  void mark_bright(Bloom* bloom) const;
+  void save(std::vector<BoltRecord>& records, std::vector<Coord>& traces, std::vector<LeadRecord>& lead_records) const;
 };
 
-Bolt::Bolt(Coord seed) {
+Bolt::Bolt(Coord seed, unsigned int rand_state) {
+  this->rand_state = rand_state;
+  occupied.resize(((size_t)width*height + 63) / 64);
   Lead primary(seed, 0.0);
   leads.emplace_back(std::move(primary));
 }
 
+Bolt::Bolt(const BoltRecord& record, const Coord*& trace, const LeadRecord*& leads) {
+  occupied.resize(((size_t)width*height + 63) / 64);
+  for (uint32_t i = 0; i < record.num_trace; i++)
+    add_trace(trace[i]);
+  trace += record.num_trace;
+  for (uint32_t i = 0; i < record.num_leads; i++) {
+    Coord coord;
+    coord.x = leads[i].x;
+    coord.y = leads[i].y;
+    this->leads.emplace_back(coord, leads[i].heading_angle);
+  }
+  leads += record.num_leads;
+
+  flash_color = record.flash_color;
+  is_flashing = record.is_flashing;
+  is_done = record.is_done;
+  rand_state = record.rand_state;
+}
+
 Bolt::Bolt(Bolt&& bolt) {
   trace = std::move(bolt.trace);
+  occupied = std::move(bolt.occupied);
+  trace_min = bolt.trace_min;
+  trace_max = bolt.trace_max;
   leads = std::move(bolt.leads);
   trace_split_sampler = std::move(bolt.trace_split_sampler);
-  split_dir_sampler = std::move(split_dir_sampler);
+  split_dir_sampler = std::move(bolt.split_dir_sampler);
   flash_color = bolt.flash_color;
   is_done = bolt.is_done;
   is_flashing = bolt.is_flashing;
+  rand_state = bolt.rand_state;
+}
+
+void Bolt::add_trace(Coord coord) {
+  size_t idx = (size_t)coord.y*width + coord.x;
+  uint64_t bit = (uint64_t)1 << (idx % 64);
+  if (occupied[idx / 64] & bit)
+    return;
+  occupied[idx / 64] |= bit;
+  trace.push_back(coord);
+  trace_min.x = std::min(trace_min.x, coord.x);
+  trace_min.y = std::min(trace_min.y, coord.y);
+  trace_max.x = std::max(trace_max.x, coord.x);
+  trace_max.y = std::max(trace_max.y, coord.y);
 }
 
 void Bolt::process() {
@@ -146,9 +256,9 @@ void Bolt::process() {
 
   std::vector<Lead> new_leads;
   for (Lead& lead : leads) {
-    trace.emplace_back(lead.coord);
+    add_trace(lead.coord);
 
-    switch (lead.walk_sampler->sample()) {
+    switch (lead.walk_sampler->sample(&rand_state)) {
       case 0:
         lead.coord.y++;
         break;
@@ -175,8 +285,8 @@ void Bolt::process() {
     } else if (lead.coord.y >= height) {
       lead.coord.y = height-1;
       is_flashing = true;
-    } else if (trace_split_sampler->sample()) {
-      int dir = split_dir_sampler->sample();
+    } else if (trace_split_sampler->sample(&rand_state)) {
+      int dir = split_dir_sampler->sample(&rand_state);
       //printf("dir: %d\n", dir);
       float new_heading_angle = dir ? lead.heading_angle + M_PI_4 : lead.heading_angle - M_PI_4;
       Lead new_lead(lead.coord, new_heading_angle);
@@ -188,8 +298,10 @@ void Bolt::process() {
     leads.emplace_back(std::move(lead));
 }
 
-void Bolt::render() {
+void Bolt::render(std::vector<DirtyRect>& dirty) {
   uint32_t* color_buf = (uint32_t*)buf;
+  Coord dirty_min = trace_min;
+  Coord dirty_max = trace_max;
 
   for (Coord& trace_point : trace) {
     if (is_flashing) {
@@ -201,74 +313,340 @@ void Bolt::render() {
 
   for (Lead& lead : leads) {
     color_buf[lead.coord.y * width + lead.coord.x] = flash_color;
+    dirty_min.x = std::min(dirty_min.x, lead.coord.x);
+    dirty_min.y = std::min(dirty_min.y, lead.coord.y);
+    dirty_max.x = std::max(dirty_max.x, lead.coord.x);
+    dirty_max.y = std::max(dirty_max.y, lead.coord.y);
+  }
+
+  if (dirty_min.x <= dirty_max.x)
+    dirty.push_back({dirty_min.x, dirty_max.x + 1, dirty_min.y, dirty_max.y + 1});
+}
+
+void Bolt::mark_bright(Bloom* bloom) const {
+  if (is_done)
+    return;
+  if (is_flashing && !trace.empty())
+    bloom->mark(trace_min.x, trace_min.y, trace_max.x + 1, trace_max.y + 1);
+  for (const Lead& lead : leads)
+    bloom->mark(lead.coord.x, lead.coord.y, lead.coord.x + 1, lead.coord.y + 1);
+}
+
+void Bolt::save(std::vector<BoltRecord>& records, std::vector<Coord>& traces, std::vector<LeadRecord>& lead_records) const {
+  BoltRecord record;
+  record.num_trace = trace.size();
+  record.num_leads = leads.size();
+  record.flash_color = flash_color;
+  record.is_flashing = is_flashing;
+  record.is_done = is_done;
+  record.reserved = 0;
+  record.rand_state = rand_state;
+  records.push_back(record);
+
+  traces.insert(traces.end(), trace.begin(), trace.end());
+  for (const Lead& lead : leads) {
+    LeadRecord lead_record;
+    lead_record.x = lead.coord.x;
+    lead_record.y = lead.coord.y;
+    lead_record.heading_angle = lead.heading_angle;
+    lead_records.push_back(lead_record);
+  }
+}
+
+std::vector<Bolt> bolts;
+
+void save_checkpoint() {
+  if (!checkpoint_writer->begin(frame_count))
+    return;
+
+  std::vector<BoltRecord> records;
+  std::vector<Coord> traces;
+  std::vector<LeadRecord> lead_records;
+  for (const Bolt& bolt : bolts)
+    bolt.save(records, traces, lead_records);
+
+  CheckpointCanvas canvas;
+  canvas.width = width;
+  canvas.height = height;
+  checkpoint_writer->add_section(checkpoint_tag("DIMS"), &canvas, sizeof(canvas));
+  checkpoint_writer->add_section(checkpoint_tag("CANV"), buf, width*height*4);
+  checkpoint_writer->add_section(checkpoint_tag("BOLT"), records.data(), records.size()*sizeof(BoltRecord));
+  checkpoint_writer->add_section(checkpoint_tag("TRAC"), traces.data(), traces.size()*sizeof(Coord));
+  checkpoint_writer->add_section(checkpoint_tag("LEAD"), lead_records.data(), lead_records.size()*sizeof(LeadRecord));
+  checkpoint_writer->commit();
+}
+
+void restore_checkpoint(const char* path) {
+  CheckpointReader reader;
+  if (!reader.open(path, kCheckpointProgram))
+    exit(-1);
+
+  size_t canvas_size, buf_size, records_size, traces_size, leads_size;
+  const CheckpointCanvas* canvas = (const CheckpointCanvas*)reader.section(checkpoint_tag("DIMS"), &canvas_size);
+  const void* canvas_buf = reader.section(checkpoint_tag("CANV"), &buf_size);
+  const BoltRecord* records = (const BoltRecord*)reader.section(checkpoint_tag("BOLT"), &records_size);
+  const Coord* traces = (const Coord*)reader.section(checkpoint_tag("TRAC"), &traces_size);
+  const LeadRecord* leads = (const LeadRecord*)reader.section(checkpoint_tag("LEAD"), &leads_size);
+  if (!canvas || !canvas_buf || !records || !traces || !leads || canvas_size != sizeof(CheckpointCanvas) ||
+      canvas->width != width || canvas->height != height || buf_size != (size_t)width*height*4) {
+    printf("Checkpoint does not match the canvas\n");
+    exit(-1);
+  }
+
+  size_t num_records = records_size / sizeof(BoltRecord);
+  size_t num_trace = 0;
+  size_t num_leads = 0;
+  for (size_t i = 0; i < num_records; i++) {
+    num_trace += records[i].num_trace;
+    num_leads += records[i].num_leads;
+  }
+  if (num_trace*sizeof(Coord) != traces_size || num_leads*sizeof(LeadRecord) != leads_size) {
+    printf("Checkpoint bolt records are inconsistent\n");
+    exit(-1);
+  }
+  // Bolts index the canvas and their occupancy bitmap with these directly.
+  for (size_t i = 0; i < num_trace; i++) {
+    if (traces[i].x < 0 || traces[i].x >= width || traces[i].y < 0 || traces[i].y >= height) {
+      printf("Checkpoint bolt records are inconsistent\n");
+      exit(-1);
+    }
+  }
+  for (size_t i = 0; i < num_leads; i++) {
+    if (leads[i].x < 0 || leads[i].x >= width || leads[i].y < 0 || leads[i].y >= height) {
+      printf("Checkpoint bolt records are inconsistent\n");
+      exit(-1);
+    }
   }
+
+  memcpy(buf, canvas_buf, buf_size);
+  for (size_t i = 0; i < num_records; i++)
+    bolts.emplace_back(records[i], traces, leads);
+  frame_count = reader.frame();
 }
 
 void process_bolt(std::vector<Bolt>* bolts, int idx) {
   for (int i = 0; i < 10; i++)
     (*bolts)[idx].process();
-
-  (*bolts)[idx].render();
 }
 
-void paint_loop() {
-  auto last_buf_swap = std::chrono::high_resolution_clock::now();
-  int kRefreshPeriod = 33000;
-  std::vector<uint32_t> new_bolt_pdf = {80, 1};
-  MarkovSampler new_bolt_sampler(new_bolt_pdf);
-  std::vector<Bolt> bolts;
-  const int flash_decay = 1;
-  bool first_frame = true;
-  while(1) {
-    if (first_frame || new_bolt_sampler.sample()) {
-      Coord seed_coord;
-      //printf("New bolt!\n");
-      seed_coord.y = 0;
-      seed_coord.x = (rand() % (width - 2)) + 1;
-      bolts.emplace_back(std::move(Bolt(seed_coord)));
-      first_frame = false;
-    }
+const std::vector<uint32_t> new_bolt_pdf = {80, 1};
+MarkovSampler new_bolt_sampler(new_bolt_pdf);
+
+// Bolts are processed in parallel but rendered in order, so pixels where
+// bolts overlap come out the same on every run.
+void next_frame() {
+  if (frame_count == 0 || new_bolt_sampler.sample()) {
+    Coord seed_coord;
+    //printf("New bolt!\n");
+    seed_coord.y = 0;
+    seed_coord.x = (rand() % (width - 2)) + 1;
+    bolts.emplace_back(std::move(Bolt(seed_coord, rand())));
+  }
 
-    std::vector<Bolt> next_cycle_bolts;
+  std::vector<Bolt> next_cycle_bolts;
+  {
+    StageScope stage(profiler, "process");
     std::vector<std::shared_ptr<std::thread>> bolt_threads;
     for (int i = 0; i < bolts.size(); i++)
       bolt_threads.emplace_back(std::make_shared<std::thread>(process_bolt, &bolts, i));
 
     for (auto thread : bolt_threads)
       thread->join();
+  }
 
+  {
+    StageScope stage(profiler, "render");
+    dirty_rects.clear();
     for (Bolt& bolt : bolts) {
-      if (!bolt.is_done)
-        next_cycle_bolts.emplace_back(std::move(bolt));
+      bolt.render(dirty_rects);
+      if (bloom)
+        bolt.mark_bright(bloom);
     }
-    bolts = std::move(next_cycle_bolts);
+  }
 
-    display->swap_buf(buf);
-    auto curr_time = std::chrono::high_resolution_clock::now();
-    auto time_in_microseconds =
-        std::chrono::duration_cast<std::chrono::microseconds>(curr_time -
-                                                              last_buf_swap);
+  for (Bolt& bolt : bolts) {
+    if (!bolt.is_done)
+      next_cycle_bolts.emplace_back(std::move(bolt));
+  }
+  bolts = std::move(next_cycle_bolts);
 
-    if (time_in_microseconds.count() < kRefreshPeriod) {
-      usleep(kRefreshPeriod - time_in_microseconds.count());
-    } else {
-      printf("Warning! Frame lag! %lu us\n", time_in_microseconds.count());
+  frame_count++;
+}
+
+// Hands the canvas to the scheduler. With bloom the glow is composited
+// straight into the scheduler's frame, leaving |buf| as the bare canvas the
+// bolts keep drawing on. The glow of the previous frame fades wherever it
+// was, so bloomed frames go to the display whole. |recorder| may be null.
+void present_frame(GoldenRecorder* recorder) {
+  if (!bloom) {
+    if (recorder)
+      recorder->add_frame(buf);
+    StageScope stage(profiler, "present");
+    scheduler->push_frame(buf, 1, &dirty_rects);
+    return;
+  }
+
+  uint8_t* frame;
+  {
+    StageScope stage(profiler, "wait");
+    frame = scheduler->begin_frame();
+  }
+  {
+    StageScope stage(profiler, "bloom");
+    bloom->apply(buf, frame);
+  }
+  if (recorder)
+    recorder->add_frame(frame);
+  StageScope stage(profiler, "present");
+  scheduler->end_frame();
+}
+
+// Bolt threads are spawned from the loop's thread, so its counters cover
+// them.
+void paint_loop() {
+  if (profiler)
+    profiler->add_current_thread();
+
+  while(1) {
+    next_frame();
+    present_frame(nullptr);
+
+    if (checkpoint_writer && frame_count % checkpoint_interval == 0) {
+      StageScope stage(profiler, "checkpoint");
+      save_checkpoint();
     }
-    last_buf_swap = std::chrono::high_resolution_clock::now();
   }
 }
 
+void headless_loop(int frames, GoldenRecorder* recorder) {
+  if (profiler)
+    profiler->add_current_thread();
+
+  for (int frame = 0; frame < frames; frame++) {
+    next_frame();
+    present_frame(recorder);
+  }
+}
+
+void usage(const char* name) {
+  printf("Usage: %s [-S seed] [-d width x height] [-b] [-c checkpoint_path] [-k checkpoint_interval_frames]\n"
+         "          [-r restore_path]\n"
+         "          [-n headless_frames [-W golden_path] [-C golden_path]]\n"
+         "          [-E png:pattern|y4m:path|raw:path] [-X shm_name] [-P]\n"
+         "-b adds a glow to leads and flashes.\n"
+         "-X publishes frames to a shared memory ring for other processes, see frame_ring.h.\n"
+         "-P reports hardware counters for each stage of the frame loop at exit.\n", name);
+  exit(-1);
+}
+
 int main(int argc, char** argv) {
   time_t t;
-  srand((unsigned) time(&t));
+  unsigned int seed = time(&t);
+
+  const char* checkpoint_path = nullptr;
+  const char* restore_path = nullptr;
+  int headless_frames = 0;
+  const char* golden_write_path = nullptr;
+  const char* golden_compare_path = nullptr;
+  EncoderFormat encoder_format;
+  const char* encoder_path = nullptr;
+  const char* publish_name = nullptr;
+  bool use_bloom = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "S:d:bc:k:r:n:W:C:E:PX:")) != -1) {
+    switch (opt) {
+      case 'S':
+        seed = strtoul(optarg, nullptr, 0);
+        break;
+      case 'd':
+        if (sscanf(optarg, "%dx%d", &width, &height) != 2 || width < 3 || height < 1)
+          usage(argv[0]);
+        break;
+      case 'b':
+        use_bloom = true;
+        break;
+      case 'c':
+        checkpoint_path = optarg;
+        break;
+      case 'k':
+        checkpoint_interval = atoi(optarg);
+        if (checkpoint_interval <= 0)
+          usage(argv[0]);
+        break;
+      case 'r':
+        restore_path = optarg;
+        break;
+      case 'n':
+        headless_frames = atoi(optarg);
+        break;
+      case 'W':
+        golden_write_path = optarg;
+        break;
+      case 'C':
+        golden_compare_path = optarg;
+        break;
+      case 'E':
+        if (!parse_encoder_spec(optarg, encoder_format, encoder_path))
+          usage(argv[0]);
+        break;
+      case 'X':
+        publish_name = optarg;
+        break;
+      case 'P':
+        profiler = new StageProfiler();
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+
+  srand(seed);
 
-  buf = (uint8_t*)malloc(width*height*4);
+  if (use_bloom) {
+    pool = new ThreadPool();
+    if (profiler)
+      profiler->add_pool(pool);
+    bloom = new Bloom(width, height, kBloomThreshold, kBloomIntensity, pool);
+  }
+
+  buf = (uint8_t*)calloc((size_t)width*height*4, 1);
+  if (restore_path)
+    restore_checkpoint(restore_path);
+  if (checkpoint_path)
+    checkpoint_writer = new CheckpointWriter(checkpoint_path, kCheckpointProgram);
+
+  if (encoder_path)
+    encoder = new FrameEncoder(encoder_format, encoder_path, width, height, 1000000 / kRefreshPeriod);
+
+  if (publish_name)
+    publisher = new FramePublisher(publish_name, width, height);
+
+  if (headless_frames) {
+    scheduler = new FrameScheduler(nullptr, width, height, kRenderAheadFrames, kRefreshPeriod);
+    scheduler->set_encoder(encoder);
+    scheduler->set_publisher(publisher);
+    GoldenRecorder recorder(width, height);
+    headless_loop(headless_frames, &recorder);
+    delete encoder;
+    delete publisher;
+    if (profiler)
+      profiler->report();
+    return recorder.finish(golden_write_path, golden_compare_path, kCheckpointProgram, 0);
+  }
 
   QApplication app(argc, argv);
 
   display = new QtDisplay(width, height);
+  scheduler = new FrameScheduler(display, width, height, kRenderAheadFrames, kRefreshPeriod);
+  scheduler->set_encoder(encoder);
+  scheduler->set_publisher(publisher);
 
   paint_thread = new std::thread(paint_loop);
 
-  return app.exec();
+  int ret = app.exec();
+  if (publisher)
+    publisher->unlink();
+  if (profiler)
+    profiler->report();
+  return ret;
 }
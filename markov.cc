@@ -12,7 +12,14 @@ MarkovSampler::MarkovSampler(const std::vector<uint32_t> pdf) {
 }
 
 int MarkovSampler::sample() const {
-  uint32_t rand_val = rand() % sum;
+  return lookup(rand() % sum);
+}
+
+int MarkovSampler::sample(unsigned int* state) const {
+  return lookup(rand_r(state) % sum);
+}
+
+int MarkovSampler::lookup(uint32_t rand_val) const {
   uint32_t cdf = 0;
 
   for (int i = 0; i < pdf.size(); i++) {
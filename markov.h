@@ -9,9 +9,14 @@ private:
   std::vector<uint32_t> pdf;
   uint32_t sum;
 
+  int lookup(uint32_t rand_val) const;
+
 public:
   MarkovSampler(const std::vector<uint32_t> pdf);
   int sample() const;
+  // Draws from a caller owned rand_r() state, so samplers used from
+  // several threads stay reproducible.
+  int sample(unsigned int* state) const;
 };
 
 #endif
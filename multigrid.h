@@ -0,0 +1,296 @@
+#include <math.h>
+#include <vector>
+
+#include "thread_pool.h"
+
+#ifndef MULTIGRID_H
+#define MULTIGRID_H
+
+// Geometric multigrid solver for (I - alpha L) u = f on a grid with zero
+// values outside its edges, where L is the 5-point Laplacian. This is the
+// system a backward Euler (or Crank-Nicolson) diffusion step has to solve,
+// so the time step is not limited by stability and each V-cycle is O(N).
+//
+// Levels are vertex-centered: coarse point i sits on fine point 2i+1, and
+// the coarse operator is rediscretized with alpha/4 for the doubled spacing.
+// Grids of size 2^k - 1 coarsen exactly; for other sizes the last fine
+// row/column is only corrected through interpolation towards the boundary,
+// which costs a few extra cycles but keeps the levels simple.
+// The smoother is red-black Gauss-Seidel, with rows of each color spread
+// over the thread pool. Norms are summed row by row and the rows added in
+// order, so the number of cycles does not depend on thread timing or count.
+template <typename T>
+class MultigridSolver {
+private:
+  struct Level {
+    int width;
+    int height;
+    T alpha;
+    std::vector<T> u;
+    std::vector<T> f;
+    std::vector<T> r;
+  };
+
+  std::vector<Level> levels;
+  ThreadPool* pool;
+  // Squared norm of each row, sized for the finest level.
+  std::vector<T> row_norms;
+
+  static const int kPreSmooth = 2;
+  static const int kPostSmooth = 2;
+  static const int kCoarseSweeps = 30;
+
+  void smooth(Level& level, int sweeps);
+  T residual(Level& level);
+  T norm(const T* v, int w, int h);
+  T sum_row_norms(int h) const;
+  void restrict_residual(const Level& fine, Level& coarse);
+  void prolong(const Level& coarse, Level& fine);
+  void v_cycle(int l);
+
+public:
+  MultigridSolver(int width, int height, T alpha, ThreadPool* pool);
+
+  // Solves in place; |u| holds the initial guess on entry. Returns the
+  // number of V-cycles run, or -1 if the residual did not drop below
+  // |tolerance| times the norm of |f| within |max_cycles|.
+  int solve(T* u, const T* f, T tolerance, int max_cycles);
+
+  // out = in + beta L in, the explicit half of a Crank-Nicolson step.
+  void apply_explicit(const T* in, T* out, T beta);
+};
+
+template <typename T>
+MultigridSolver<T>::MultigridSolver(int width, int height, T alpha, ThreadPool* pool) {
+  this->pool = pool;
+  row_norms.resize(height);
+
+  while (1) {
+    Level level;
+    level.width = width;
+    level.height = height;
+    level.alpha = alpha;
+    level.u.resize(width*height);
+    level.f.resize(width*height);
+    level.r.resize(width*height);
+    levels.push_back(std::move(level));
+
+    if (width < 7 || height < 7)
+      break;
+    width = (width - 1) / 2;
+    height = (height - 1) / 2;
+    alpha /= 4;
+  }
+}
+
+template <typename T>
+void MultigridSolver<T>::smooth(Level& level, int sweeps) {
+  int w = level.width;
+  int h = level.height;
+  T alpha = level.alpha;
+  T inv_diag = 1 / (1 + 4*alpha);
+  T* u = level.u.data();
+  const T* f = level.f.data();
+
+  for (int sweep = 0; sweep < sweeps; sweep++) {
+    for (int color = 0; color < 2; color++) {
+      pool->parallel_for(0, h, [&](int begin, int end) {
+        for (int y = begin; y < end; y++) {
+          for (int x = (y + color) & 1; x < w; x += 2) {
+            T sum = 0;
+            if (x > 0)
+              sum += u[y*w + x-1];
+            if (x < w-1)
+              sum += u[y*w + x+1];
+            if (y > 0)
+              sum += u[(y-1)*w + x];
+            if (y < h-1)
+              sum += u[(y+1)*w + x];
+            u[y*w + x] = (f[y*w + x] + alpha*sum) * inv_diag;
+          }
+        }
+      });
+    }
+  }
+}
+
+template <typename T>
+T MultigridSolver<T>::residual(Level& level) {
+  int w = level.width;
+  int h = level.height;
+  T alpha = level.alpha;
+  const T* u = level.u.data();
+  const T* f = level.f.data();
+  T* r = level.r.data();
+
+  pool->parallel_for(0, h, [&](int begin, int end) {
+    for (int y = begin; y < end; y++) {
+      T row_norm = 0;
+      for (int x = 0; x < w; x++) {
+        T sum = 0;
+        if (x > 0)
+          sum += u[y*w + x-1];
+        if (x < w-1)
+          sum += u[y*w + x+1];
+        if (y > 0)
+          sum += u[(y-1)*w + x];
+        if (y < h-1)
+          sum += u[(y+1)*w + x];
+        r[y*w + x] = f[y*w + x] - (1 + 4*alpha)*u[y*w + x] + alpha*sum;
+        row_norm += r[y*w + x]*r[y*w + x];
+      }
+      row_norms[y] = row_norm;
+    }
+  });
+
+  return sqrt(sum_row_norms(h));
+}
+
+template <typename T>
+T MultigridSolver<T>::norm(const T* v, int w, int h) {
+  pool->parallel_for(0, h, [&](int begin, int end) {
+    for (int y = begin; y < end; y++) {
+      T row_norm = 0;
+      for (int x = 0; x < w; x++)
+        row_norm += v[y*w + x]*v[y*w + x];
+      row_norms[y] = row_norm;
+    }
+  });
+
+  return sqrt(sum_row_norms(h));
+}
+
+template <typename T>
+T MultigridSolver<T>::sum_row_norms(int h) const {
+  T sum = 0;
+  for (int y = 0; y < h; y++)
+    sum += row_norms[y];
+  return sum;
+}
+
+template <typename T>
+void MultigridSolver<T>::restrict_residual(const Level& fine, Level& coarse) {
+  int fw = fine.width;
+  int cw = coarse.width;
+  const T* r = fine.r.data();
+  T* f = coarse.f.data();
+
+  pool->parallel_for(0, coarse.height, [&](int begin, int end) {
+    for (int cy = begin; cy < end; cy++) {
+      int y = 2*cy + 1;
+      for (int cx = 0; cx < cw; cx++) {
+        int x = 2*cx + 1;
+        T sum = 4*r[y*fw + x];
+        sum += 2*(r[y*fw + x-1] + r[y*fw + x+1] + r[(y-1)*fw + x] + r[(y+1)*fw + x]);
+        sum += r[(y-1)*fw + x-1] + r[(y-1)*fw + x+1] + r[(y+1)*fw + x-1] + r[(y+1)*fw + x+1];
+        f[cy*cw + cx] = sum / 16;
+      }
+    }
+  });
+}
+
+template <typename T>
+void MultigridSolver<T>::prolong(const Level& coarse, Level& fine) {
+  int fw = fine.width;
+  int cw = coarse.width;
+  int ch = coarse.height;
+  const T* e = coarse.u.data();
+  T* u = fine.u.data();
+
+  auto coarse_at = [&](int cx, int cy) -> T {
+    if (cx < 0 || cx >= cw || cy < 0 || cy >= ch)
+      return 0;
+    return e[cy*cw + cx];
+  };
+
+  pool->parallel_for(0, fine.height, [&](int begin, int end) {
+    for (int y = begin; y < end; y++) {
+      int cy0 = (y - 1) >> 1;
+      bool y_odd = y & 1;
+      for (int x = 0; x < fw; x++) {
+        int cx0 = (x - 1) >> 1;
+        bool x_odd = x & 1;
+        T correction;
+        if (x_odd && y_odd) {
+          correction = coarse_at(cx0, cy0);
+        } else if (x_odd) {
+          correction = (coarse_at(cx0, cy0) + coarse_at(cx0, cy0+1)) / 2;
+        } else if (y_odd) {
+          correction = (coarse_at(cx0, cy0) + coarse_at(cx0+1, cy0)) / 2;
+        } else {
+          correction = (coarse_at(cx0, cy0) + coarse_at(cx0+1, cy0) +
+                        coarse_at(cx0, cy0+1) + coarse_at(cx0+1, cy0+1)) / 4;
+        }
+        u[y*fw + x] += correction;
+      }
+    }
+  });
+}
+
+template <typename T>
+void MultigridSolver<T>::v_cycle(int l) {
+  Level& level = levels[l];
+
+  if (l == (int)levels.size() - 1) {
+    smooth(level, kCoarseSweeps);
+    return;
+  }
+
+  smooth(level, kPreSmooth);
+  residual(level);
+
+  Level& coarse = levels[l+1];
+  restrict_residual(level, coarse);
+  std::fill(coarse.u.begin(), coarse.u.end(), 0);
+  v_cycle(l+1);
+  prolong(coarse, level);
+
+  smooth(level, kPostSmooth);
+}
+
+template <typename T>
+int MultigridSolver<T>::solve(T* u, const T* f, T tolerance, int max_cycles) {
+  Level& top = levels[0];
+  int size = top.width*top.height;
+  std::copy(u, u + size, top.u.begin());
+  std::copy(f, f + size, top.f.begin());
+
+  T f_norm = norm(top.f.data(), top.width, top.height);
+
+  int cycles = -1;
+  for (int cycle = 1; cycle <= max_cycles; cycle++) {
+    v_cycle(0);
+    if (residual(top) <= tolerance * f_norm) {
+      cycles = cycle;
+      break;
+    }
+  }
+
+  std::copy(top.u.begin(), top.u.end(), u);
+  return cycles;
+}
+
+template <typename T>
+void MultigridSolver<T>::apply_explicit(const T* in, T* out, T beta) {
+  int w = levels[0].width;
+  int h = levels[0].height;
+
+  pool->parallel_for(0, h, [&](int begin, int end) {
+    for (int y = begin; y < end; y++) {
+      for (int x = 0; x < w; x++) {
+        T sum = -4*in[y*w + x];
+        if (x > 0)
+          sum += in[y*w + x-1];
+        if (x < w-1)
+          sum += in[y*w + x+1];
+        if (y > 0)
+          sum += in[(y-1)*w + x];
+        if (y < h-1)
+          sum += in[(y+1)*w + x];
+        out[y*w + x] = in[y*w + x] + beta*sum;
+      }
+    }
+  });
+}
+
+#endif
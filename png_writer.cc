@@ -0,0 +1,58 @@
+#include "png_writer.h"
+
+#include <png.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <zlib.h>
+
+void write_png_file(const char* file_name, int width, int height, const uint8_t* pixels,
+                    PixelLayout layout, int compression_level) {
+  FILE *fd = fopen(file_name, "wb");
+  if (!fd) {
+    printf("Could not open file %s\n", file_name);
+    exit(-1);
+  }
+
+  png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  if (!png_ptr) {
+    printf("Could not create png_ptr\n");
+    exit(-1);
+  }
+
+  png_infop info_ptr = png_create_info_struct(png_ptr);
+  if (!info_ptr) {
+    printf("Could not create info_ptr\n");
+    exit(-1);
+  }
+
+  if (setjmp(png_jmpbuf(png_ptr))) {
+    printf("Error while writing png\n");
+    exit(-1);
+  }
+
+  png_init_io(png_ptr, fd);
+  if (compression_level >= 0) {
+    png_set_compression_level(png_ptr, compression_level);
+    // Filter selection costs more than it saves at the fast levels.
+    if (compression_level <= Z_BEST_SPEED)
+      png_set_filter(png_ptr, 0, PNG_FILTER_SUB);
+  }
+  png_set_IHDR(png_ptr, info_ptr, width, height, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+               PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+  png_write_info(png_ptr, info_ptr);
+
+  int stride = width*3;
+  if (layout == PixelLayout::kRGB32) {
+    // Little endian 0xFFRRGGBB words are B, G, R, X in memory.
+    png_set_bgr(png_ptr);
+    png_set_filler(png_ptr, 0, PNG_FILLER_AFTER);
+    stride = width*4;
+  }
+
+  for (int y = 0; y < height; y++)
+    png_write_row(png_ptr, (png_const_bytep)(pixels + y*stride));
+
+  png_write_end(png_ptr, NULL);
+  png_destroy_write_struct(&png_ptr, &info_ptr);
+  fclose(fd);
+}
@@ -0,0 +1,18 @@
+#include <stdint.h>
+
+#ifndef PNG_WRITER_H
+#define PNG_WRITER_H
+
+enum class PixelLayout {
+  // Packed 8 bit R, G, B.
+  kRGB,
+  // 0xFFRRGGBB words, the frame layout the display uses.
+  kRGB32,
+};
+
+// Writes an 8 bit RGB PNG. |compression_level| is a zlib level, or -1 for
+// libpng's default.
+void write_png_file(const char* file_name, int width, int height, const uint8_t* pixels,
+                    PixelLayout layout, int compression_level = -1);
+
+#endif
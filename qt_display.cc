@@ -1,12 +1,19 @@
 #include "qt_display.h"
 
 #include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+// Above this fraction of the frame, one whole copy and paint beats many
+// partial ones.
+static const double kFullFrameCoverage = 0.5;
 
 QtDisplay::QtDisplay(int width, int height) {
   this->width = width;
   this->height = height;
 
   framebuf = (uint8_t*)malloc(width*height*4);
+  have_frame = false;
 
   setFixedSize(width, height);
   setWindowTitle("test");
@@ -22,28 +29,112 @@ QtDisplay::~QtDisplay() {
 }
 
 void QtDisplay::paintEvent(QPaintEvent* e) {
-  Q_UNUSED(e);
-
   QPainter qp(this);
 
   framebuf_mutex.lock();
   QImage image(framebuf, width, height, width * 4, QImage::Format_RGB32);
-  qp.drawPixmap(0, 0, width, height, QPixmap::fromImage(image));
+  for (const QRect& rect : e->region())
+    qp.drawImage(rect, image, rect);
   framebuf_mutex.unlock();
-
-  needs_repaint = false;
 }
 
 void QtDisplay::timerEvent(QTimerEvent *e) {
   Q_UNUSED(e);
 
-  if (needs_repaint)
-    this->repaint();
+  if (!needs_repaint)
+    return;
+
+  QRegion region;
+  framebuf_mutex.lock();
+  region.swap(dirty_region);
+  needs_repaint = false;
+  framebuf_mutex.unlock();
+
+  this->repaint(region);
 }
 
 void QtDisplay::swap_buf(uint8_t* new_framebuf) {
   framebuf_mutex.lock();
   memcpy(framebuf, new_framebuf, width*height*4);
+  have_frame = true;
+  dirty_region = QRegion(QRect(0, 0, width, height));
   needs_repaint = true;
   framebuf_mutex.unlock();
 }
+
+void QtDisplay::copy_rect(const uint8_t* new_framebuf, const DirtyRect& rect) {
+  for (int y = rect.y_begin; y < rect.y_end; y++) {
+    size_t offset = ((size_t)y*width + rect.x_begin)*4;
+    memcpy(framebuf + offset, new_framebuf + offset, (rect.x_end - rect.x_begin)*4);
+  }
+}
+
+// Two rects merge if they overlap, or if they share an edge and their
+// union is exactly a rect, as runs of dirty tiles in neighbouring rows do.
+static bool can_merge(const DirtyRect& a, const DirtyRect& b) {
+  bool same_x = a.x_begin == b.x_begin && a.x_end == b.x_end;
+  bool same_y = a.y_begin == b.y_begin && a.y_end == b.y_end;
+  if (same_x && a.y_begin <= b.y_end && b.y_begin <= a.y_end)
+    return true;
+  if (same_y && a.x_begin <= b.x_end && b.x_begin <= a.x_end)
+    return true;
+  return a.x_begin < b.x_end && b.x_begin < a.x_end && a.y_begin < b.y_end && b.y_begin < a.y_end;
+}
+
+// Merges rects until none overlap, so their areas add up to the area they
+// cover.
+static void coalesce_rects(std::vector<DirtyRect>& rects) {
+  bool merged = true;
+  while (merged) {
+    merged = false;
+    for (size_t i = 0; i < rects.size(); i++) {
+      for (size_t j = i + 1; j < rects.size(); j++) {
+        if (!can_merge(rects[i], rects[j]))
+          continue;
+        rects[i].x_begin = std::min(rects[i].x_begin, rects[j].x_begin);
+        rects[i].x_end = std::max(rects[i].x_end, rects[j].x_end);
+        rects[i].y_begin = std::min(rects[i].y_begin, rects[j].y_begin);
+        rects[i].y_end = std::max(rects[i].y_end, rects[j].y_end);
+        rects[j] = rects.back();
+        rects.pop_back();
+        j = i;
+        merged = true;
+      }
+    }
+  }
+}
+
+void QtDisplay::swap_buf(uint8_t* new_framebuf, const std::vector<DirtyRect>& rects) {
+  std::vector<DirtyRect> clipped;
+  for (DirtyRect rect : rects) {
+    rect.x_begin = std::max(rect.x_begin, 0);
+    rect.x_end = std::min(rect.x_end, width);
+    rect.y_begin = std::max(rect.y_begin, 0);
+    rect.y_end = std::min(rect.y_end, height);
+    if (rect.x_begin < rect.x_end && rect.y_begin < rect.y_end)
+      clipped.push_back(rect);
+  }
+  coalesce_rects(clipped);
+
+  uint64_t area = 0;
+  for (const DirtyRect& rect : clipped)
+    area += (uint64_t)(rect.x_end - rect.x_begin)*(rect.y_end - rect.y_begin);
+  if (area > kFullFrameCoverage*width*height) {
+    swap_buf(new_framebuf);
+    return;
+  }
+
+  framebuf_mutex.lock();
+  if (!have_frame) {
+    framebuf_mutex.unlock();
+    swap_buf(new_framebuf);
+    return;
+  }
+  for (const DirtyRect& rect : clipped) {
+    copy_rect(new_framebuf, rect);
+    dirty_region += QRect(rect.x_begin, rect.y_begin, rect.x_end - rect.x_begin, rect.y_end - rect.y_begin);
+  }
+  if (!clipped.empty())
+    needs_repaint = true;
+  framebuf_mutex.unlock();
+}
@@ -1,12 +1,22 @@
 #include <stdint.h>
 #include <QPainter>
+#include <QRegion>
 #include <QSoundEffect>
 #include <QWidget>
 #include <mutex>
+#include <vector>
 
 #ifndef QT_DISPLAY_H
 #define QT_DISPLAY_H
 
+// Pixels [x_begin, x_end) x [y_begin, y_end) of a frame.
+struct DirtyRect {
+  int x_begin;
+  int x_end;
+  int y_begin;
+  int y_end;
+};
+
 class QtDisplay : public QWidget {
 private:
   int width;
@@ -14,9 +24,16 @@ private:
 
   std::mutex framebuf_mutex;
   uint8_t *framebuf;
+  // Whether |framebuf| holds a whole frame yet, which partial swaps build
+  // on.
+  bool have_frame;
+  // Area changed since the last repaint.
+  QRegion dirty_region;
 
   std::atomic<bool> needs_repaint;
 
+  void copy_rect(const uint8_t* new_framebuf, const DirtyRect& rect);
+
 protected:
   void paintEvent(QPaintEvent *e) override;
   void timerEvent(QTimerEvent *e) override;
@@ -26,6 +43,11 @@ public:
   ~QtDisplay();
 
   void swap_buf(uint8_t* new_framebuf);
+  // Like swap_buf(), but |new_framebuf| only differs from the previous
+  // frame within |rects|, so only those are copied and repainted. Rects may
+  // overlap and are clipped to the frame. Falls back to a whole frame when
+  // they cover most of it.
+  void swap_buf(uint8_t* new_framebuf, const std::vector<DirtyRect>& rects);
 };
 
 #endif
@@ -2,17 +2,48 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <stdint.h>
 #include <png.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
 #include <thread>
 
+#include "checkpoint.h"
+#include "frame_encoder.h"
+#include "frame_publisher.h"
+#include "frame_scheduler.h"
+#include "golden.h"
 #include "qt_display.h"
+#include "stage_profiler.h"
+#include "thread_pool.h"
 
 int width;
 int height;
 uint8_t* buf;
 QtDisplay* display;
+FrameScheduler* scheduler;
+FrameEncoder* encoder = nullptr;
+FramePublisher* publisher = nullptr;
+const int kRefreshPeriod = 33000;
+const int kRenderAheadFrames = 8;
 std::thread* paint_thread;
+CheckpointWriter* checkpoint_writer = nullptr;
+int checkpoint_interval = 300;
+uint64_t frame_count = 0;
+StageProfiler* profiler = nullptr;
+ThreadPool* pool = nullptr;
+// Pixels of a row dithered between checks on the row above.
+const int kDitherChunk = 256;
+const uint32_t kCheckpointProgram = checkpoint_tag("RWLK");
+// Tiles of the canvas that changed this frame, handed to the display as
+// one rect per run of tiles in a row.
+const int kDirtyTileSize = 32;
+int dirty_tiles_x;
+int dirty_tiles_y;
+std::vector<uint8_t> dirty_tiles;
+std::vector<DirtyRect> dirty_rects;
 
 struct TargetPixel {
   uint32_t color;
@@ -156,6 +187,113 @@ void dither_image(int n) {
   }
 }
 
+enum class Dither {
+  kBayer,
+  kErrorDiffusion,
+  kSerpentine,
+};
+
+// Accumulated error keeps values within a pixel's range of 0-255, so the
+// nearest level of anything in [-kDitherRange, 255 + kDitherRange] is
+// looked up instead of divided out per pixel.
+const int kDitherRange = 256;
+
+// Quantizes pixel (x, y) through |nearest_level| and spreads the error
+// with Floyd-Steinberg weights, mirrored when scanning right to left
+// (|dir| of -1). Errors are kept 16x scaled. |row_error| holds what the
+// row above pushed into this row, |next_row_error| collects what this row
+// pushes into the next, both with a spare entry at either end, and |carry|
+// is what the previous pixel pushed along the row.
+inline void diffuse_pixel(int x, int y, int dir, const uint8_t* nearest_level, const int* row_error,
+                          int* next_row_error, int& carry) {
+  uint8_t* pixel = buf + ((size_t)y*width + x)*4;
+  int val = pixel[0] + ((row_error[x] + carry + 8) >> 4);
+  val = std::min(std::max(val, -kDitherRange), 255 + kDitherRange);
+  int out = nearest_level[val + kDitherRange];
+  int error = val - out;
+
+  pixel[0] = out;
+  pixel[1] = out;
+  pixel[2] = out;
+  carry = 7*error;
+  next_row_error[x - dir] += 3*error;
+  next_row_error[x] += 5*error;
+  next_row_error[x + dir] += error;
+}
+
+// Error diffusion to 2^n grey levels. Each pixel only depends on the ones
+// before it in its row and on the three nearest in the row above, so rows
+// can run concurrently as a wavefront: rows are dealt out round robin to
+// the pool's workers, and a row only dithers a chunk once the row above is
+// past the end of it. Rows in flight keep their errors in a ring of
+// pool->size() + 1 row buffers.
+//
+// With |serpentine| every other row runs right to left. The first pixel of
+// such a row depends on the last one of the row above, so there is no
+// wavefront to exploit and the rows run in order on the calling thread.
+void error_diffuse_image(int n, bool serpentine) {
+  int levels = 1 << n;
+  int padded_width = width + 2;
+  std::vector<uint8_t> nearest_level(256 + 2*kDitherRange);
+  for (int i = 0; i < (int)nearest_level.size(); i++) {
+    int val = std::min(std::max(i - kDitherRange, 0), 255);
+    nearest_level[i] = (val*(levels - 1) + 127) / 255 * 255 / (levels - 1);
+  }
+
+  if (serpentine) {
+    std::vector<int> errors(2*padded_width, 0);
+    for (int y = 0; y < height; y++) {
+      int* row_error = errors.data() + (y % 2)*padded_width + 1;
+      int* next_row_error = errors.data() + ((y + 1) % 2)*padded_width + 1;
+      int carry = 0;
+      if (y % 2) {
+        for (int x = width - 1; x >= 0; x--)
+          diffuse_pixel(x, y, -1, nearest_level.data(), row_error, next_row_error, carry);
+      } else {
+        for (int x = 0; x < width; x++)
+          diffuse_pixel(x, y, 1, nearest_level.data(), row_error, next_row_error, carry);
+      }
+      memset(row_error - 1, 0, padded_width*sizeof(int));
+    }
+    return;
+  }
+
+  int workers = pool->size();
+  int ring_rows = workers + 1;
+  std::vector<int> errors(ring_rows*padded_width, 0);
+  // Pixels done per row.
+  std::unique_ptr<std::atomic<int>[]> progress(new std::atomic<int>[height]);
+  for (int y = 0; y < height; y++)
+    progress[y] = 0;
+
+  // Band i of a range of size() runs on worker i, so each worker takes
+  // every workers-th row.
+  pool->parallel_for(0, workers, [&](int begin, int end) {
+    for (int y = begin; y < height; y += workers) {
+      int* row_error = errors.data() + (y % ring_rows)*padded_width + 1;
+      int* next_row_error = errors.data() + ((y + 1) % ring_rows)*padded_width + 1;
+      int carry = 0;
+
+      for (int x_begin = 0; x_begin < width; x_begin += kDitherChunk) {
+        int x_end = std::min(x_begin + kDitherChunk, width);
+        // The row above must be done with the pixel past the chunk, which
+        // still pushes error into it, and is then writing beyond it.
+        if (y > 0) {
+          int needed = std::min(x_end + 1, width);
+          while (progress[y-1].load(std::memory_order_acquire) < needed)
+            std::this_thread::yield();
+        }
+        for (int x = x_begin; x < x_end; x++)
+          diffuse_pixel(x, y, 1, nearest_level.data(), row_error, next_row_error, carry);
+        progress[y].store(x_end, std::memory_order_release);
+      }
+
+      // Row y + workers, the next to use this buffer, runs on this worker.
+      memset(row_error - 1, 0, padded_width*sizeof(int));
+    }
+  });
+}
+
 void find_target_pixels() {
   uint32_t* color_buf = (uint32_t*)buf;
   for (int i = 0; i < width*height; i++) {
@@ -176,14 +314,29 @@ void find_target_pixels() {
   }
 }
 
+void mark_dirty(int x, int y) {
+  dirty_tiles[(y / kDirtyTileSize)*dirty_tiles_x + x / kDirtyTileSize] = 1;
+}
+
 void paint_target_pixels() {
   int kFadeCoeff = 10;
 //  memset(buf, 255, width*height*4);
 
+  if (dirty_tiles.empty()) {
+    dirty_tiles_x = (width + kDirtyTileSize - 1) / kDirtyTileSize;
+    dirty_tiles_y = (height + kDirtyTileSize - 1) / kDirtyTileSize;
+    dirty_tiles.resize(dirty_tiles_x*dirty_tiles_y);
+  }
+  std::fill(dirty_tiles.begin(), dirty_tiles.end(), 0);
+
   for (int i = 0; i < width*height; i++) {
     int r = buf[i*4];
     int g = buf[i*4+1];
     int b = buf[i*4+2];
+    // Fully faded pixels are the bulk of the canvas and stay put.
+    if ((r & g & b) == 255)
+      continue;
+    mark_dirty(i % width, i / width);
 
     r += kFadeCoeff;
     if (r > 255)
@@ -202,8 +355,22 @@ void paint_target_pixels() {
 
   uint32_t* color_buf = (uint32_t*)buf;
 
-  for (auto pixel : target_pixels)
+  for (auto pixel : target_pixels) {
     color_buf[pixel.y*width + pixel.x] = pixel.color;
+    mark_dirty(pixel.x, pixel.y);
+  }
+
+  dirty_rects.clear();
+  for (int ty = 0; ty < dirty_tiles_y; ty++) {
+    for (int tx = 0; tx < dirty_tiles_x; tx++) {
+      if (!dirty_tiles[ty*dirty_tiles_x + tx])
+        continue;
+      int run_begin = tx;
+      while (tx < dirty_tiles_x && dirty_tiles[ty*dirty_tiles_x + tx])
+        tx++;
+      dirty_rects.push_back({run_begin*kDirtyTileSize, tx*kDirtyTileSize, ty*kDirtyTileSize, (ty + 1)*kDirtyTileSize});
+    }
+  }
 }
 
 int restart_probability = 100;
@@ -230,11 +397,11 @@ void walk_targets() {
             pixel.y--;
           break;
         case 1:
-          if (pixel.x < width)
+          if (pixel.x < width - 1)
             pixel.x++;
           break;
         case 2:
-          if (pixel.y < height)
+          if (pixel.y < height - 1)
             pixel.y++;
           break;
         case 3:
@@ -252,59 +419,244 @@ void walk_targets() {
   target_pixels = std::move(new_targets);
 }
 
-void paint_loop() {
-  auto last_buf_swap = std::chrono::high_resolution_clock::now();
-  int kRefreshPeriod = 33000;
-  uint64_t frame_count = 0;
-  while(1) {
-    if (frame_count % 5 == 0) {
-      restart_probability += restart_probability_dir;
-      if (restart_probability < 0) {
-        restart_probability = 0;
-        restart_probability_dir *= -1;
-      } else if (restart_probability > 100) {
-        restart_probability = 100;
-        restart_probability_dir *= -1;
-      }
+struct CheckpointCanvas {
+  int32_t width;
+  int32_t height;
+  int32_t restart_probability;
+  int32_t restart_probability_dir;
+};
+
+void save_checkpoint() {
+  if (!checkpoint_writer->begin(frame_count))
+    return;
+
+  CheckpointCanvas canvas;
+  canvas.width = width;
+  canvas.height = height;
+  canvas.restart_probability = restart_probability;
+  canvas.restart_probability_dir = restart_probability_dir;
+  checkpoint_writer->add_section(checkpoint_tag("DIMS"), &canvas, sizeof(canvas));
+  checkpoint_writer->add_section(checkpoint_tag("CANV"), buf, width*height*4);
+  checkpoint_writer->add_section(checkpoint_tag("TPIX"), target_pixels.data(), target_pixels.size()*sizeof(TargetPixel));
+  checkpoint_writer->commit();
+}
+
+// Restores the canvas and walkers in place of reading, dithering and
+// scanning the source image.
+void restore_checkpoint(const char* path) {
+  CheckpointReader reader;
+  if (!reader.open(path, kCheckpointProgram))
+    exit(-1);
+
+  size_t canvas_size, buf_size, pixels_size;
+  const CheckpointCanvas* canvas = (const CheckpointCanvas*)reader.section(checkpoint_tag("DIMS"), &canvas_size);
+  const void* canvas_buf = reader.section(checkpoint_tag("CANV"), &buf_size);
+  const TargetPixel* pixels = (const TargetPixel*)reader.section(checkpoint_tag("TPIX"), &pixels_size);
+  if (!canvas || !canvas_buf || !pixels || canvas_size != sizeof(CheckpointCanvas) ||
+      buf_size != (size_t)canvas->width*canvas->height*4 || pixels_size % sizeof(TargetPixel)) {
+    printf("Checkpoint does not match the canvas\n");
+    exit(-1);
+  }
+
+  width = canvas->width;
+  height = canvas->height;
+  restart_probability = canvas->restart_probability;
+  restart_probability_dir = canvas->restart_probability_dir;
+  buf = (uint8_t*)malloc(buf_size);
+  memcpy(buf, canvas_buf, buf_size);
+  target_pixels.assign(pixels, pixels + pixels_size / sizeof(TargetPixel));
+  frame_count = reader.frame();
+}
+
+void next_frame() {
+  if (frame_count % 5 == 0) {
+    restart_probability += restart_probability_dir;
+    if (restart_probability < 0) {
+      restart_probability = 0;
+      restart_probability_dir *= -1;
+    } else if (restart_probability > 100) {
+      restart_probability = 100;
+      restart_probability_dir *= -1;
     }
+  }
 
-    frame_count++;
+  frame_count++;
 
+  {
+    StageScope stage(profiler, "walk");
     walk_targets();
+  }
+  {
+    StageScope stage(profiler, "paint");
     paint_target_pixels();
-    display->swap_buf(buf);
-    auto curr_time = std::chrono::high_resolution_clock::now();
-    auto time_in_microseconds =
-        std::chrono::duration_cast<std::chrono::microseconds>(curr_time -
-                                                              last_buf_swap);
-
-    if (time_in_microseconds.count() < kRefreshPeriod) {
-      usleep(kRefreshPeriod - time_in_microseconds.count());
-    } else {
-      printf("Warning! Frame lag! %lu us\n", time_in_microseconds.count());
+  }
+}
+
+void paint_loop() {
+  if (profiler)
+    profiler->add_current_thread();
+
+  while(1) {
+    next_frame();
+    {
+      StageScope stage(profiler, "present");
+      scheduler->push_frame(buf, 1, &dirty_rects);
+    }
+
+    if (checkpoint_writer && frame_count % checkpoint_interval == 0) {
+      StageScope stage(profiler, "checkpoint");
+      save_checkpoint();
     }
-    last_buf_swap = std::chrono::high_resolution_clock::now();
   }
 }
 
+void headless_loop(int frames, GoldenRecorder* recorder) {
+  if (profiler)
+    profiler->add_current_thread();
+
+  for (int frame = 0; frame < frames; frame++) {
+    next_frame();
+    recorder->add_frame(buf);
+    {
+      StageScope stage(profiler, "present");
+      scheduler->push_frame(buf);
+    }
+  }
+}
+
+void usage(const char* name) {
+  printf("Usage: %s [-S seed] [-c checkpoint_path] [-k checkpoint_interval_frames]\n"
+         "          [-n headless_frames [-W golden_path] [-C golden_path]]\n"
+         "          [-E png:pattern|y4m:path|raw:path] [-X shm_name] [-P] [-D bayer|fs|serpentine]\n"
+         "          (-r restore_path | image.png)\n"
+         "-D picks ordered (Bayer) dithering or Floyd-Steinberg error diffusion, optionally serpentine.\n"
+         "Plain error diffusion runs rows in parallel; serpentine runs them in order.\n"
+         "-X publishes frames to a shared memory ring for other processes, see frame_ring.h.\n"
+         "-P reports hardware counters for each stage of the frame loop at exit.\n", name);
+  exit(-1);
+}
+
 int main(int argc, char** argv) {
   time_t t;
+  unsigned int seed = time(&t);
+
+  const char* checkpoint_path = nullptr;
+  const char* restore_path = nullptr;
+  int headless_frames = 0;
+  const char* golden_write_path = nullptr;
+  const char* golden_compare_path = nullptr;
+  EncoderFormat encoder_format;
+  const char* encoder_path = nullptr;
+  const char* publish_name = nullptr;
+  Dither dither = Dither::kBayer;
+  int opt;
+  while ((opt = getopt(argc, argv, "S:c:k:r:n:W:C:E:PD:X:")) != -1) {
+    switch (opt) {
+      case 'S':
+        seed = strtoul(optarg, nullptr, 0);
+        break;
+      case 'c':
+        checkpoint_path = optarg;
+        break;
+      case 'k':
+        checkpoint_interval = atoi(optarg);
+        if (checkpoint_interval <= 0)
+          usage(argv[0]);
+        break;
+      case 'r':
+        restore_path = optarg;
+        break;
+      case 'n':
+        headless_frames = atoi(optarg);
+        break;
+      case 'W':
+        golden_write_path = optarg;
+        break;
+      case 'C':
+        golden_compare_path = optarg;
+        break;
+      case 'E':
+        if (!parse_encoder_spec(optarg, encoder_format, encoder_path))
+          usage(argv[0]);
+        break;
+      case 'X':
+        publish_name = optarg;
+        break;
+      case 'P':
+        profiler = new StageProfiler();
+        break;
+      case 'D':
+        if (!strcmp(optarg, "bayer"))
+          dither = Dither::kBayer;
+        else if (!strcmp(optarg, "fs"))
+          dither = Dither::kErrorDiffusion;
+        else if (!strcmp(optarg, "serpentine"))
+          dither = Dither::kSerpentine;
+        else
+          usage(argv[0]);
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+
+  srand(seed);
 
-  srand((unsigned) time(&t));
+  if (restore_path) {
+    restore_checkpoint(restore_path);
+  } else {
+    if (optind >= argc)
+      usage(argv[0]);
 
-  read_png_file(argv[1], width, height, buf);
+    read_png_file(argv[optind], width, height, buf);
+
+    greyscale_image();
+    //darken_foreground();
+    if (dither == Dither::kBayer) {
+      dither_image(1);
+    } else {
+      pool = new ThreadPool();
+      error_diffuse_image(1, dither == Dither::kSerpentine);
+    }
 
-  greyscale_image();
-  //darken_foreground();
-  dither_image(1);
+    find_target_pixels();
+  }
 
-  find_target_pixels();
+  if (checkpoint_path)
+    checkpoint_writer = new CheckpointWriter(checkpoint_path, kCheckpointProgram);
+
+  if (encoder_path)
+    encoder = new FrameEncoder(encoder_format, encoder_path, width, height, 1000000 / kRefreshPeriod);
+
+  if (publish_name)
+    publisher = new FramePublisher(publish_name, width, height);
+
+  if (headless_frames) {
+    scheduler = new FrameScheduler(nullptr, width, height, kRenderAheadFrames, kRefreshPeriod);
+    scheduler->set_encoder(encoder);
+    scheduler->set_publisher(publisher);
+    GoldenRecorder recorder(width, height);
+    headless_loop(headless_frames, &recorder);
+    delete encoder;
+    delete publisher;
+    if (profiler)
+      profiler->report();
+    return recorder.finish(golden_write_path, golden_compare_path, kCheckpointProgram, 0);
+  }
 
   QApplication app(argc, argv);
 
   display = new QtDisplay(width, height);
+  scheduler = new FrameScheduler(display, width, height, kRenderAheadFrames, kRefreshPeriod);
+  scheduler->set_encoder(encoder);
+  scheduler->set_publisher(publisher);
 
   paint_thread = new std::thread(paint_loop);
 
-  return app.exec();
+  int ret = app.exec();
+  if (publisher)
+    publisher->unlink();
+  if (profiler)
+    profiler->report();
+  return ret;
 }
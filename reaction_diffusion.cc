@@ -0,0 +1,661 @@
+#include <QApplication>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <thread>
+
+#include "checkpoint.h"
+#include "colormap.h"
+#include "field_reducer.h"
+#include "frame_encoder.h"
+#include "frame_publisher.h"
+#include "frame_scheduler.h"
+#include "golden.h"
+#include "halo.h"
+#include "reaction_diffusion.h"
+#include "scalar.h"
+#include "simulation.h"
+#include "stage_profiler.h"
+#include "step_controller.h"
+#include "thread_pool.h"
+#include "qt_display.h"
+
+int width = 500;
+int height = 500;
+int grid_width = 500;
+int grid_height = 500;
+uint8_t* buf;
+QtDisplay* display;
+FrameScheduler* scheduler;
+FrameEncoder* encoder = nullptr;
+FramePublisher* publisher = nullptr;
+StepController* controller;
+const int kRefreshPeriod = 33000;
+const int kRenderAheadFrames = 8;
+// Headless runs use a fixed step count per frame instead of the wall clock
+// driven StepController, so their frames are reproducible.
+const int kHeadlessStepsPerFrame = 10;
+std::thread* paint_thread;
+ThreadPool* pool;
+Simulation* sim;
+Precision precision = Precision::kDouble;
+CheckpointWriter* checkpoint_writer = nullptr;
+int checkpoint_interval = 300;
+uint64_t frame_count = 0;
+StageProfiler* profiler = nullptr;
+const uint32_t kCheckpointProgram = checkpoint_tag("RDIF");
+
+enum class ModelType {
+  kGreyScott,
+  kDiffusion,
+  kBrusselator,
+  kFitzHughNagumo,
+};
+
+bool parse_model(const char* name, ModelType& model) {
+  if (!strcmp(name, "grey-scott"))
+    model = ModelType::kGreyScott;
+  else if (!strcmp(name, "diffusion"))
+    model = ModelType::kDiffusion;
+  else if (!strcmp(name, "brusselator"))
+    model = ModelType::kBrusselator;
+  else if (!strcmp(name, "fitzhugh-nagumo"))
+    model = ModelType::kFitzHughNagumo;
+  else
+    return false;
+  return true;
+}
+
+// Leads every checkpoint so a restore can size the grid and pick the model
+// before constructing the simulation.
+struct CheckpointGrid {
+  int32_t width;
+  int32_t height;
+  int32_t precision;
+  int32_t model;
+};
+
+// The coefficients of each model are compile-time constants, so they fold
+// into its kernel. Only the time step is set at run time.
+struct GreyScottCoefficients {
+  static constexpr double diffusion = 0.05;
+  static constexpr double replacement = 0.05;
+  static constexpr double v_decay = 0.05;
+  static constexpr double reaction = 1.0;
+  double dt;
+};
+
+struct DiffusionCoefficients {
+  static constexpr double diffusion = 0.1;
+  double dt;
+};
+
+struct BrusselatorCoefficients {
+  static constexpr double a = 3.0;
+  static constexpr double b = 6.0;
+  static constexpr double u_diffusion = 2.0;
+  static constexpr double v_diffusion = 16.0;
+  double dt;
+};
+
+struct FitzHughNagumoCoefficients {
+  static constexpr double u_diffusion = 0.25;
+  static constexpr double v_diffusion = 5.0;
+  static constexpr double epsilon = 4.0;
+  static constexpr double a1 = 0.5;
+  static constexpr double a0 = 0.0;
+  double dt;
+};
+
+// How each model is run and shown, indexed by ModelType. The grid starts at
+// |rest| plus noise, with a square of |seed| in the middle. Models whose
+// rest state is unstable grow patterns out of the noise alone.
+struct ModelInfo {
+  const char* name;
+  double dt;
+  int shown_species;
+  float color_min;
+  float color_max;
+  double rest[2];
+  double seed[2];
+};
+
+const ModelInfo kModels[] = {
+  {"grey-scott", 1.0, 1, 0.0f, 0.5f, {1.0, 0.0}, {0.5, 0.25}},
+  {"diffusion", 1.0, 0, 0.0f, 1.0f, {0.0, 0.0}, {1.0, 0.0}},
+  {"brusselator", 0.01, 0, 1.0f, 5.0f, {3.0, 2.0}, {3.0, 2.0}},
+  {"fitzhugh-nagumo", 0.02, 0, -1.0f, 1.0f, {0.0, 0.0}, {0.0, 0.0}},
+};
+
+struct ReactionDiffusionOptions {
+  int width;
+  int height;
+  int display_width;
+  int display_height;
+  Viewport view;
+  ModelType model;
+  Boundary boundary;
+  double dt;
+  // Amplitude of the uniform noise added to every species at the start.
+  double noise;
+  int shown_species;
+  const Colormap* colormap;
+  float color_min;
+  float color_max;
+};
+
+// Steps any model through the shared engine: all species stored as S, one
+// fused pass per step, rows spread over the pool in the bands they were
+// first touched in.
+template <typename S, typename Model>
+class ReactionDiffusion : public Simulation {
+private:
+  int width;
+  int height;
+  int display_width;
+  int display_height;
+  int stride;
+  Boundary boundary;
+  ThreadPool* pool;
+  FieldReducer reducer;
+  Model model;
+  SpeciesFields<S, Model::kSpecies> fields;
+  float* display_field;
+  int shown_species;
+  const Colormap* colormap;
+  float color_min;
+  float color_max;
+
+  template <int kWidth>
+  void step_rows();
+  void seed(const ModelInfo& info, double noise);
+
+public:
+  ReactionDiffusion(const ReactionDiffusionOptions& options, ThreadPool* pool);
+  ~ReactionDiffusion();
+
+  void step() override;
+  void render(uint8_t* buf) override;
+  void save(CheckpointWriter* writer) override;
+  bool restore(const CheckpointReader& reader) override;
+};
+
+template <typename S, typename Model>
+ReactionDiffusion<S, Model>::ReactionDiffusion(const ReactionDiffusionOptions& options, ThreadPool* pool)
+    : reducer(options.width, options.height, options.display_width, options.display_height, pool),
+      fields(options.width, options.height, pool) {
+  width = options.width;
+  height = options.height;
+  display_width = options.display_width;
+  display_height = options.display_height;
+  stride = halo_stride(width);
+  boundary = options.boundary;
+  model.dt = options.dt;
+  shown_species = options.shown_species;
+  colormap = options.colormap;
+  color_min = options.color_min;
+  color_max = options.color_max;
+  this->pool = pool;
+  reducer.set_viewport(options.view);
+
+  display_field = (float*)malloc(display_width*display_height*sizeof(float));
+  seed(kModels[(int)options.model], options.noise);
+}
+
+template <typename S, typename Model>
+ReactionDiffusion<S, Model>::~ReactionDiffusion() {
+  free(display_field);
+}
+
+// The spacing 2 stencil steps the four sublattices of even and odd x and y
+// independently, so the noise is drawn per 2x2 block. Every sublattice then
+// starts out alike and they evolve as one.
+template <typename S, typename Model>
+void ReactionDiffusion<S, Model>::seed(const ModelInfo& info, double noise) {
+  int seed_size = std::max(std::min(width, height) / 16, 2) & ~1;
+  int seed_x = (width/2 - seed_size/2) & ~1;
+  int seed_y = (height/2 - seed_size/2) & ~1;
+
+  for (int y = 0; y < height; y += 2) {
+    for (int x = 0; x < width; x += 2) {
+      bool in_seed = x >= seed_x && x < seed_x + seed_size && y >= seed_y && y < seed_y + seed_size;
+      for (int s = 0; s < Model::kSpecies; s++) {
+        double val = in_seed ? info.seed[s] : info.rest[s];
+        val += noise * (2.0 * rand() / RAND_MAX - 1);
+        for (int cell_y = y; cell_y < std::min(y + 2, height); cell_y++) {
+          for (int cell_x = x; cell_x < std::min(x + 2, width); cell_x++)
+            fields.current[s][cell_y*stride + cell_x] = val;
+        }
+      }
+    }
+  }
+}
+
+// Whole rows, so a specialized width fixes the trip count as well as the
+// stride. kWidth is 0 for the generic kernel.
+template <typename S, typename Model>
+template <int kWidth>
+void ReactionDiffusion<S, Model>::step_rows() {
+  pool->parallel_for(0, height, [&](int begin, int end) {
+    const int kStride = kWidth ? halo_stride(kWidth) : 0;
+    for (int y = begin; y < end; y++)
+      step_species_row<S, Model, kStride, kWidth, false>(fields, (size_t)y*stride, width, model);
+  });
+}
+
+template <typename S, typename Model>
+void ReactionDiffusion<S, Model>::step() {
+  fields.fill_halo(boundary);
+  bool specialized = dispatch_specialized_width(width, [this](auto fixed_width) {
+    step_rows<decltype(fixed_width)::value>();
+  });
+  if (!specialized)
+    step_rows<0>();
+  fields.swap();
+}
+
+template <typename S, typename Model>
+void ReactionDiffusion<S, Model>::render(uint8_t* buf) {
+  reducer.reduce(fields.current[shown_species], display_field, stride);
+
+  uint32_t* color_buf = (uint32_t*)buf;
+  pool->parallel_for(0, display_height, [&](int begin, int end) {
+    int offset = begin*display_width;
+    colormap->apply(display_field + offset, color_buf + offset, (end - begin)*display_width, color_min, color_max);
+  });
+}
+
+template <typename S, typename Model>
+void ReactionDiffusion<S, Model>::save(CheckpointWriter* writer) {
+  for (int s = 0; s < Model::kSpecies; s++) {
+    char tag[5];
+    snprintf(tag, sizeof(tag), "SPC%d", s);
+    writer->add_section(checkpoint_tag(tag), fields.current[s], width*sizeof(S), height, stride*sizeof(S));
+  }
+}
+
+template <typename S, typename Model>
+bool ReactionDiffusion<S, Model>::restore(const CheckpointReader& reader) {
+  const void* data[Model::kSpecies];
+  for (int s = 0; s < Model::kSpecies; s++) {
+    char tag[5];
+    snprintf(tag, sizeof(tag), "SPC%d", s);
+    size_t size;
+    data[s] = reader.section(checkpoint_tag(tag), &size);
+    if (!data[s] || size != width*height*sizeof(S))
+      return false;
+  }
+
+  for (int s = 0; s < Model::kSpecies; s++) {
+    for (int y = 0; y < height; y++)
+      memcpy(fields.current[s] + y*stride, (const S*)data[s] + y*width, width*sizeof(S));
+  }
+  return true;
+}
+
+template <typename Model>
+Simulation* make_model_simulation(Precision precision, const ReactionDiffusionOptions& options) {
+  switch (precision) {
+    case Precision::kFloat:
+      return new ReactionDiffusion<float, Model>(options, pool);
+    case Precision::kHalf:
+      return new ReactionDiffusion<Half, Model>(options, pool);
+    case Precision::kBFloat16:
+      return new ReactionDiffusion<BFloat16, Model>(options, pool);
+    default:
+      return new ReactionDiffusion<double, Model>(options, pool);
+  }
+}
+
+Simulation* make_simulation(Precision precision, const ReactionDiffusionOptions& options) {
+  switch (options.model) {
+    case ModelType::kDiffusion:
+      return make_model_simulation<DiffusionModel<DiffusionCoefficients>>(precision, options);
+    case ModelType::kBrusselator:
+      return make_model_simulation<BrusselatorModel<BrusselatorCoefficients>>(precision, options);
+    case ModelType::kFitzHughNagumo:
+      return make_model_simulation<FitzHughNagumoModel<FitzHughNagumoCoefficients>>(precision, options);
+    default:
+      return make_model_simulation<GreyScottModel<GreyScottCoefficients>>(precision, options);
+  }
+}
+
+ModelType model = ModelType::kGreyScott;
+
+void save_checkpoint() {
+  if (!checkpoint_writer->begin(frame_count))
+    return;
+
+  CheckpointGrid grid;
+  grid.width = grid_width;
+  grid.height = grid_height;
+  grid.precision = (int32_t)precision;
+  grid.model = (int32_t)model;
+  checkpoint_writer->add_section(checkpoint_tag("GRID"), &grid, sizeof(grid));
+  sim->save(checkpoint_writer);
+  checkpoint_writer->commit();
+}
+
+void paint_loop() {
+  if (profiler)
+    profiler->add_current_thread();
+
+  while(1) {
+    int steps = controller->steps();
+    {
+      StageScope stage(profiler, "step");
+      auto step_start = std::chrono::high_resolution_clock::now();
+      for (int i = 0; i < steps; i++)
+        sim->step();
+      auto step_end = std::chrono::high_resolution_clock::now();
+      controller->record_steps(steps, std::chrono::duration_cast<std::chrono::microseconds>(step_end - step_start).count());
+    }
+
+    {
+      StageScope stage(profiler, "wait");
+      buf = scheduler->begin_frame();
+    }
+    {
+      StageScope stage(profiler, "render");
+      auto render_start = std::chrono::high_resolution_clock::now();
+      sim->render(buf);
+      auto render_end = std::chrono::high_resolution_clock::now();
+      controller->record_render(std::chrono::duration_cast<std::chrono::microseconds>(render_end - render_start).count());
+    }
+    {
+      StageScope stage(profiler, "present");
+      scheduler->end_frame(controller->periods());
+    }
+
+    frame_count++;
+    if (checkpoint_writer && frame_count % checkpoint_interval == 0) {
+      StageScope stage(profiler, "checkpoint");
+      save_checkpoint();
+    }
+  }
+}
+
+void headless_loop(int frames, GoldenRecorder* recorder) {
+  if (profiler)
+    profiler->add_current_thread();
+
+  for (int frame = 0; frame < frames; frame++) {
+    {
+      StageScope stage(profiler, "step");
+      for (int i = 0; i < kHeadlessStepsPerFrame; i++)
+        sim->step();
+    }
+    {
+      StageScope stage(profiler, "wait");
+      buf = scheduler->begin_frame();
+    }
+    {
+      StageScope stage(profiler, "render");
+      sim->render(buf);
+    }
+    recorder->add_frame(buf);
+    {
+      StageScope stage(profiler, "present");
+      scheduler->end_frame();
+    }
+  }
+}
+
+void usage(const char* name) {
+  printf("Usage: %s [-M grey-scott|diffusion|brusselator|fitzhugh-nagumo] [-p double|float|half|bfloat16]\n"
+         "          [-g grid_width x grid_height] [-d display_width x display_height] [-z zoom]\n"
+         "          [-o center_x,center_y] [-t time_step] [-S seed] [-a noise] [-v species]\n"
+         "          [-B zero|periodic|reflective] [-N none|cpu|node]\n"
+         "          [-c checkpoint_path] [-k checkpoint_interval_frames] [-r restore_path]\n"
+         "          [-m grey|viridis|inferno|#rrggbb,#rrggbb,...] [-L 256|4096] [-l color_min:color_max]\n"
+         "          [-n headless_frames [-W golden_path] [-C golden_path] [-e tolerance]]\n"
+         "          [-E png:pattern|y4m:path|raw:path] [-X shm_name] [-P]\n"
+         "Every model runs through the same fused kernel, see reaction_diffusion.h. The time step,\n"
+         "shown species and color range default to suit the model.\n"
+         "-N pins the simulation workers to a CPU or a NUMA node each, spread over all nodes.\n"
+         "-X publishes frames to a shared memory ring for other processes, see frame_ring.h.\n"
+         "-P reports hardware counters for each stage of the frame loop at exit, plus the achieved steps/s\n"
+         "for GUI runs.\n", name);
+  exit(-1);
+}
+
+int main(int argc, char** argv) {
+  unsigned seed = 1;
+  Viewport view;
+  view.zoom = 1.0;
+  bool has_center = false;
+  Boundary boundary = Boundary::kReflective;
+  ThreadPinning pinning = ThreadPinning::kNone;
+  double dt = 0;
+  double noise = 0.01;
+  int shown_species = -1;
+  const char* checkpoint_path = nullptr;
+  const char* restore_path = nullptr;
+  int headless_frames = 0;
+  const char* golden_write_path = nullptr;
+  const char* golden_compare_path = nullptr;
+  int tolerance = 0;
+  const char* colormap_spec = "viridis";
+  int lut_size = 256;
+  bool has_color_range = false;
+  float color_min = 0;
+  float color_max = 1;
+  EncoderFormat encoder_format;
+  const char* encoder_path = nullptr;
+  const char* publish_name = nullptr;
+  bool profile = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "M:p:g:d:z:o:t:S:a:v:B:N:c:k:r:n:W:C:e:m:L:l:E:X:P")) != -1) {
+    switch (opt) {
+      case 'M':
+        if (!parse_model(optarg, model))
+          usage(argv[0]);
+        break;
+      case 'p':
+        if (!parse_precision(optarg, precision))
+          usage(argv[0]);
+        break;
+      case 'g':
+        if (sscanf(optarg, "%dx%d", &grid_width, &grid_height) != 2 || grid_width <= 0 || grid_height <= 0)
+          usage(argv[0]);
+        break;
+      case 'd':
+        if (sscanf(optarg, "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0)
+          usage(argv[0]);
+        break;
+      case 'z':
+        view.zoom = atof(optarg);
+        if (view.zoom <= 0)
+          usage(argv[0]);
+        break;
+      case 'o':
+        if (sscanf(optarg, "%lf,%lf", &view.center_x, &view.center_y) != 2)
+          usage(argv[0]);
+        has_center = true;
+        break;
+      case 't':
+        dt = atof(optarg);
+        break;
+      case 'S':
+        seed = strtoul(optarg, nullptr, 0);
+        break;
+      case 'a':
+        noise = atof(optarg);
+        break;
+      case 'v':
+        shown_species = atoi(optarg);
+        break;
+      case 'B':
+        if (!parse_boundary(optarg, boundary))
+          usage(argv[0]);
+        break;
+      case 'N':
+        if (!parse_thread_pinning(optarg, pinning))
+          usage(argv[0]);
+        break;
+      case 'c':
+        checkpoint_path = optarg;
+        break;
+      case 'k':
+        checkpoint_interval = atoi(optarg);
+        if (checkpoint_interval <= 0)
+          usage(argv[0]);
+        break;
+      case 'r':
+        restore_path = optarg;
+        break;
+      case 'n':
+        headless_frames = atoi(optarg);
+        break;
+      case 'W':
+        golden_write_path = optarg;
+        break;
+      case 'C':
+        golden_compare_path = optarg;
+        break;
+      case 'e':
+        tolerance = atoi(optarg);
+        break;
+      case 'm':
+        colormap_spec = optarg;
+        break;
+      case 'L':
+        lut_size = atoi(optarg);
+        break;
+      case 'l':
+        if (sscanf(optarg, "%f:%f", &color_min, &color_max) != 2 || color_max <= color_min)
+          usage(argv[0]);
+        has_color_range = true;
+        break;
+      case 'E':
+        if (!parse_encoder_spec(optarg, encoder_format, encoder_path))
+          usage(argv[0]);
+        break;
+      case 'X':
+        publish_name = optarg;
+        break;
+      case 'P':
+        profile = true;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  srand(seed);
+
+  // The checkpoint's grid, precision and model take precedence over the
+  // flags, since the saved state only makes sense for the model and grid it
+  // was computed on.
+  CheckpointReader reader;
+  if (restore_path) {
+    if (!reader.open(restore_path, kCheckpointProgram))
+      exit(-1);
+
+    size_t grid_size;
+    const CheckpointGrid* grid = (const CheckpointGrid*)reader.section(checkpoint_tag("GRID"), &grid_size);
+    if (!grid || grid_size != sizeof(CheckpointGrid)) {
+      printf("Checkpoint is missing its grid description\n");
+      exit(-1);
+    }
+    if (grid->width <= 0 || grid->height <= 0 ||
+        grid->width > kCheckpointMaxGridSide || grid->height > kCheckpointMaxGridSide) {
+      printf("Checkpoint has invalid grid %dx%d\n", grid->width, grid->height);
+      exit(-1);
+    }
+    if (grid->precision < (int32_t)Precision::kDouble || grid->precision > (int32_t)Precision::kBFloat16) {
+      printf("Checkpoint has unknown precision %d\n", grid->precision);
+      exit(-1);
+    }
+    grid_width = grid->width;
+    grid_height = grid->height;
+    precision = (Precision)grid->precision;
+    if (grid->model < 0 || grid->model >= (int32_t)(sizeof(kModels) / sizeof(kModels[0]))) {
+      printf("Checkpoint has unknown model %d\n", grid->model);
+      exit(-1);
+    }
+    model = (ModelType)grid->model;
+    frame_count = reader.frame();
+  }
+
+  const ModelInfo& info = kModels[(int)model];
+  int num_species = model == ModelType::kDiffusion ? 1 : 2;
+  if (shown_species < 0)
+    shown_species = info.shown_species;
+  if (shown_species >= num_species)
+    usage(argv[0]);
+  if (!has_center) {
+    view.center_x = grid_width / 2.0;
+    view.center_y = grid_height / 2.0;
+  }
+
+  ReactionDiffusionOptions options;
+  options.width = grid_width;
+  options.height = grid_height;
+  options.display_width = width;
+  options.display_height = height;
+  options.view = view;
+  options.model = model;
+  options.boundary = boundary;
+  options.dt = dt ? dt : info.dt;
+  options.noise = noise;
+  options.shown_species = shown_species;
+  options.colormap = parse_colormap(colormap_spec, lut_size);
+  if (!options.colormap)
+    usage(argv[0]);
+  options.color_min = has_color_range ? color_min : info.color_min;
+  options.color_max = has_color_range ? color_max : info.color_max;
+
+  pool = new ThreadPool(0, pinning);
+  if (profile) {
+    profiler = new StageProfiler();
+    profiler->add_pool(pool);
+  }
+  printf("Running %s with time step %g\n", info.name, options.dt);
+  sim = make_simulation(precision, options);
+  if (restore_path && !sim->restore(reader)) {
+    printf("Checkpoint does not match the simulation\n");
+    exit(-1);
+  }
+  if (checkpoint_path)
+    checkpoint_writer = new CheckpointWriter(checkpoint_path, kCheckpointProgram);
+
+  if (encoder_path)
+    encoder = new FrameEncoder(encoder_format, encoder_path, width, height, 1000000 / kRefreshPeriod);
+
+  if (publish_name)
+    publisher = new FramePublisher(publish_name, width, height);
+
+  if (headless_frames) {
+    scheduler = new FrameScheduler(nullptr, width, height, kRenderAheadFrames, kRefreshPeriod);
+    scheduler->set_encoder(encoder);
+    scheduler->set_publisher(publisher);
+    GoldenRecorder recorder(width, height);
+    headless_loop(headless_frames, &recorder);
+    delete encoder;
+    delete publisher;
+    if (profiler)
+      profiler->report();
+    return recorder.finish(golden_write_path, golden_compare_path, kCheckpointProgram, tolerance);
+  }
+
+  QApplication app(argc, argv);
+
+  display = new QtDisplay(width, height);
+  scheduler = new FrameScheduler(display, width, height, kRenderAheadFrames, kRefreshPeriod);
+  scheduler->set_encoder(encoder);
+  scheduler->set_publisher(publisher);
+  controller = new StepController(kRefreshPeriod);
+
+  paint_thread = new std::thread(paint_loop);
+
+  int ret = app.exec();
+  if (publisher)
+    publisher->unlink();
+  if (profiler) {
+    profiler->report();
+    printf("Achieved %.0f steps/s\n", controller->achieved_steps_per_second());
+  }
+  return ret;
+}
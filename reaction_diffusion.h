@@ -0,0 +1,206 @@
+#include <stddef.h>
+#include <algorithm>
+#include <cmath>
+
+#include "halo.h"
+#include "scalar.h"
+#include "thread_pool.h"
+
+#ifndef REACTION_DIFFUSION_H
+#define REACTION_DIFFUSION_H
+
+// Explicit reaction-diffusion engine shared by the 2D simulations.
+//
+// A model is a functor over kSpecies species. Given each species' value and
+// Laplacian at one cell, it returns their rates of change:
+//
+//   template <typename C>
+//   void operator()(const C* val, const C* laplacian, C* rate) const;
+//
+// The engine steps every species with val + dt*rate. Models inherit their
+// coefficients and dt from a parameter set P. Static constexpr members fold
+// into the kernel as constants; plain members are read at run time. The
+// same model code serves both.
+
+// kSpecies double buffered halo grids of S, one grid per species (structure
+// of arrays). The kernel's x loop is then unit stride for every species, so
+// it vectorizes without shuffles. Each species can also be checkpointed and
+// displayed as a plain grid. Grids are first touched by |pool|, see
+// alloc_halo_grid().
+template <typename S, int kSpecies>
+class SpeciesFields {
+public:
+  int width;
+  int height;
+  int stride;
+  S* current[kSpecies];
+  S* next[kSpecies];
+
+  SpeciesFields(int width, int height, ThreadPool* pool) {
+    this->width = width;
+    this->height = height;
+    stride = halo_stride(width);
+    for (int s = 0; s < kSpecies; s++) {
+      current[s] = alloc_halo_grid<S>(width, height, pool);
+      next[s] = alloc_halo_grid<S>(width, height, pool);
+    }
+  }
+
+  ~SpeciesFields() {
+    for (int s = 0; s < kSpecies; s++) {
+      free_halo_grid(current[s], width, height);
+      free_halo_grid(next[s], width, height);
+    }
+  }
+
+  void fill_halo(Boundary boundary) {
+    for (int s = 0; s < kSpecies; s++)
+      ::fill_halo(current[s], width, height, boundary);
+  }
+
+  void swap() {
+    for (int s = 0; s < kSpecies; s++)
+      std::swap(current[s], next[s]);
+  }
+};
+
+// Steps |cells| cells of one row of every species, starting |offset| cells
+// into each grid. The Laplacian is the gradient of the gradient, a 5-point
+// stencil of spacing 2, read straight out of the halo. Laplacians, reaction
+// and update are fused, so a species adds arithmetic but no extra sweep
+// over memory.
+//
+// kStride and kCells are compile-time in the specialized kernels, which
+// folds the neighbour offsets into the addressing and fixes the trip count.
+// A zero takes the run-time value instead. With kTrackChange it returns
+// whether any cell changed by more than |epsilon|, measured on the stored
+// values so an epsilon of 0 means exactly unchanged. Without it, it returns
+// false and the loop has no reduction at all.
+//
+// The change test is an OR of comparisons rather than a running maximum: a
+// floating point max reduction only vectorizes under fast math, an integer
+// OR always does.
+template <typename S, typename Model, int kStride, int kCells, bool kTrackChange>
+inline bool step_species_row(const SpeciesFields<S, Model::kSpecies>& fields, size_t offset, int cells,
+                             const Model& model, typename ScalarTraits<S>::compute_type epsilon = 0) {
+  typedef typename ScalarTraits<S>::compute_type C;
+  const int kSpecies = Model::kSpecies;
+  const int stride = kStride ? kStride : fields.stride;
+  if (kCells)
+    cells = kCells;
+  // A local copy can't alias the grids, so its run-time coefficients stay
+  // in registers.
+  const Model m = model;
+  C step = m.dt;
+
+  const S* rows[kSpecies];
+  S* next_rows[kSpecies];
+  for (int s = 0; s < kSpecies; s++) {
+    rows[s] = fields.current[s] + offset;
+    next_rows[s] = fields.next[s] + offset;
+  }
+
+  int changed = 0;
+  for (int x = 0; x < cells; x++) {
+    C val[kSpecies];
+    C laplacian[kSpecies];
+    C rate[kSpecies];
+#pragma GCC unroll 4
+    for (int s = 0; s < kSpecies; s++) {
+      const S* row = rows[s];
+      val[s] = row[x];
+      laplacian[s] = (C)row[x-2] + (C)row[x+2] + (C)row[x-2*stride] + (C)row[x+2*stride] - 4*val[s];
+    }
+    m(val, laplacian, rate);
+#pragma GCC unroll 4
+    for (int s = 0; s < kSpecies; s++) {
+      next_rows[s][x] = val[s] + step*rate[s];
+      if (kTrackChange)
+        changed |= std::abs((C)next_rows[s][x] - val[s]) > epsilon;
+    }
+  }
+  return changed;
+}
+
+// Plain diffusion of one species.
+template <typename P>
+struct DiffusionModel : P {
+  static const int kSpecies = 1;
+
+  DiffusionModel(const P& params = P()) : P(params) {}
+
+  template <typename C>
+  void operator()(const C*, const C* laplacian, C* rate) const {
+    C diffusion_coefficient = this->diffusion;
+    rate[0] = diffusion_coefficient*laplacian[0];
+  }
+};
+
+// Grey-Scott, u + 2v -> 3v. u is fed in at the replacement rate, and v is
+// removed at the replacement rate plus v_decay. Both species diffuse alike.
+template <typename P>
+struct GreyScottModel : P {
+  static const int kSpecies = 2;
+
+  GreyScottModel(const P& params = P()) : P(params) {}
+
+  template <typename C>
+  void operator()(const C* val, const C* laplacian, C* rate) const {
+    C diffusion_coefficient = this->diffusion;
+    C replacement_coefficient = this->replacement;
+    C v_decay = this->v_decay;
+    C reaction_coefficient = this->reaction;
+    C u_val = val[0];
+    C v_val = val[1];
+    C uvv = reaction_coefficient * u_val * v_val * v_val;
+    rate[0] = diffusion_coefficient*laplacian[0] - uvv + replacement_coefficient*(1 - u_val);
+    rate[1] = diffusion_coefficient*laplacian[1] + uvv - (replacement_coefficient + v_decay) * v_val;
+  }
+};
+
+// Brusselator, with activator u and inhibitor v. It rests at u = a,
+// v = b/a. Stripes and spots form where b is above the Turing threshold
+// (1 + a*sqrt(u_diffusion/v_diffusion))^2 and below the Hopf threshold
+// 1 + a^2.
+template <typename P>
+struct BrusselatorModel : P {
+  static const int kSpecies = 2;
+
+  BrusselatorModel(const P& params = P()) : P(params) {}
+
+  template <typename C>
+  void operator()(const C* val, const C* laplacian, C* rate) const {
+    C a = this->a;
+    C b = this->b;
+    C u_diffusion = this->u_diffusion;
+    C v_diffusion = this->v_diffusion;
+    C uuv = val[0] * val[0] * val[1];
+    rate[0] = u_diffusion*laplacian[0] + a - (b + 1)*val[0] + uuv;
+    rate[1] = v_diffusion*laplacian[1] + b*val[0] - uuv;
+  }
+};
+
+// FitzHugh-Nagumo, with the cubic activator u and the linear recovery
+// variable v. A fast diffusing v makes it a Turing system that settles into
+// labyrinths.
+template <typename P>
+struct FitzHughNagumoModel : P {
+  static const int kSpecies = 2;
+
+  FitzHughNagumoModel(const P& params = P()) : P(params) {}
+
+  template <typename C>
+  void operator()(const C* val, const C* laplacian, C* rate) const {
+    C u_diffusion = this->u_diffusion;
+    C v_diffusion = this->v_diffusion;
+    C epsilon = this->epsilon;
+    C a1 = this->a1;
+    C a0 = this->a0;
+    C u_val = val[0];
+    C v_val = val[1];
+    rate[0] = u_diffusion*laplacian[0] + u_val - u_val*u_val*u_val - v_val;
+    rate[1] = v_diffusion*laplacian[1] + epsilon*(u_val - a1*v_val - a0);
+  }
+};
+
+#endif
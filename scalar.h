@@ -0,0 +1,143 @@
+#include <stdint.h>
+#include <string.h>
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
+
+#ifndef SCALAR_H
+#define SCALAR_H
+
+// IEEE binary16 storage type. Arithmetic happens in float.
+struct Half {
+  uint16_t bits;
+
+  Half() {}
+  Half(float val) { bits = from_float(val); }
+  operator float() const { return to_float(bits); }
+
+  static uint16_t from_float(float val) {
+#ifdef __F16C__
+    return _cvtss_sh(val, 0);
+#else
+    uint32_t f;
+    memcpy(&f, &val, 4);
+    uint32_t sign = (f >> 16) & 0x8000;
+    int32_t exponent = ((f >> 23) & 0xFF) - 127 + 15;
+    uint32_t mantissa = f & 0x7FFFFF;
+
+    if (((f >> 23) & 0xFF) == 0xFF)
+      return sign | 0x7C00 | (mantissa ? 0x200 : 0);
+    if (exponent >= 0x1F)
+      return sign | 0x7C00;
+    if (exponent <= 0) {
+      if (exponent < -10)
+        return sign;
+      mantissa |= 0x800000;
+      int shift = 14 - exponent;
+      uint32_t half_mantissa = mantissa >> shift;
+      uint32_t remainder = mantissa & ((1 << shift) - 1);
+      uint32_t halfway = 1 << (shift - 1);
+      if (remainder > halfway || (remainder == halfway && (half_mantissa & 1)))
+        half_mantissa++;
+      return sign | half_mantissa;
+    }
+
+    uint32_t ret = sign | (exponent << 10) | (mantissa >> 13);
+    uint32_t remainder = mantissa & 0x1FFF;
+    if (remainder > 0x1000 || (remainder == 0x1000 && (ret & 1)))
+      ret++;
+    return ret;
+#endif
+  }
+
+  static float to_float(uint16_t h) {
+#ifdef __F16C__
+    return _cvtsh_ss(h);
+#else
+    uint32_t sign = (h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1F;
+    uint32_t mantissa = h & 0x3FF;
+    uint32_t f;
+
+    if (exponent == 0x1F) {
+      f = sign | 0x7F800000 | (mantissa << 13);
+    } else if (exponent) {
+      f = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+    } else if (mantissa) {
+      exponent = 127 - 15 + 1;
+      while (!(mantissa & 0x400)) {
+        mantissa <<= 1;
+        exponent--;
+      }
+      f = sign | (exponent << 23) | ((mantissa & 0x3FF) << 13);
+    } else {
+      f = sign;
+    }
+
+    float ret;
+    memcpy(&ret, &f, 4);
+    return ret;
+#endif
+  }
+};
+
+// bfloat16 storage type: the top half of a float, rounded to nearest even.
+struct BFloat16 {
+  uint16_t bits;
+
+  BFloat16() {}
+  BFloat16(float val) {
+    uint32_t f;
+    memcpy(&f, &val, 4);
+    if ((f & 0x7FFFFFFF) > 0x7F800000)
+      bits = (f >> 16) | 0x40;
+    else
+      bits = (f + 0x7FFF + ((f >> 16) & 1)) >> 16;
+  }
+  operator float() const {
+    uint32_t f = (uint32_t)bits << 16;
+    float ret;
+    memcpy(&ret, &f, 4);
+    return ret;
+  }
+};
+
+// Maps a storage type to the type kernels should do arithmetic in.
+template <typename S>
+struct ScalarTraits {
+  typedef S compute_type;
+};
+
+template <>
+struct ScalarTraits<Half> {
+  typedef float compute_type;
+};
+
+template <>
+struct ScalarTraits<BFloat16> {
+  typedef float compute_type;
+};
+
+enum class Precision {
+  kDouble,
+  kFloat,
+  kHalf,
+  kBFloat16,
+};
+
+inline bool parse_precision(const char* name, Precision& precision) {
+  if (!strcmp(name, "double"))
+    precision = Precision::kDouble;
+  else if (!strcmp(name, "float"))
+    precision = Precision::kFloat;
+  else if (!strcmp(name, "half"))
+    precision = Precision::kHalf;
+  else if (!strcmp(name, "bfloat16"))
+    precision = Precision::kBFloat16;
+  else
+    return false;
+
+  return true;
+}
+
+#endif
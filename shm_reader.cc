@@ -0,0 +1,203 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "frame_ring.h"
+#include "png_writer.h"
+
+// Reference reader for the frame ring the generators publish with -X. It
+// follows the latest frame, copying it out of the ring and checking it
+// wasn't overwritten meanwhile. It then hashes the copy, optionally writes
+// it out as a PNG, and reports frame rate, skipped frames and latency once
+// a second.
+
+const int kWaitTimeoutMs = 1000;
+
+struct Ring {
+  uint8_t* mapping;
+  size_t size;
+  ino_t inode;
+  const FrameRingHeader* header;
+};
+
+// Returns false while |name| doesn't exist or isn't fully set up yet.
+bool open_ring(const char* name, Ring& ring) {
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  if (fstat(fd, &st) || (size_t)st.st_size < sizeof(FrameRingHeader)) {
+    close(fd);
+    return false;
+  }
+  ring.size = st.st_size;
+  ring.inode = st.st_ino;
+  ring.mapping = (uint8_t*)mmap(nullptr, ring.size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (ring.mapping == MAP_FAILED)
+    return false;
+
+  ring.header = (const FrameRingHeader*)ring.mapping;
+  bool ready = !memcmp(ring.header->magic, kFrameRingMagic, sizeof(kFrameRingMagic));
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (ready && ring.header->version != kFrameRingVersion) {
+    printf("%s is frame ring version %u, expected %u\n", name, ring.header->version, kFrameRingVersion);
+    exit(-1);
+  }
+  if (!ready || ring.header->first_slot + (uint64_t)ring.header->num_slots*ring.header->slot_size > ring.size) {
+    munmap(ring.mapping, ring.size);
+    return false;
+  }
+
+  printf("Mapped %s: %ux%u, %u slots, writer pid %u\n", name, ring.header->width, ring.header->height,
+         ring.header->num_slots, ring.header->writer_pid);
+  return true;
+}
+
+void close_ring(Ring& ring) {
+  munmap(ring.mapping, ring.size);
+}
+
+// Whether |name| now names a different object than the one mapped, as
+// after the writer restarted.
+bool ring_replaced(const char* name, const Ring& ring) {
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0)
+    return true;
+  struct stat st;
+  bool replaced = fstat(fd, &st) || st.st_ino != ring.inode;
+  close(fd);
+  return replaced;
+}
+
+uint64_t hash_frame(const uint8_t* frame, size_t size) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= frame[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+void usage(const char* name) {
+  printf("Usage: %s [-n frames] [-o png_pattern] [-v] shm_name\n"
+         "Follows the frames a generator publishes with -X shm_name. -o writes every frame read as a\n"
+         "PNG named by a printf pattern such as frames/%%06d.png, -v prints each frame's hash.\n", name);
+  exit(-1);
+}
+
+int main(int argc, char** argv) {
+  int max_frames = 0;
+  const char* png_pattern = nullptr;
+  bool verbose = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:o:v")) != -1) {
+    switch (opt) {
+      case 'n':
+        max_frames = atoi(optarg);
+        break;
+      case 'o':
+        png_pattern = optarg;
+        break;
+      case 'v':
+        verbose = true;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (optind >= argc)
+    usage(argv[0]);
+  const char* name = argv[optind];
+
+  Ring ring;
+  while (!open_ring(name, ring))
+    usleep(100000);
+  // Rings are fixed size, but a replacement may have a different one.
+  size_t frame_size = (size_t)ring.header->stride*ring.header->height;
+  uint8_t* frame = (uint8_t*)malloc(frame_size);
+
+  int frames = 0;
+  uint64_t last_seq = 0;
+  uint64_t window_start = frame_ring_now_us();
+  int window_frames = 0;
+  uint64_t window_skipped = 0;
+  uint64_t window_torn = 0;
+  uint64_t window_latency_us = 0;
+
+  while (!max_frames || frames < max_frames) {
+    FrameRingHeader* header = (FrameRingHeader*)ring.header;
+    uint32_t notify = header->notify.load(std::memory_order_acquire);
+    uint64_t seq = header->latest.load(std::memory_order_acquire);
+
+    if (seq == last_seq) {
+      frame_ring_wait(&header->notify, notify, kWaitTimeoutMs);
+      if (header->latest.load(std::memory_order_acquire) == last_seq && ring_replaced(name, ring)) {
+        printf("%s was replaced, reopening\n", name);
+        close_ring(ring);
+        while (!open_ring(name, ring))
+          usleep(100000);
+        frame_size = (size_t)ring.header->stride*ring.header->height;
+        frame = (uint8_t*)realloc(frame, frame_size);
+        last_seq = 0;
+      }
+      continue;
+    }
+
+    const FrameRingSlot* slot = (const FrameRingSlot*)(ring.mapping + header->first_slot +
+                                                       (seq % header->num_slots)*header->slot_size);
+    const uint8_t* pixels = (const uint8_t*)slot + kFrameRingSlotHeaderSize;
+    if (slot->sequence.load(std::memory_order_acquire) != seq) {
+      window_torn++;
+      continue;
+    }
+
+    memcpy(frame, pixels, frame_size);
+    uint64_t latency_us = frame_ring_now_us() - slot->timestamp_us;
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot->sequence.load(std::memory_order_relaxed) != seq) {
+      // Overwritten while we were copying it.
+      window_torn++;
+      continue;
+    }
+
+    uint64_t hash = hash_frame(frame, frame_size);
+    if (png_pattern) {
+      char path[4096];
+      snprintf(path, sizeof(path), png_pattern, frames);
+      write_png_file(path, header->width, header->height, frame, PixelLayout::kRGB32);
+    }
+
+    if (verbose)
+      printf("frame %lu hash %016lx\n", (unsigned long)seq, (unsigned long)hash);
+    if (last_seq && seq > last_seq + 1)
+      window_skipped += seq - last_seq - 1;
+    last_seq = seq;
+    frames++;
+    window_frames++;
+    window_latency_us += latency_us;
+
+    uint64_t now = frame_ring_now_us();
+    if (now - window_start >= 1000000) {
+      printf("%.1f fps, %lu skipped, %lu torn, %.0f us mean latency\n", window_frames * 1e6 / (now - window_start),
+             (unsigned long)window_skipped, (unsigned long)window_torn, (double)window_latency_us / window_frames);
+      window_start = now;
+      window_frames = 0;
+      window_skipped = 0;
+      window_torn = 0;
+      window_latency_us = 0;
+    }
+  }
+
+  free(frame);
+  close_ring(ring);
+  return 0;
+}
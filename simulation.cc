@@ -0,0 +1,75 @@
+#include "simulation.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+
+static const int kBenchmarkRunSteps = 10;
+
+void compare_to_reference(Simulation* reference, Simulation* test, int width, int height,
+                          int steps, int report_interval) {
+  uint8_t* reference_buf = (uint8_t*)malloc(width*height*4);
+  uint8_t* test_buf = (uint8_t*)malloc(width*height*4);
+
+  for (int i = 1; i <= steps; i++) {
+    reference->step();
+    test->step();
+    if (i % report_interval && i != steps)
+      continue;
+
+    reference->render(reference_buf);
+    test->render(test_buf);
+
+    int max_diff = 0;
+    uint64_t total_diff = 0;
+    int mismatched = 0;
+    for (int p = 0; p < width*height; p++) {
+      bool mismatch = false;
+      for (int c = 0; c < 3; c++) {
+        int diff = abs(reference_buf[p*4+c] - test_buf[p*4+c]);
+        if (diff > max_diff)
+          max_diff = diff;
+        total_diff += diff;
+        mismatch |= diff != 0;
+      }
+      mismatched += mismatch;
+    }
+
+    printf("step %d: max diff %d, mean diff %.4f, mismatched pixels %.3f%%\n",
+           i, max_diff, (double)total_diff / (width*height*3), 100.0 * mismatched / (width*height));
+  }
+
+  free(reference_buf);
+  free(test_buf);
+}
+
+void benchmark_kernels(Simulation* specialized, Simulation* generic, int width, int height, int steps) {
+  Simulation* sims[2] = {specialized, generic};
+  const char* names[2] = {"specialized", "generic"};
+  double seconds[2] = {0, 0};
+
+  for (int done = 0; done < steps; done += kBenchmarkRunSteps) {
+    int run = std::min(kBenchmarkRunSteps, steps - done);
+    for (int i = 0; i < 2; i++) {
+      auto start = std::chrono::steady_clock::now();
+      for (int s = 0; s < run; s++)
+        sims[i]->step();
+      seconds[i] += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+  }
+
+  for (int i = 0; i < 2; i++)
+    printf("%-12s %9.3f ms/step\n", names[i], seconds[i] * 1000 / steps);
+  printf("speedup %.2fx\n", seconds[1] / seconds[0]);
+
+  uint8_t* bufs[2];
+  for (int i = 0; i < 2; i++) {
+    bufs[i] = (uint8_t*)malloc(width*height*4);
+    sims[i]->render(bufs[i]);
+  }
+  printf(memcmp(bufs[0], bufs[1], width*height*4) ? "Frames differ\n" : "Frames match\n");
+  free(bufs[0]);
+  free(bufs[1]);
+}
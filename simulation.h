@@ -0,0 +1,37 @@
+#include <stdint.h>
+
+#include "checkpoint.h"
+
+#ifndef SIMULATION_H
+#define SIMULATION_H
+
+// Common interface of the grid simulations, so the frame loop and tools
+// don't need to know the scalar type a simulation was instantiated with.
+class Simulation {
+public:
+  virtual ~Simulation() {}
+
+  // Advances the simulation by one time step.
+  virtual void step() = 0;
+  // Renders the current state into a width*height RGB32 frame.
+  virtual void render(uint8_t* buf) = 0;
+
+  // Adds the simulation state to an in-progress checkpoint.
+  virtual void save(CheckpointWriter* writer) = 0;
+  // Replaces the simulation state with the one in |reader|. Returns false if
+  // the checkpoint doesn't match this simulation's grid and scalar type.
+  virtual bool restore(const CheckpointReader& reader) = 0;
+};
+
+// Steps |test| and the double precision |reference| side by side and prints
+// how far the rendered frames diverge every |report_interval| steps.
+void compare_to_reference(Simulation* reference, Simulation* test, int width, int height,
+                          int steps, int report_interval);
+
+// Steps |specialized| and |generic|, which must start from the same state,
+// for |steps| steps each and reports the time per step of each and whether
+// their final frames match. They take turns in short runs, so clock speed
+// changes and other load affect both alike.
+void benchmark_kernels(Simulation* specialized, Simulation* generic, int width, int height, int steps);
+
+#endif
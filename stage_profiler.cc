@@ -0,0 +1,178 @@
+#include "stage_profiler.h"
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static const char* kEventNames[kNumProfileEvents] = {"cycles", "instructions", "LLC misses", "branch misses"};
+static const uint64_t kEventConfigs[kNumProfileEvents] = {
+  PERF_COUNT_HW_CPU_CYCLES,
+  PERF_COUNT_HW_INSTRUCTIONS,
+  // The generic cache miss event, which the kernel maps to last level
+  // cache misses on the CPUs that have one.
+  PERF_COUNT_HW_CACHE_MISSES,
+  PERF_COUNT_HW_BRANCH_MISSES,
+};
+static const int kCacheLineSize = 64;
+
+static int perf_event_open(perf_event_attr* attr, pid_t pid, int cpu, int group_fd, unsigned long flags) {
+  return syscall(SYS_perf_event_open, attr, pid, cpu, group_fd, flags);
+}
+
+StageProfiler::StageProfiler() {
+  for (int i = 0; i < kNumProfileEvents; i++) {
+    available[i] = false;
+    warned[i] = false;
+  }
+  current = -1;
+}
+
+StageProfiler::~StageProfiler() {
+  for (int fd : fds) {
+    if (fd >= 0)
+      close(fd);
+  }
+}
+
+void StageProfiler::open_counters(bool inherit) {
+  std::lock_guard<std::mutex> lock(mutex);
+  for (int i = 0; i < kNumProfileEvents; i++) {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = kEventConfigs[i];
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.inherit = inherit;
+    // User space only, which perf_event_paranoid 2 (the usual default)
+    // still allows for our own threads.
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    int fd = perf_event_open(&attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    if (fd < 0 && !warned[i]) {
+      if (errno == EACCES || errno == EPERM)
+        printf("Can't count %s, check /proc/sys/kernel/perf_event_paranoid\n", kEventNames[i]);
+      else
+        printf("Can't count %s (%s)\n", kEventNames[i], strerror(errno));
+      warned[i] = true;
+    }
+    if (fd >= 0)
+      available[i] = true;
+    fds.push_back(fd);
+  }
+}
+
+void StageProfiler::add_current_thread() {
+  open_counters(true);
+}
+
+void StageProfiler::add_pool(ThreadPool* pool) {
+  // Band i of a range of size() runs on worker i, so each worker adds
+  // itself exactly once.
+  pool->parallel_for(0, pool->size(), [this](int begin, int end) {
+    open_counters(false);
+  });
+}
+
+// Sums each event over all threads, scaled up for the time the kernel had
+// it multiplexed out.
+void StageProfiler::read_counts(uint64_t* counts) {
+  for (int i = 0; i < kNumProfileEvents; i++)
+    counts[i] = 0;
+
+  for (size_t i = 0; i < fds.size(); i++) {
+    if (fds[i] < 0)
+      continue;
+    uint64_t value[3];
+    if (read(fds[i], value, sizeof(value)) != sizeof(value) || !value[2])
+      continue;
+    counts[i % kNumProfileEvents] += (uint64_t)((double)value[0] * value[1] / value[2]);
+  }
+}
+
+void StageProfiler::begin(const char* name) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    current = -1;
+    for (size_t i = 0; i < stages.size(); i++) {
+      if (stages[i].name == name || !strcmp(stages[i].name, name))
+        current = i;
+    }
+    if (current < 0) {
+      Stage stage;
+      memset(&stage, 0, sizeof(stage));
+      stage.name = name;
+      stages.push_back(stage);
+      current = stages.size() - 1;
+    }
+  }
+
+  read_counts(start_counts);
+  start_time = std::chrono::high_resolution_clock::now();
+}
+
+void StageProfiler::end() {
+  auto end_time = std::chrono::high_resolution_clock::now();
+  uint64_t end_counts[kNumProfileEvents];
+  read_counts(end_counts);
+
+  std::lock_guard<std::mutex> lock(mutex);
+  Stage& stage = stages[current];
+  stage.calls++;
+  stage.wall_us += std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count();
+  for (int i = 0; i < kNumProfileEvents; i++) {
+    // Scaling can make a multiplexed count step backwards.
+    if (end_counts[i] > start_counts[i])
+      stage.counts[i] += end_counts[i] - start_counts[i];
+  }
+  current = -1;
+}
+
+void StageProfiler::report() {
+  std::lock_guard<std::mutex> lock(mutex);
+  printf("Stage profile over %zu threads (GB/s assumes every LLC miss moves one %d byte line):\n",
+         fds.size() / kNumProfileEvents, kCacheLineSize);
+  printf("%-12s %8s %10s %14s %6s %14s %9s %7s %12s\n", "stage", "calls", "ms/call", "Mcycles/call", "IPC",
+         "LLC miss/call", "LLC MPKI", "GB/s", "branch MPKI");
+
+  for (const Stage& stage : stages) {
+    if (!stage.calls)
+      continue;
+    double calls = stage.calls;
+    double cycles = stage.counts[kProfileCycles];
+    double instructions = stage.counts[kProfileInstructions];
+    double llc_misses = stage.counts[kProfileLlcMisses];
+    double branch_misses = stage.counts[kProfileBranchMisses];
+    printf("%-12s %8lu %10.3f", stage.name, (unsigned long)stage.calls, stage.wall_us / calls / 1000);
+
+    if (available[kProfileCycles])
+      printf(" %14.3f", cycles / calls / 1e6);
+    else
+      printf(" %14s", "-");
+    if (available[kProfileCycles] && available[kProfileInstructions] && cycles > 0)
+      printf(" %6.2f", instructions / cycles);
+    else
+      printf(" %6s", "-");
+    if (available[kProfileLlcMisses]) {
+      printf(" %14.0f", llc_misses / calls);
+      if (available[kProfileInstructions] && instructions > 0)
+        printf(" %9.3f", llc_misses * 1000 / instructions);
+      else
+        printf(" %9s", "-");
+      if (stage.wall_us)
+        printf(" %7.2f", llc_misses * kCacheLineSize / (stage.wall_us * 1e3));
+      else
+        printf(" %7s", "-");
+    } else {
+      printf(" %14s %9s %7s", "-", "-", "-");
+    }
+    if (available[kProfileBranchMisses] && available[kProfileInstructions] && instructions > 0)
+      printf(" %12.3f\n", branch_misses * 1000 / instructions);
+    else
+      printf(" %12s\n", "-");
+  }
+}
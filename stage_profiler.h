@@ -0,0 +1,86 @@
+#include <stdint.h>
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+#include "thread_pool.h"
+
+#ifndef STAGE_PROFILER_H
+#define STAGE_PROFILER_H
+
+enum ProfileEvent {
+  kProfileCycles,
+  kProfileInstructions,
+  kProfileLlcMisses,
+  kProfileBranchMisses,
+  kNumProfileEvents,
+};
+
+// Reads hardware counters (via perf_event_open) around the named stages of
+// a frame loop and prints a per-stage summary. Counters are opened per
+// thread; every stage is charged with the counts of all added threads over
+// its span, so work a stage hands to pool workers or to threads it spawns
+// is charged to that stage. Stages must not overlap.
+//
+// Where the kernel refuses counters (perf_event_paranoid, VMs without a
+// PMU) only wall time is reported.
+class StageProfiler {
+private:
+  struct Stage {
+    const char* name;
+    uint64_t calls;
+    uint64_t wall_us;
+    uint64_t counts[kNumProfileEvents];
+  };
+
+  // One fd per event per thread, -1 where the event couldn't be opened.
+  std::vector<int> fds;
+  bool available[kNumProfileEvents];
+  bool warned[kNumProfileEvents];
+  std::vector<Stage> stages;
+  std::mutex mutex;
+
+  int current;
+  uint64_t start_counts[kNumProfileEvents];
+  std::chrono::high_resolution_clock::time_point start_time;
+
+  void open_counters(bool inherit);
+  void read_counts(uint64_t* counts);
+
+public:
+  StageProfiler();
+  ~StageProfiler();
+
+  // Counts the calling thread and, from now on, threads it creates. Created
+  // threads' counts are folded in as they exit, so stages should join the
+  // threads they spawn.
+  void add_current_thread();
+  // Counts every worker of |pool|.
+  void add_pool(ThreadPool* pool);
+
+  // Stages are identified by |name|, which must outlive the profiler, and
+  // are reported in order of first use.
+  void begin(const char* name);
+  void end();
+
+  void report();
+};
+
+// Profiles the enclosing scope as stage |name|. |profiler| may be null.
+class StageScope {
+private:
+  StageProfiler* profiler;
+
+public:
+  StageScope(StageProfiler* profiler, const char* name) {
+    this->profiler = profiler;
+    if (profiler)
+      profiler->begin(name);
+  }
+  ~StageScope() {
+    if (profiler)
+      profiler->end();
+  }
+};
+
+#endif
@@ -0,0 +1,65 @@
+#include "step_controller.h"
+
+#include <math.h>
+
+// Only use this fraction of the budget, to leave headroom for jitter.
+static const double kBudgetFill = 0.8;
+static const double kCostSmoothing = 0.1;
+static const int kMaxStepsPerFrame = 10000;
+
+StepController::StepController(int frame_budget) {
+  this->frame_budget = frame_budget;
+  step_cost = 0;
+  render_cost = 0;
+  steps_per_frame = 1;
+  frame_periods = 1;
+
+  window_start = std::chrono::high_resolution_clock::now();
+  window_steps = 0;
+  steps_per_second = 0;
+}
+
+void StepController::update_plan() {
+  if (step_cost <= 0)
+    return;
+
+  double budget = frame_budget * kBudgetFill;
+  double step_budget = budget - render_cost;
+  int steps = step_budget > 0 ? (int)(step_budget / step_cost) : 0;
+
+  if (steps >= 1) {
+    steps_per_frame = steps < kMaxStepsPerFrame ? steps : kMaxStepsPerFrame;
+    frame_periods = 1;
+  } else {
+    steps_per_frame = 1;
+    frame_periods = (int)ceil((step_cost + render_cost) / budget);
+  }
+}
+
+void StepController::record_steps(int steps, int64_t microseconds) {
+  double cost = (double)microseconds / steps;
+  if (step_cost <= 0)
+    step_cost = cost;
+  else
+    step_cost += kCostSmoothing * (cost - step_cost);
+
+  window_steps += steps;
+  auto curr_time = std::chrono::high_resolution_clock::now();
+  auto window = std::chrono::duration_cast<std::chrono::microseconds>(curr_time - window_start);
+  if (window.count() >= 1000000) {
+    steps_per_second = window_steps * 1e6 / window.count();
+    window_start = curr_time;
+    window_steps = 0;
+  }
+
+  update_plan();
+}
+
+void StepController::record_render(int64_t microseconds) {
+  if (render_cost <= 0)
+    render_cost = microseconds;
+  else
+    render_cost += kCostSmoothing * (microseconds - render_cost);
+
+  update_plan();
+}
@@ -0,0 +1,43 @@
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+
+#ifndef STEP_CONTROLLER_H
+#define STEP_CONTROLLER_H
+
+// Picks how many simulation steps to run per displayed frame so that
+// stepping plus rendering fills the frame budget. Costs are tracked as
+// moving averages of measured wall time. If even a single step overflows
+// the budget, each frame is instead held on screen for several refresh
+// periods, so the display slows down evenly rather than lagging.
+class StepController {
+private:
+  int frame_budget;
+  double step_cost;
+  double render_cost;
+
+  int steps_per_frame;
+  int frame_periods;
+
+  std::chrono::high_resolution_clock::time_point window_start;
+  uint64_t window_steps;
+  std::atomic<double> steps_per_second;
+
+  void update_plan();
+
+public:
+  // |frame_budget| is in microseconds.
+  StepController(int frame_budget);
+
+  int steps() const { return steps_per_frame; }
+  // Number of refresh periods the next frame should stay on screen.
+  int periods() const { return frame_periods; }
+
+  void record_steps(int steps, int64_t microseconds);
+  void record_render(int64_t microseconds);
+
+  // Steps actually run per second of wall time, over the last full second.
+  double achieved_steps_per_second() const { return steps_per_second; }
+};
+
+#endif
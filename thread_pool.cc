@@ -0,0 +1,184 @@
+#include "thread_pool.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+bool parse_thread_pinning(const char* name, ThreadPinning& pinning) {
+  if (!strcmp(name, "none"))
+    pinning = ThreadPinning::kNone;
+  else if (!strcmp(name, "cpu"))
+    pinning = ThreadPinning::kCpu;
+  else if (!strcmp(name, "node"))
+    pinning = ThreadPinning::kNode;
+  else
+    return false;
+  return true;
+}
+
+// Parses a sysfs CPU list such as "0-7,16-23".
+static std::vector<int> parse_cpu_list(const char* list) {
+  std::vector<int> cpus;
+  const char* p = list;
+  while (*p >= '0' && *p <= '9') {
+    char* end;
+    int first = strtol(p, &end, 10);
+    int last = first;
+    if (*end == '-')
+      last = strtol(end + 1, &end, 10);
+    for (int cpu = first; cpu <= last; cpu++)
+      cpus.push_back(cpu);
+    p = *end == ',' ? end + 1 : end;
+  }
+  return cpus;
+}
+
+// The CPUs of each NUMA node that this process may run on, leaving out
+// nodes with none. Without NUMA information, all of them as one node.
+static std::vector<std::vector<int>> node_cpus() {
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  sched_getaffinity(0, sizeof(allowed), &allowed);
+
+  std::vector<std::vector<int>> nodes;
+  for (int node = 0; ; node++) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    FILE* f = fopen(path, "r");
+    if (!f)
+      break;
+    char list[4096] = "";
+    if (!fgets(list, sizeof(list), f))
+      list[0] = 0;
+    fclose(f);
+
+    std::vector<int> cpus;
+    for (int cpu : parse_cpu_list(list)) {
+      if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))
+        cpus.push_back(cpu);
+    }
+    if (!cpus.empty())
+      nodes.push_back(cpus);
+  }
+
+  if (nodes.empty()) {
+    nodes.emplace_back();
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &allowed))
+        nodes.back().push_back(cpu);
+    }
+  }
+  return nodes;
+}
+
+ThreadPool::ThreadPool(int num_threads, ThreadPinning pinning) {
+  if (num_threads <= 0)
+    num_threads = std::thread::hardware_concurrency();
+  if (num_threads <= 0)
+    num_threads = 1;
+
+  num_workers = num_threads;
+  task = nullptr;
+  task_begin = 0;
+  task_end = 0;
+  generation = 0;
+  pending = 0;
+  stopping = false;
+
+  for (int i = 0; i < num_threads; i++)
+    workers.emplace_back(&ThreadPool::worker_loop, this, i);
+  // Before any task runs, so grids the pool first touches land on the
+  // nodes that will work on them.
+  if (pinning != ThreadPinning::kNone)
+    pin_workers(pinning);
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    stopping = true;
+  }
+  work_ready.notify_all();
+
+  for (std::thread& worker : workers)
+    worker.join();
+}
+
+void ThreadPool::pin_workers(ThreadPinning pinning) {
+  std::vector<std::vector<int>> nodes = node_cpus();
+  std::vector<int> cpus;
+  std::vector<int> cpu_node;
+  for (size_t node = 0; node < nodes.size(); node++) {
+    for (int cpu : nodes[node]) {
+      cpus.push_back(cpu);
+      cpu_node.push_back(node);
+    }
+  }
+  if (pinning == ThreadPinning::kCpu && num_workers > (int)cpus.size())
+    printf("%d workers on %zu CPUs, some will share\n", num_workers, cpus.size());
+
+  for (int i = 0; i < num_workers; i++) {
+    int idx = (int)((int64_t)i*cpus.size()/num_workers);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (pinning == ThreadPinning::kCpu) {
+      CPU_SET(cpus[idx], &set);
+    } else {
+      for (int cpu : nodes[cpu_node[idx]])
+        CPU_SET(cpu, &set);
+    }
+    int err = pthread_setaffinity_np(workers[i].native_handle(), sizeof(set), &set);
+    if (err) {
+      printf("Can't pin worker %d: %s\n", i, strerror(err));
+      return;
+    }
+  }
+  printf("Pinned %d workers to %s over %zu nodes\n", num_workers,
+         pinning == ThreadPinning::kCpu ? "CPUs" : "nodes", nodes.size());
+}
+
+void ThreadPool::worker_loop(int idx) {
+  uint64_t seen_generation = 0;
+
+  while (1) {
+    const std::function<void(int, int)>* fn;
+    int begin, end;
+    {
+      std::unique_lock<std::mutex> lock(pool_mutex);
+      work_ready.wait(lock, [&] { return generation != seen_generation || stopping; });
+      if (stopping)
+        return;
+      seen_generation = generation;
+      fn = task;
+      int64_t len = task_end - task_begin;
+      begin = task_begin + len*idx/num_workers;
+      end = task_begin + len*(idx+1)/num_workers;
+    }
+
+    if (begin < end)
+      (*fn)(begin, end);
+
+    {
+      std::lock_guard<std::mutex> lock(pool_mutex);
+      pending--;
+    }
+    work_done.notify_one();
+  }
+}
+
+void ThreadPool::parallel_for(int begin, int end, const std::function<void(int, int)>& fn) {
+  std::lock_guard<std::mutex> dispatch_lock(dispatch_mutex);
+
+  std::unique_lock<std::mutex> lock(pool_mutex);
+  task = &fn;
+  task_begin = begin;
+  task_end = end;
+  pending = num_workers;
+  generation++;
+  work_ready.notify_all();
+
+  work_done.wait(lock, [this] { return pending == 0; });
+  task = nullptr;
+}
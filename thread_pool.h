@@ -0,0 +1,60 @@
+#include <stdint.h>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+// Where workers are allowed to run. Pinned workers are spread evenly over
+// the CPUs the process may use, taken node by node, so neighbouring bands
+// share a node and a pool smaller than the machine still uses every node.
+enum class ThreadPinning {
+  // Wherever the scheduler puts them.
+  kNone,
+  // Each worker on one CPU.
+  kCpu,
+  // Each worker on the CPUs of one NUMA node, free to move within it.
+  kNode,
+};
+
+bool parse_thread_pinning(const char* name, ThreadPinning& pinning);
+
+// Fixed set of worker threads for data-parallel loops over grid rows.
+class ThreadPool {
+private:
+  int num_workers;
+  std::vector<std::thread> workers;
+
+  std::mutex dispatch_mutex;
+  std::mutex pool_mutex;
+  std::condition_variable work_ready;
+  std::condition_variable work_done;
+
+  const std::function<void(int, int)>* task;
+  int task_begin;
+  int task_end;
+  uint64_t generation;
+  int pending;
+  bool stopping;
+
+  void worker_loop(int idx);
+  void pin_workers(ThreadPinning pinning);
+
+public:
+  // Defaults to one worker per hardware thread.
+  ThreadPool(int num_threads = 0, ThreadPinning pinning = ThreadPinning::kNone);
+  ~ThreadPool();
+
+  int size() const { return num_workers; }
+
+  // Splits [begin, end) into size() contiguous bands and blocks until all
+  // of them have run. Band i always runs on worker i, so data first touched
+  // by a band stays with the same thread from call to call. Must not be
+  // called from inside a task.
+  void parallel_for(int begin, int end, const std::function<void(int, int)>& fn);
+};
+
+#endif